@@ -1,4 +1,4 @@
-int LLAMA_BUILD_NUMBER = 9;
-char const *LLAMA_COMMIT = "17aea4b";
-char const *LLAMA_COMPILER = "MSVC 19.40.33811.0";
-char const *LLAMA_BUILD_TARGET = "x64";
+int LLAMA_BUILD_NUMBER = 26;
+char const *LLAMA_COMMIT = "f4f3562";
+char const *LLAMA_COMPILER = "cc (Debian 12.2.0-14+deb12u1) 12.2.0";
+char const *LLAMA_BUILD_TARGET = "x86_64-linux-gnu";
@@ -357,6 +357,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.prompt_cache_ro = true;
         return true;
     }
+    if (arg == "--prompt-cache-compact") {
+        params.prompt_cache_compact = true;
+        return true;
+    }
     if (arg == "-bf" || arg == "--binary-file") {
         CHECK_ARG
         std::ifstream file(argv[i], std::ios::binary);
@@ -730,6 +734,16 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.image.emplace_back(argv[i]);
         return true;
     }
+    if (arg == "--image-cache-dir") {
+        CHECK_ARG
+        params.image_cache_dir = argv[i];
+        return true;
+    }
+    if (arg == "--image-cache-size") {
+        CHECK_ARG
+        params.image_cache_size = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-i" || arg == "--interactive") {
         params.interactive = true;
         return true;
@@ -747,6 +761,16 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.embd_normalize = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "--embd-type") {
+        CHECK_ARG
+        std::string value(argv[i]);
+        /**/ if (value == "f32")    { params.embd_type = LLAMA_EMBD_TYPE_F32; }
+        else if (value == "f16")    { params.embd_type = LLAMA_EMBD_TYPE_F16; }
+        else if (value == "int8")   { params.embd_type = LLAMA_EMBD_TYPE_INT8; }
+        else if (value == "binary") { params.embd_type = LLAMA_EMBD_TYPE_BINARY; }
+        else { invalid_param = true; }
+        return true;
+    }
     if (arg == "--embd-output-format") {
         CHECK_ARG
         params.embd_out = argv[i];
@@ -894,6 +918,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.use_mmap = false;
         return true;
     }
+    if (arg == "--moe-budget") {
+        CHECK_ARG
+        params.moe_budget = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--numa") {
         CHECK_ARG
         std::string value(argv[i]);
@@ -1190,6 +1219,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.endpoint_metrics = true;
         return true;
     }
+    if (arg == "--profile") {
+        params.endpoint_profile = true;
+        return true;
+    }
+    if (arg == "--dynamic-slots") {
+        params.dynamic_slots = true;
+        return true;
+    }
     if (arg == "--slot-save-path") {
         CHECK_ARG
         params.slot_save_path = argv[i];
@@ -1210,6 +1247,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.chat_template = argv[i];
         return true;
     }
+    if (arg == "--prefill-budget") {
+        CHECK_ARG
+        params.n_prefill_budget = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--slot-prompt-similarity" || arg == "-sps") {
         CHECK_ARG
         params.slot_prompt_similarity = std::stof(argv[i]);
@@ -1435,6 +1477,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "main",        "       --prompt-cache-all",     "if specified, saves user input and generations to cache as well\n"
                                                                         "not supported with --interactive or other interactive options" });
     options.push_back({ "main",        "       --prompt-cache-ro",      "if specified, uses the prompt cache but does not update it" });
+    options.push_back({ "main",        "       --prompt-cache-compact", "if specified, saves the prompt cache in the compact format with a Q8_0 KV cache" });
     options.push_back({ "main",        "-r,    --reverse-prompt PROMPT",
                                                                         "halt generation at PROMPT, return control in interactive mode\n"
                                                                         "can be specified more than once for multiple prompts" });
@@ -1542,6 +1585,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "multi-modality" });
     options.push_back({ "*",           "       --mmproj FILE",          "path to a multimodal projector file for LLaVA. see examples/llava/README.md" });
     options.push_back({ "*",           "       --image FILE",           "path to an image file. use with multimodal models. Specify multiple times for batching" });
+    options.push_back({ "*",           "       --image-cache-dir DIR",  "directory to store the image embeddings in, so that they are reused across runs (default: none)" });
+    options.push_back({ "*",           "       --image-cache-size N",   "size of the in-memory image embedding cache in MiB, 0 = disabled (default: %d)", params.image_cache_size });
 
     options.push_back({ "backend" });
     options.push_back({ "*",           "       --rpc SERVERS",          "comma separated list of RPC servers" });
@@ -1551,6 +1596,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     }
     if (llama_supports_mmap()) {
         options.push_back({ "*",           "       --no-mmap",              "do not memory-map model (slower load but may reduce pageouts if not using mlock)" });
+        options.push_back({ "*",           "       --moe-budget N",         "page the expert weights of MoE models in and out of a memory budget of N MiB (default: %d, 0 = no limit)", params.moe_budget });
     }
     options.push_back({ "*",           "       --numa TYPE",            "attempt optimizations that help on some NUMA systems\n"
                                                                         "  - distribute: spread execution evenly over all nodes\n"
@@ -1624,6 +1670,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
 
     options.push_back({ "embedding" });
     options.push_back({ "embedding",   "       --embd-normalize",       "normalisation for embendings (default: %d) (-1=none, 0=max absolute int16, 1=taxicab, 2=euclidean, >2=p-norm)", params.embd_normalize });
+    options.push_back({ "embedding",   "       --embd-type {f32,f16,int8,binary}",
+                                                                        "type of the pooled embeddings, computed in the graph (default: f32)" });
     options.push_back({ "embedding",   "       --embd-output-format",   "empty = default, \"array\" = [[],[]...], \"json\" = openai style, \"json+\" = same \"json\" + cosine similarity matrix" });
     options.push_back({ "embedding",   "       --embd-separator",       "separator of embendings (default \\n) for example \"<#sep#>\"" });
 
@@ -1638,13 +1686,17 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --ssl-cert-file FNAME",  "path to file a PEM-encoded SSL certificate" });
     options.push_back({ "server",      "       --timeout N",            "server read/write timeout in seconds (default: %d)", params.timeout_read });
     options.push_back({ "server",      "       --threads-http N",       "number of threads used to process HTTP requests (default: %d)", params.n_threads_http });
+    options.push_back({ "server",      "       --prefill-budget N",     "max number of prompt tokens per batch while other slots are generating (default: %d, -1 = batch size)", params.n_prefill_budget });
     options.push_back({ "server",      "       --system-prompt-file FNAME",
                                                                         "set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications" });
     options.push_back({ "server",      "       --log-format {text,json}",
                                                                         "log output format: json or text (default: json)" });
     options.push_back({ "server",      "       --metrics",              "enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --profile",              "record the time spent in each op on the CPU, served by the /profile endpoint (default: %s)", params.endpoint_profile ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --no-slots",             "disables slots monitoring endpoint (default: %s)", params.endpoint_slots ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --slot-save-path PATH",  "path to save slot kv cache (default: disabled)" });
+    options.push_back({ "server",      "       --dynamic-slots",        "slots share the whole context instead of n_ctx/n_parallel each, new prompts are admitted based on\n"
+                                                                        "the free KV cells and slots are swapped out to host memory when the KV cache is full (default: %s)", params.dynamic_slots ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --chat-template JINJA_TEMPLATE",
                                                                         "set custom jinja chat template (default: template taken from model's metadata)\n"
                                                                         "only commonly used templates are accepted:\n"
@@ -2146,6 +2198,7 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.moe_budget      = (size_t) params.moe_budget * 1024 * 1024;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -2206,6 +2259,8 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.yarn_beta_slow    = params.yarn_beta_slow;
     cparams.yarn_orig_ctx     = params.yarn_orig_ctx;
     cparams.pooling_type      = params.pooling_type;
+    cparams.embd_type         = params.embd_type;
+    cparams.embd_normalize    = params.embd_normalize == 2;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
     cparams.cb_eval           = params.cb_eval;
@@ -2625,6 +2680,28 @@ std::vector<llama_token> llama_tokenize(
     return result;
 }
 
+std::vector<llama_token> llama_tokenize_parallel(
+  const struct llama_context * ctx,
+           const std::string & text,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    const llama_model * model = llama_get_model(ctx);
+
+    // upper limit for the number of tokens
+    int n_tokens = text.length() + 2 * add_special;
+    std::vector<llama_token> result(n_tokens);
+    n_tokens = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
+    if (n_tokens < 0) {
+        result.resize(-n_tokens);
+        int check = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_tokens);
+    } else {
+        result.resize(n_tokens);
+    }
+    return result;
+}
+
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     std::string piece;
     piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
@@ -2823,6 +2900,16 @@ void llama_kv_cache_dump_view_seqs(const llama_kv_cache_view & view, int row_siz
     printf("\n=== Done dumping\n");
 }
 
+//
+// Profiling utils
+//
+
+std::string llama_profiler_report(const struct ggml_profiler * prof, enum ggml_profile_format format) {
+    std::vector<char> buf(ggml_profiler_report(prof, format, nullptr, 0) + 1);
+    ggml_profiler_report(prof, format, buf.data(), buf.size());
+    return std::string(buf.data());
+}
+
 //
 // Embedding utils
 //
@@ -3177,6 +3264,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "mlock: %s # default: false\n", params.use_mlock ? "true" : "false");
     fprintf(stream, "model: %s # default: %s\n", params.model.c_str(), DEFAULT_MODEL_PATH);
     fprintf(stream, "model_draft: %s # default:\n", params.model_draft.c_str());
+    fprintf(stream, "moe_budget: %d # default: 0\n", params.moe_budget);
     fprintf(stream, "multiline_input: %s # default: false\n", params.multiline_input ? "true" : "false");
     fprintf(stream, "n_gpu_layers: %d # default: -1\n", params.n_gpu_layers);
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
@@ -3190,6 +3278,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "prompt_cache: %s\n", params.path_prompt_cache.c_str());
     fprintf(stream, "prompt_cache_all: %s # default: false\n", params.prompt_cache_all ? "true" : "false");
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
+    fprintf(stream, "prompt_cache_compact: %s # default: false\n", params.prompt_cache_compact ? "true" : "false");
     yaml_dump_vector_int(stream, "prompt_tokens", prompt_tokens);
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
 
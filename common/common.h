@@ -90,6 +90,7 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t moe_budget            =     0; // memory budget for the MoE expert weights in MiB (0 = no limit)
 
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void * cb_eval_user_data                 = nullptr;
@@ -159,6 +160,7 @@ struct gpt_params {
     bool conversation      = false; // conversation mode (does not print special tokens and suffix/prefix)
     bool prompt_cache_all  = false; // save user input and generations to prompt cache
     bool prompt_cache_ro   = false; // open the prompt cache read-only and do not update it
+    bool prompt_cache_compact = false; // save the prompt cache with a Q8_0 K/V cache
 
     bool escape            = true;  // escape "\n", "\r", "\t", "\'", "\"", and "\\"
     bool multiline_input   = false; // reverse the usage of `\`
@@ -185,18 +187,22 @@ struct gpt_params {
     // multimodal models (see examples/llava)
     std::string mmproj = "";        // path to multimodal projector
     std::vector<std::string> image; // path to image file(s)
+    std::string image_cache_dir = "";  // directory to store the image embeddings in
+    int32_t image_cache_size    = 256; // size of the in-memory image embedding cache in MiB (0 = disabled)
 
     // embedding
     bool embedding         = false; // get only sentence embedding
     int32_t embd_normalize = 2;     // normalisation for embendings (-1=none, 0=max absolute int16, 1=taxicab, 2=euclidean, >2=p-norm)
+    enum llama_embd_type embd_type = LLAMA_EMBD_TYPE_F32; // type of the pooled embeddings
     std::string embd_out   = "";    // empty = default, "array" = [[],[]...], "json" = openai style, "json+" = same "json" + cosine similarity matrix
     std::string embd_sep   = "\n";  // separator of embendings
 
     // server params
-    int32_t port           = 8080;         // server listens on this network port
-    int32_t timeout_read   = 600;          // http read timeout in seconds
-    int32_t timeout_write  = timeout_read; // http write timeout in seconds
-    int32_t n_threads_http = -1;           // number of threads to process HTTP requests
+    int32_t port             = 8080;         // server listens on this network port
+    int32_t timeout_read     = 600;          // http read timeout in seconds
+    int32_t timeout_write    = timeout_read; // http write timeout in seconds
+    int32_t n_threads_http   = -1;           // number of threads to process HTTP requests
+    int32_t n_prefill_budget = -1;           // max prompt tokens per batch while other slots are generating (-1 = n_batch)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";
@@ -211,6 +217,9 @@ struct gpt_params {
 
     bool endpoint_slots   = true;
     bool endpoint_metrics = false;
+    bool endpoint_profile = false;
+
+    bool dynamic_slots = false; // slots share the whole context and are swapped out to host memory when the KV cache is full
 
     bool log_json = false;
 
@@ -345,6 +354,14 @@ std::vector<llama_token> llama_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// same as llama_tokenize, but large texts are tokenized in chunks on n_threads threads
+std::vector<llama_token> llama_tokenize_parallel(
+  const struct llama_context * ctx,
+           const std::string & text,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string llama_token_to_piece(
@@ -406,6 +423,13 @@ void llama_kv_cache_dump_view(const llama_kv_cache_view & view, int row_size = 8
 // Dump the KV cache view showing individual sequences in each cell (long output).
 void llama_kv_cache_dump_view_seqs(const llama_kv_cache_view & view, int row_size = 40);
 
+//
+// Profiling utils
+//
+
+// CPP wrapper for ggml_profiler_report
+std::string llama_profiler_report(const struct ggml_profiler * prof, enum ggml_profile_format format);
+
 //
 // Embedding utils
 //
@@ -0,0 +1,578 @@
+// CPU microbenchmark of the ggml ops used by the llama models, on the shapes of a model
+//
+// The shapes are read from the header of a GGUF file (no tensor data is loaded), or taken from a preset. Each op is
+// run for every combination of weight type, batch size, KV length and thread count, and the achieved GB/s and
+// GFLOP/s are reported against the peak of the machine, in a table and as JSON for regression tracking.
+
+#include "common.h"
+#include "ggml.h"
+
+// Change JSON_ASSERT from assert() to GGML_ASSERT:
+#define JSON_ASSERT GGML_ASSERT
+#include "json.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+using json = nlohmann::ordered_json;
+
+// the dimensions of a model that determine the shapes of its ops
+struct model_shape {
+    std::string name;
+    int64_t n_embd;
+    int64_t n_head;
+    int64_t n_head_kv;
+    int64_t n_ff;
+    int64_t n_rot;
+    int64_t n_vocab;
+    float   norm_eps;
+
+    int64_t n_embd_head() const { return n_embd / n_head; }
+};
+
+// Llama 3 8B
+static const model_shape model_shape_default = {
+    /* .name      = */ "llama 8B (preset)",
+    /* .n_embd    = */ 4096,
+    /* .n_head    = */ 32,
+    /* .n_head_kv = */ 8,
+    /* .n_ff      = */ 14336,
+    /* .n_rot     = */ 128,
+    /* .n_vocab   = */ 128256,
+    /* .norm_eps  = */ 1e-5f,
+};
+
+struct bench_ops_params {
+    std::string model;
+    std::vector<std::string> ops = { "mul_mat", "flash_attn_ext", "soft_max", "rope", "rms_norm" };
+    std::vector<ggml_type> types = { GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0, GGML_TYPE_Q4_K };
+    std::vector<int> n_tokens    = { 1, 32, 512 };
+    std::vector<int> n_kv        = { 512, 4096 };
+    std::vector<int> n_threads   = { cpu_get_num_math() };
+    double peak_gbps   = 0.0; // 0 = measure
+    double peak_gflops = 0.0; // 0 = unknown
+    double min_time    = 0.1; // s per case
+    std::string output;
+};
+
+static std::string string_join(const std::vector<std::string> & values, const std::string & delim) {
+    std::string str;
+    for (size_t i = 0; i < values.size(); i++) {
+        str += values[i];
+        if (i < values.size() - 1) {
+            str += delim;
+        }
+    }
+    return str;
+}
+
+static void print_usage(int /* argc */, char ** argv) {
+    const bench_ops_params def;
+
+    printf("usage: %s [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help\n");
+    printf("  -m, --model <filename>              read the shapes from the header of a GGUF model (default: %s)\n", model_shape_default.name.c_str());
+    printf("  --ops <op1,op2,..>                  ops or mul_mat weights to run (default: %s)\n", string_join(def.ops, ",").c_str());
+    printf("  -q, --types <t1,t2,..>              weight types of mul_mat (default: f16,q8_0,q4_0,q4_K)\n");
+    printf("  -b, --n-tokens <n>                  tokens in the batch (default: 1,32,512)\n");
+    printf("  -kv, --n-kv <n>                     KV cache length of the attention ops (default: 512,4096)\n");
+    printf("  -t, --threads <n>                   (default: %d)\n", def.n_threads[0]);
+    printf("  --peak-gbps <x>                     memory bandwidth of the machine in GB/s (default: measured)\n");
+    printf("  --peak-gflops <x>                   compute peak of the machine in GFLOP/s (default: unknown)\n");
+    printf("  --min-time <s>                      minimum run time of each case (default: %.1f)\n", def.min_time);
+    printf("  -o, --output <filename>             write the results as JSON\n");
+    printf("\n");
+    printf("Multiple values can be given for each list by separating them with ','.\n");
+}
+
+static ggml_type ggml_type_from_name(const std::string & s) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char * name = ggml_type_name((ggml_type) i);
+        if (name && s == name) {
+            return (ggml_type) i;
+        }
+    }
+    return GGML_TYPE_COUNT;
+}
+
+static bool parse_params(int argc, char ** argv, bench_ops_params & params) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        } else if ((arg == "-m" || arg == "--model") && has_value) {
+            params.model = argv[++i];
+        } else if (arg == "--ops" && has_value) {
+            params.ops = string_split<std::string>(argv[++i], ',');
+        } else if ((arg == "-q" || arg == "--types") && has_value) {
+            params.types.clear();
+            for (const auto & name : string_split<std::string>(argv[++i], ',')) {
+                const ggml_type type = ggml_type_from_name(name);
+                if (type == GGML_TYPE_COUNT || ggml_quantize_requires_imatrix(type) || ggml_blck_size(type) == 0) {
+                    fprintf(stderr, "error: unsupported type: %s\n", name.c_str());
+                    return false;
+                }
+                params.types.push_back(type);
+            }
+        } else if ((arg == "-b" || arg == "--n-tokens") && has_value) {
+            params.n_tokens = string_split<int>(argv[++i], ',');
+        } else if ((arg == "-kv" || arg == "--n-kv") && has_value) {
+            params.n_kv = string_split<int>(argv[++i], ',');
+        } else if ((arg == "-t" || arg == "--threads") && has_value) {
+            params.n_threads = string_split<int>(argv[++i], ',');
+        } else if (arg == "--peak-gbps" && has_value) {
+            params.peak_gbps = std::stod(argv[++i]);
+        } else if (arg == "--peak-gflops" && has_value) {
+            params.peak_gflops = std::stod(argv[++i]);
+        } else if (arg == "--min-time" && has_value) {
+            params.min_time = std::stod(argv[++i]);
+        } else if ((arg == "-o" || arg == "--output") && has_value) {
+            params.output = argv[++i];
+        } else {
+            fprintf(stderr, "error: invalid argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool load_model_shape(const std::string & fname, model_shape & shape) {
+    gguf_init_params gparams = {
+        /* .no_alloc = */ true,
+        /* .ctx      = */ NULL,
+    };
+    gguf_context * ctx = gguf_init_from_file(fname.c_str(), gparams);
+    if (!ctx) {
+        fprintf(stderr, "error: failed to read %s\n", fname.c_str());
+        return false;
+    }
+
+    const int kid_arch = gguf_find_key(ctx, "general.architecture");
+    if (kid_arch < 0) {
+        fprintf(stderr, "error: %s has no architecture\n", fname.c_str());
+        gguf_free(ctx);
+        return false;
+    }
+    const std::string arch = gguf_get_val_str(ctx, kid_arch);
+
+    // integer hyperparameters, 0 if missing or per layer
+    auto get_u32 = [&](const std::string & key) -> int64_t {
+        const int kid = gguf_find_key(ctx, (arch + "." + key).c_str());
+        if (kid < 0) {
+            return 0;
+        }
+        switch (gguf_get_kv_type(ctx, kid)) {
+            case GGUF_TYPE_UINT32: return gguf_get_val_u32(ctx, kid);
+            case GGUF_TYPE_INT32:  return gguf_get_val_i32(ctx, kid);
+            default:               return 0;
+        }
+    };
+
+    shape.name      = fname;
+    shape.n_embd    = get_u32("embedding_length");
+    shape.n_head    = get_u32("attention.head_count");
+    shape.n_head_kv = get_u32("attention.head_count_kv");
+    shape.n_ff      = get_u32("feed_forward_length");
+    shape.n_rot     = get_u32("rope.dimension_count");
+    shape.norm_eps  = 1e-5f;
+
+    if (shape.n_head_kv == 0) {
+        shape.n_head_kv = shape.n_head;
+    }
+    if (shape.n_rot == 0 && shape.n_head > 0) {
+        shape.n_rot = shape.n_embd / shape.n_head;
+    }
+
+    const int kid_eps = gguf_find_key(ctx, (arch + ".attention.layer_norm_rms_epsilon").c_str());
+    if (kid_eps >= 0) {
+        shape.norm_eps = gguf_get_val_f32(ctx, kid_eps);
+    }
+
+    const int kid_vocab = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+    shape.n_vocab = kid_vocab >= 0 ? gguf_get_arr_n(ctx, kid_vocab) : 0;
+
+    gguf_free(ctx);
+
+    if (shape.n_embd == 0 || shape.n_head == 0 || shape.n_ff == 0) {
+        fprintf(stderr, "error: %s: unsupported architecture %s, the head count and the feed forward length must not be per layer\n", fname.c_str(), arch.c_str());
+        return false;
+    }
+
+    shape.name = arch + " " + fname.substr(fname.find_last_of("/\\") + 1);
+
+    return true;
+}
+
+// one op on one shape
+struct bench_case {
+    std::string op;
+    std::string name;  // mul_mat: the weight, e.g. ffn_up
+    ggml_type   type;  // type of the weights or of the KV cache
+    int         n_tokens;
+    int         n_kv;  // attention ops only
+
+    // builds the op in ctx and returns it, with the bytes moved and the nominal number of flops
+    std::function<ggml_tensor * (ggml_context * ctx, double & bytes, double & flops)> build;
+};
+
+static std::vector<bench_case> get_bench_cases(const bench_ops_params & params, const model_shape & m) {
+    std::vector<bench_case> cases;
+
+    auto enabled = [&](const std::string & name) {
+        return std::find(params.ops.begin(), params.ops.end(), name) != params.ops.end();
+    };
+
+    const int64_t n_embd_head = m.n_embd_head();
+    const int64_t n_embd_q    = n_embd_head*m.n_head;
+    const int64_t n_embd_kv   = n_embd_head*m.n_head_kv;
+
+    // weights of a layer and of the output, [n_in, n_out]
+    struct weight { const char * name; int64_t n_in; int64_t n_out; };
+    std::vector<weight> weights = {
+        { "attn_q",      m.n_embd, n_embd_q  },
+        { "attn_kv",     m.n_embd, n_embd_kv },
+        { "attn_output", n_embd_q, m.n_embd  },
+        { "ffn_up",      m.n_embd, m.n_ff    },
+        { "ffn_down",    m.n_ff,   m.n_embd  },
+    };
+    if (m.n_vocab > 0) {
+        weights.push_back({ "output", m.n_embd, m.n_vocab });
+    }
+
+    for (const int n_tokens : params.n_tokens) {
+        for (const auto & w : weights) {
+            if (!enabled("mul_mat") && !enabled(w.name)) {
+                continue;
+            }
+            for (const ggml_type type : params.types) {
+                if (w.n_in % ggml_blck_size(type) != 0) {
+                    continue;
+                }
+                const weight ww = w;
+                cases.push_back({ "mul_mat", w.name, type, n_tokens, 0,
+                    [ww, type, n_tokens](ggml_context * ctx, double & bytes, double & flops) {
+                        ggml_tensor * a = ggml_new_tensor_2d(ctx, type, ww.n_in, ww.n_out);
+                        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ww.n_in, n_tokens);
+                        ggml_tensor * out = ggml_mul_mat(ctx, a, b);
+                        bytes = ggml_nbytes(a) + ggml_nbytes(b) + ggml_nbytes(out);
+                        flops = 2.0*ww.n_in*ww.n_out*n_tokens;
+                        return out;
+                    }});
+            }
+        }
+
+        for (const int n_kv : params.n_kv) {
+            const float scale = 1.0f/sqrtf(n_embd_head);
+
+            if (enabled("flash_attn_ext")) {
+                cases.push_back({ "flash_attn_ext", "", GGML_TYPE_F16, n_tokens, n_kv,
+                    [=](ggml_context * ctx, double & bytes, double & flops) {
+                        ggml_tensor * q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_tokens, m.n_head);
+                        ggml_tensor * k    = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_embd_head, n_kv, m.n_head_kv);
+                        ggml_tensor * v    = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_embd_head, n_kv, m.n_head_kv);
+                        ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+                        ggml_tensor * out  = ggml_flash_attn_ext(ctx, q, k, v, mask, scale, 0.0f);
+                        bytes = ggml_nbytes(q) + ggml_nbytes(k) + ggml_nbytes(v) + ggml_nbytes(mask) + ggml_nbytes(out);
+                        flops = 4.0*n_embd_head*n_kv*n_tokens*m.n_head; // KQ and KQV
+                        return out;
+                    }});
+            }
+
+            // the attention without flash attention
+            if (enabled("soft_max")) {
+                cases.push_back({ "soft_max", "", GGML_TYPE_F32, n_tokens, n_kv,
+                    [=](ggml_context * ctx, double & bytes, double & flops) {
+                        ggml_tensor * kq   = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, n_tokens, m.n_head);
+                        ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+                        ggml_tensor * out  = ggml_soft_max_ext(ctx, kq, mask, scale, 0.0f);
+                        bytes = ggml_nbytes(kq) + ggml_nbytes(kq)/m.n_head + ggml_nbytes(out);
+                        flops = 5.0*ggml_nelements(kq); // scale, mask, max, exp, normalize
+                        return out;
+                    }});
+            }
+        }
+
+        if (enabled("rope")) {
+            cases.push_back({ "rope", "", GGML_TYPE_F32, n_tokens, 0,
+                [=](ggml_context * ctx, double & bytes, double & flops) {
+                    ggml_tensor * x   = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, m.n_head, n_tokens);
+                    ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+                    ggml_tensor * out = ggml_rope_ext(ctx, x, pos, nullptr, m.n_rot, 0, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 32.0f, 1.0f);
+                    bytes = ggml_nbytes(x) + ggml_nbytes(pos) + ggml_nbytes(out);
+                    flops = 3.0*m.n_rot*m.n_head*n_tokens; // 6 per rotated pair
+                    return out;
+                }});
+        }
+
+        if (enabled("rms_norm")) {
+            cases.push_back({ "rms_norm", "", GGML_TYPE_F32, n_tokens, 0,
+                [=](ggml_context * ctx, double & bytes, double & flops) {
+                    ggml_tensor * x   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, m.n_embd, n_tokens);
+                    ggml_tensor * out = ggml_rms_norm(ctx, x, m.norm_eps);
+                    bytes = ggml_nbytes(x) + ggml_nbytes(out);
+                    flops = 3.0*ggml_nelements(x); // square, sum, scale
+                    return out;
+                }});
+        }
+    }
+
+    return cases;
+}
+
+static void init_tensor_random(ggml_tensor * t, std::mt19937 & rng) {
+    const int64_t n = ggml_nelements(t);
+
+    if (t->type == GGML_TYPE_I32) {
+        std::uniform_int_distribution<int32_t> dist(0, 4095);
+        for (int64_t i = 0; i < n; i++) {
+            ((int32_t *) t->data)[i] = dist(rng);
+        }
+        return;
+    }
+
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(n);
+    for (auto & x : data) {
+        x = dist(rng);
+    }
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, data.data(), n*sizeof(float));
+    } else {
+        ggml_quantize_chunk(t->type, data.data(), t->data, 0, n/t->ne[0], t->ne[0], nullptr);
+    }
+}
+
+static void graph_compute(std::vector<uint8_t> & work, ggml_cgraph * gf, int n_threads) {
+    ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+    if (plan.work_size > 0) {
+        work.resize(plan.work_size);
+        plan.work_data = work.data();
+    }
+    ggml_graph_compute(gf, &plan);
+}
+
+struct bench_result {
+    double t_us;   // median time of a run
+    double bytes;
+    double flops;
+};
+
+static bool run_case(const bench_case & bc, int n_threads, double min_time, std::vector<uint8_t> & work, bench_result & res) {
+    // size the context for the tensors of the case
+    size_t mem_size = 0;
+    {
+        ggml_init_params iparams = { ggml_tensor_overhead()*16 + ggml_graph_overhead(), NULL, true };
+        ggml_context * ctx = ggml_init(iparams);
+        double bytes, flops;
+        bc.build(ctx, bytes, flops);
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+            mem_size += GGML_PAD(ggml_nbytes(t), GGML_MEM_ALIGN) + ggml_tensor_overhead();
+        }
+        ggml_free(ctx);
+    }
+
+    ggml_init_params iparams = { mem_size + ggml_graph_overhead() + 1024*1024, NULL, false };
+    ggml_context * ctx = ggml_init(iparams);
+    if (!ctx) {
+        return false;
+    }
+
+    ggml_tensor * out = bc.build(ctx, res.bytes, res.flops);
+
+    std::mt19937 rng(42);
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->op == GGML_OP_NONE) {
+            init_tensor_random(t, rng);
+        }
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    // warmup, and the number of runs per sample so that a sample is well above the resolution of the timer
+    int n_runs = 1;
+    while (true) {
+        const int64_t t0 = ggml_time_us();
+        for (int i = 0; i < n_runs; i++) {
+            graph_compute(work, gf, n_threads);
+        }
+        if (ggml_time_us() - t0 >= 1000 || n_runs >= 1024) {
+            break;
+        }
+        n_runs *= 2;
+    }
+
+    std::vector<double> times;
+    const int64_t t_start = ggml_time_us();
+    while (times.size() < 3 || (ggml_time_us() - t_start < min_time*1e6 && times.size() < 1000)) {
+        const int64_t t0 = ggml_time_us();
+        for (int i = 0; i < n_runs; i++) {
+            graph_compute(work, gf, n_threads);
+        }
+        times.push_back((double) (ggml_time_us() - t0) / n_runs);
+    }
+
+    std::sort(times.begin(), times.end());
+    res.t_us = times[times.size()/2];
+
+    ggml_free(ctx);
+
+    return true;
+}
+
+// memory bandwidth of the machine, from a copy larger than the caches
+static double measure_peak_gbps(int n_threads) {
+    const int64_t n = 64*1024*1024; // 256 MiB per tensor
+
+    ggml_init_params iparams = { 2*n*sizeof(float) + 4*ggml_tensor_overhead() + ggml_graph_overhead() + 1024*1024, NULL, false };
+    ggml_context * ctx = ggml_init(iparams);
+    if (!ctx) {
+        return 0.0;
+    }
+
+    ggml_tensor * src = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+    ggml_tensor * dst = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+    memset(src->data, 0, ggml_nbytes(src));
+    memset(dst->data, 0, ggml_nbytes(dst));
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, ggml_cpy(ctx, src, dst));
+
+    std::vector<uint8_t> work;
+    double best_us = 1e30;
+    for (int i = 0; i < 5; i++) {
+        const int64_t t0 = ggml_time_us();
+        graph_compute(work, gf, n_threads);
+        best_us = std::min(best_us, (double) (ggml_time_us() - t0));
+    }
+
+    ggml_free(ctx);
+
+    return 2.0*n*sizeof(float) / best_us / 1e3;
+}
+
+int main(int argc, char ** argv) {
+    bench_ops_params params;
+    if (!parse_params(argc, argv, params)) {
+        return 1;
+    }
+
+    ggml_time_init();
+
+    model_shape shape = model_shape_default;
+    if (!params.model.empty() && !load_model_shape(params.model, shape)) {
+        return 1;
+    }
+
+    const int n_threads_max = *std::max_element(params.n_threads.begin(), params.n_threads.end());
+
+    if (params.peak_gbps <= 0.0) {
+        params.peak_gbps = measure_peak_gbps(n_threads_max);
+        fprintf(stderr, "%s: measured memory bandwidth: %.1f GB/s\n", __func__, params.peak_gbps);
+    }
+
+    fprintf(stderr, "%s: %s: n_embd = %" PRId64 ", n_head = %" PRId64 ", n_head_kv = %" PRId64 ", n_ff = %" PRId64 ", n_vocab = %" PRId64 "\n",
+            __func__, shape.name.c_str(), shape.n_embd, shape.n_head, shape.n_head_kv, shape.n_ff, shape.n_vocab);
+
+    const std::vector<bench_case> cases = get_bench_cases(params, shape);
+
+    printf("| %-14s | %-11s | %-5s | %8s | %6s | %7s | %12s | %9s | %9s | %7s | %6s | %6s |\n",
+            "op", "weight", "type", "n_tokens", "n_kv", "threads", "us/run", "GB/s", "GFLOP/s", "FLOP/B", "%bw", "%flops");
+    printf("| %-14s | %-11s | %-5s | %8s | %6s | %7s | %12s | %9s | %9s | %7s | %6s | %6s |\n",
+            "--------------", "-----------", "-----", "-------:", "-----:", "------:", "-----------:", "--------:", "--------:", "------:", "-----:", "-----:");
+
+    json results = json::array();
+    std::vector<uint8_t> work;
+
+    for (const auto & bc : cases) {
+        for (const int n_threads : params.n_threads) {
+            bench_result res;
+            if (!run_case(bc, n_threads, params.min_time, work, res)) {
+                fprintf(stderr, "%s: failed to allocate %s %s %s\n", __func__, bc.op.c_str(), bc.name.c_str(), ggml_type_name(bc.type));
+                continue;
+            }
+
+            const double gbps      = res.bytes / res.t_us / 1e3;
+            const double gflops    = res.flops / res.t_us / 1e3;
+            const double intensity = res.flops / res.bytes;
+
+            // the roofline: the op is bound by the memory below the ridge point and by the compute above it
+            const double pct_bw    = 100.0*gbps/params.peak_gbps;
+            const double pct_flops = params.peak_gflops > 0.0 ? 100.0*gflops/params.peak_gflops : 0.0;
+
+            printf("| %-14s | %-11s | %-5s | %8d | %6d | %7d | %12.2f | %9.2f | %9.2f | %7.2f | %6.1f | %6s |\n",
+                    bc.op.c_str(), bc.name.c_str(), ggml_type_name(bc.type), bc.n_tokens, bc.n_kv, n_threads,
+                    res.t_us, gbps, gflops, intensity, pct_bw,
+                    params.peak_gflops > 0.0 ? std::to_string((int) std::round(pct_flops)).c_str() : "-");
+            fflush(stdout);
+
+            results.push_back({
+                {"op",         bc.op},
+                {"weight",     bc.name},
+                {"type",       ggml_type_name(bc.type)},
+                {"n_tokens",   bc.n_tokens},
+                {"n_kv",       bc.n_kv},
+                {"n_threads",  n_threads},
+                {"t_us",       res.t_us},
+                {"bytes",      res.bytes},
+                {"flops",      res.flops},
+                {"gbps",       gbps},
+                {"gflops",     gflops},
+                {"intensity",  intensity},
+                {"pct_bw",     pct_bw},
+                {"pct_flops",  params.peak_gflops > 0.0 ? json(pct_flops) : json(nullptr)},
+            });
+        }
+    }
+
+    if (!params.output.empty()) {
+        const json report = {
+            {"build_commit", LLAMA_COMMIT},
+            {"build_number", LLAMA_BUILD_NUMBER},
+            {"system_info",  llama_print_system_info()},
+            {"model",        {
+                {"name",      shape.name},
+                {"n_embd",    shape.n_embd},
+                {"n_head",    shape.n_head},
+                {"n_head_kv", shape.n_head_kv},
+                {"n_ff",      shape.n_ff},
+                {"n_rot",     shape.n_rot},
+                {"n_vocab",   shape.n_vocab},
+            }},
+            {"peak_gbps",    params.peak_gbps},
+            {"peak_gflops",  params.peak_gflops > 0.0 ? json(params.peak_gflops) : json(nullptr)},
+            {"ridge_point",  params.peak_gflops > 0.0 ? json(params.peak_gflops/params.peak_gbps) : json(nullptr)},
+            {"results",      results},
+        };
+
+        std::ofstream fout(params.output);
+        if (!fout) {
+            fprintf(stderr, "%s: failed to open %s\n", __func__, params.output.c_str());
+            return 1;
+        }
+        fout << report.dump(4) << std::endl;
+        fprintf(stderr, "%s: wrote %zu results to %s\n", __func__, results.size(), params.output.c_str());
+    }
+
+    return 0;
+}
@@ -30,7 +30,7 @@ static void batch_add_seq(llama_batch & batch, const std::vector<int32_t> & toke
     }
 }
 
-static void batch_decode(llama_context * ctx, llama_batch & batch, float * output, int n_seq, int n_embd, int embd_norm) {
+static void batch_decode(llama_context * ctx, llama_batch & batch, float * output, int n_seq, int n_embd, int embd_norm, enum llama_embd_type embd_type) {
     // clear previous kv_cache values (irrelevant for embeddings)
     llama_kv_cache_clear(ctx);
 
@@ -46,11 +46,38 @@ static void batch_decode(llama_context * ctx, llama_batch & batch, float * outpu
         }
 
         // try to get sequence embeddings - supported only when pooling_type is not NONE
-        const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
+        const void * embd = llama_get_embeddings_seq_data(ctx, batch.seq_id[i][0]);
         GGML_ASSERT(embd != NULL && "failed to get sequence embeddings");
 
         float * out = output + batch.seq_id[i][0] * n_embd;
-        llama_embd_normalize(embd, out, n_embd, embd_norm);
+
+        // the euclidean norm is applied in the graph, INT8 and BINARY are printed as they are
+        switch (embd_type) {
+            case LLAMA_EMBD_TYPE_F32:
+                {
+                    std::copy((const float *) embd, (const float *) embd + n_embd, out);
+                } break;
+            case LLAMA_EMBD_TYPE_F16:
+                {
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) embd, out, n_embd);
+                } break;
+            case LLAMA_EMBD_TYPE_INT8:
+                {
+                    for (int j = 0; j < n_embd; j++) {
+                        out[j] = ((const int8_t *) embd)[j];
+                    }
+                } break;
+            case LLAMA_EMBD_TYPE_BINARY:
+                {
+                    for (int j = 0; j < n_embd; j++) {
+                        out[j] = (((const uint8_t *) embd)[j/8] >> (j%8)) & 1;
+                    }
+                } break;
+        }
+
+        if (embd_norm != 2 && (embd_type == LLAMA_EMBD_TYPE_F32 || embd_type == LLAMA_EMBD_TYPE_F16)) {
+            llama_embd_normalize(out, out, n_embd, embd_norm);
+        }
     }
 }
 
@@ -170,7 +197,7 @@ int main(int argc, char ** argv) {
         // encode if at capacity
         if (batch.n_tokens + n_toks > n_batch) {
             float * out = emb + p * n_embd;
-            batch_decode(ctx, batch, out, s, n_embd, params.embd_normalize);
+            batch_decode(ctx, batch, out, s, n_embd, params.embd_normalize, params.embd_type);
             llama_batch_clear(batch);
             p += s;
             s = 0;
@@ -183,7 +210,10 @@ int main(int argc, char ** argv) {
 
     // final batch
     float * out = emb + p * n_embd;
-    batch_decode(ctx, batch, out, s, n_embd, params.embd_normalize);
+    batch_decode(ctx, batch, out, s, n_embd, params.embd_normalize, params.embd_type);
+
+    // integer values are printed without decimals
+    const bool embd_int = params.embd_normalize == 0 || params.embd_type == LLAMA_EMBD_TYPE_INT8 || params.embd_type == LLAMA_EMBD_TYPE_BINARY;
 
     if (params.embd_out.empty()) {
         // print the first part of the embeddings or for a single prompt, the full embedding
@@ -191,7 +221,7 @@ int main(int argc, char ** argv) {
         for (int j = 0; j < n_prompts; j++) {
             fprintf(stdout, "embedding %d: ", j);
             for (int i = 0; i < (n_prompts > 1 ? std::min(16, n_embd) : n_embd); i++) {
-                if (params.embd_normalize == 0) {
+                if (embd_int) {
                     fprintf(stdout, "%6.0f ", emb[j * n_embd + i]);
                 } else {
                     fprintf(stdout, "%9.6f ", emb[j * n_embd + i]);
@@ -227,7 +257,7 @@ int main(int argc, char ** argv) {
             if (notArray) fprintf(stdout, "    {\n      \"object\": \"embedding\",\n      \"index\": %d,\n      \"embedding\": ",j);
             fprintf(stdout, "[");
             for (int i = 0;;) { // at least one iteration (n_embd > 0)
-                fprintf(stdout, params.embd_normalize == 0 ? "%1.0f" : "%1.7f", emb[j * n_embd + i]);
+                fprintf(stdout, embd_int ? "%1.0f" : "%1.7f", emb[j * n_embd + i]);
                 i++;
                 if (i < n_embd) fprintf(stdout, ","); else break;
             }
@@ -171,11 +171,33 @@ static std::string pair_str(const std::pair<int, int> & p) {
     return buf;
 }
 
+// n_seq sequences generating n_gen tokens each, one token per sequence in each decode step
+struct parallel_test {
+    int n_seq;
+    int n_depth;        // tokens in the KV cache of each sequence before the test
+    int n_gen;
+    int n_chunk;        // prompt tokens of another sequence added to each decode step (chunked prefill)
+    bool shared_prefix; // the n_depth tokens are a prefix shared by all the sequences
+};
+
+static std::string parallel_str(const parallel_test & p) {
+    static char buf[64];
+    if (p.shared_prefix) {
+        snprintf(buf, sizeof(buf), "px:%d,%d,%d", p.n_seq, p.n_depth, p.n_gen);
+    } else if (p.n_chunk > 0) {
+        snprintf(buf, sizeof(buf), "pm:%d,%d,%d,%d", p.n_seq, p.n_depth, p.n_gen, p.n_chunk);
+    } else {
+        snprintf(buf, sizeof(buf), "pd:%d,%d,%d", p.n_seq, p.n_depth, p.n_gen);
+    }
+    return buf;
+}
+
 struct cmd_params {
     std::vector<std::string> model;
     std::vector<int> n_prompt;
     std::vector<int> n_gen;
     std::vector<std::pair<int, int>> n_pg;
+    std::vector<parallel_test> parallel;
     std::vector<int> n_batch;
     std::vector<int> n_ubatch;
     std::vector<ggml_type> type_k;
@@ -193,6 +215,7 @@ struct cmd_params {
     ggml_numa_strategy numa;
     int reps;
     bool verbose;
+    std::string profile;
     output_formats output_format;
     output_formats output_format_stderr;
 };
@@ -202,6 +225,7 @@ static const cmd_params cmd_params_defaults = {
     /* n_prompt             */ {512},
     /* n_gen                */ {128},
     /* n_pg                 */ {},
+    /* parallel             */ {},
     /* n_batch              */ {2048},
     /* n_ubatch             */ {512},
     /* type_k               */ {GGML_TYPE_F16},
@@ -219,6 +243,7 @@ static const cmd_params cmd_params_defaults = {
     /* numa                 */ GGML_NUMA_STRATEGY_DISABLED,
     /* reps                 */ 5,
     /* verbose              */ false,
+    /* profile              */ "",
     /* output_format        */ MARKDOWN,
     /* output_format_stderr */ NONE,
 };
@@ -232,6 +257,9 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -p, --n-prompt <n>                  (default: %s)\n", join(cmd_params_defaults.n_prompt, ",").c_str());
     printf("  -n, --n-gen <n>                     (default: %s)\n", join(cmd_params_defaults.n_gen, ",").c_str());
     printf("  -pg <pp,tg>                         (default: %s)\n", join(transform_to_str(cmd_params_defaults.n_pg, pair_str), ",").c_str());
+    printf("  -pd <n_seq,depth,tg>                parallel decode of n_seq sequences at depth (default: %s)\n", join(transform_to_str(cmd_params_defaults.parallel, parallel_str), ",").c_str());
+    printf("  -pm <n_seq,depth,tg,chunk>          parallel decode with a prompt chunk of another sequence in each step\n");
+    printf("  -px <n_seq,prefix,tg>               parallel decode of n_seq sequences sharing a prefix\n");
     printf("  -b, --batch-size <n>                (default: %s)\n", join(cmd_params_defaults.n_batch, ",").c_str());
     printf("  -ub, --ubatch-size <n>              (default: %s)\n", join(cmd_params_defaults.n_ubatch, ",").c_str());
     printf("  -ctk, --cache-type-k <t>            (default: %s)\n", join(transform_to_str(cmd_params_defaults.type_k, ggml_type_name), ",").c_str());
@@ -251,6 +279,7 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -o, --output <csv|json|md|sql>      (default: %s)\n", output_format_str(cmd_params_defaults.output_format));
     printf("  -oe, --output-err <csv|json|md|sql> (default: %s)\n", output_format_str(cmd_params_defaults.output_format_stderr));
     printf("  -v, --verbose                       (default: %s)\n", cmd_params_defaults.verbose ? "1" : "0");
+    printf("  -prof, --profile <filename>         print the time spent in each op on the CPU and write a Chrome trace of each test to <filename> (default: disabled)\n");
     printf("\n");
     printf("Multiple values can be given for each parameter by separating them with ',' or by specifying the parameter multiple times.\n");
 }
@@ -294,6 +323,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.output_format_stderr = cmd_params_defaults.output_format_stderr;
     params.reps = cmd_params_defaults.reps;
     params.numa = cmd_params_defaults.numa;
+    params.profile = cmd_params_defaults.profile;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -336,6 +366,17 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 break;
             }
             params.n_pg.push_back({std::stoi(p[0]), std::stoi(p[1])});
+        } else if (arg == "-pd" || arg == "-pm" || arg == "-px") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = string_split<int>(argv[i], ',');
+            if (p.size() != (arg == "-pm" ? 4u : 3u) || p[0] < 1 || p[1] < 0 || p[2] < 1 || (arg == "-pm" && p[3] < 1)) {
+                invalid_param = true;
+                break;
+            }
+            params.parallel.push_back({p[0], p[1], p[2], arg == "-pm" ? p[3] : 0, arg == "-px"});
         } else if (arg == "-b" || arg == "--batch-size") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -511,6 +552,12 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             invalid_param = !output_format_from_str(argv[i], params.output_format_stderr);
         } else if (arg == "-v" || arg == "--verbose") {
             params.verbose = true;
+        } else if (arg == "-prof" || arg == "--profile") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.profile = argv[i];
         } else {
             invalid_param = true;
             break;
@@ -527,6 +574,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.n_prompt.empty())     { params.n_prompt = cmd_params_defaults.n_prompt; }
     if (params.n_gen.empty())        { params.n_gen = cmd_params_defaults.n_gen; }
     if (params.n_pg.empty())         { params.n_pg = cmd_params_defaults.n_pg; }
+    if (params.parallel.empty())     { params.parallel = cmd_params_defaults.parallel; }
     if (params.n_batch.empty())      { params.n_batch = cmd_params_defaults.n_batch; }
     if (params.n_ubatch.empty())     { params.n_ubatch = cmd_params_defaults.n_ubatch; }
     if (params.type_k.empty())       { params.type_k = cmd_params_defaults.type_k; }
@@ -549,6 +597,11 @@ struct cmd_params_instance {
     std::string model;
     int n_prompt;
     int n_gen;
+    bool parallel;
+    int n_seq;
+    int n_depth;
+    int n_chunk;
+    bool shared_prefix;
     int n_batch;
     int n_ubatch;
     ggml_type type_k;
@@ -592,7 +645,13 @@ struct cmd_params_instance {
     llama_context_params to_llama_cparams() const {
         llama_context_params cparams = llama_context_default_params();
 
-        cparams.n_ctx = n_prompt + n_gen;
+        if (parallel) {
+            const int n_kv_seq = shared_prefix ? n_gen : n_depth + n_gen;
+            cparams.n_ctx = (shared_prefix ? n_depth : 0) + n_seq*n_kv_seq + n_chunk*n_gen;
+            cparams.n_seq_max = n_seq + (n_chunk > 0 ? 1 : 0);
+        } else {
+            cparams.n_ctx = n_prompt + n_gen;
+        }
         cparams.n_batch = n_batch;
         cparams.n_ubatch = n_ubatch;
         cparams.type_k = type_k;
@@ -632,6 +691,11 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .model        = */ m,
                 /* .n_prompt     = */ n_prompt,
                 /* .n_gen        = */ 0,
+                /* .parallel     = */ false,
+                /* .n_seq        = */ 1,
+                /* .n_depth      = */ 0,
+                /* .n_chunk      = */ 0,
+                /* .shared_prefix= */ false,
                 /* .n_batch      = */ nb,
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
@@ -658,6 +722,11 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .model        = */ m,
                 /* .n_prompt     = */ 0,
                 /* .n_gen        = */ n_gen,
+                /* .parallel     = */ false,
+                /* .n_seq        = */ 1,
+                /* .n_depth      = */ 0,
+                /* .n_chunk      = */ 0,
+                /* .shared_prefix= */ false,
                 /* .n_batch      = */ nb,
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
@@ -684,6 +753,39 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .model        = */ m,
                 /* .n_prompt     = */ n_pg.first,
                 /* .n_gen        = */ n_pg.second,
+                /* .parallel     = */ false,
+                /* .n_seq        = */ 1,
+                /* .n_depth      = */ 0,
+                /* .n_chunk      = */ 0,
+                /* .shared_prefix= */ false,
+                /* .n_batch      = */ nb,
+                /* .n_ubatch     = */ nub,
+                /* .type_k       = */ tk,
+                /* .type_v       = */ tv,
+                /* .n_threads    = */ nt,
+                /* .n_gpu_layers = */ nl,
+                /* .rpc_servers  = */ rpc,
+                /* .split_mode   = */ sm,
+                /* .main_gpu     = */ mg,
+                /* .no_kv_offload= */ nkvo,
+                /* .flash_attn   = */ fa,
+                /* .tensor_split = */ ts,
+                /* .use_mmap     = */ mmp,
+                /* .embeddings   = */ embd,
+            };
+            instances.push_back(instance);
+        }
+
+        for (const auto & pt : params.parallel) {
+            cmd_params_instance instance = {
+                /* .model        = */ m,
+                /* .n_prompt     = */ 0,
+                /* .n_gen        = */ pt.n_gen,
+                /* .parallel     = */ true,
+                /* .n_seq        = */ pt.n_seq,
+                /* .n_depth      = */ pt.n_depth,
+                /* .n_chunk      = */ pt.n_chunk,
+                /* .shared_prefix= */ pt.shared_prefix,
                 /* .n_batch      = */ nb,
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
@@ -738,6 +840,11 @@ struct test {
     bool embeddings;
     int n_prompt;
     int n_gen;
+    bool parallel;
+    int n_seq;
+    int n_depth;
+    int n_chunk;
+    bool shared_prefix;
     std::string test_time;
     std::vector<uint64_t> samples_ns;
 
@@ -764,6 +871,11 @@ struct test {
         embeddings = inst.embeddings;
         n_prompt = inst.n_prompt;
         n_gen = inst.n_gen;
+        parallel = inst.parallel;
+        n_seq = inst.n_seq;
+        n_depth = inst.n_depth;
+        n_chunk = inst.n_chunk;
+        shared_prefix = inst.shared_prefix;
         // RFC 3339 date-time format
         time_t t = time(NULL);
         std::strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&t));
@@ -780,8 +892,22 @@ struct test {
         return ::stdev(samples_ns);
     }
 
+    // tokens processed in the timed part of the test, in total and by each sequence
+    int n_tokens() const {
+        return parallel ? (n_seq + n_chunk)*n_gen : n_prompt + n_gen;
+    }
+
+    int n_tokens_seq() const {
+        return parallel ? n_gen : n_prompt + n_gen;
+    }
+
+    // number of llama_decode steps in the timed part of the test
+    int n_steps() const {
+        return parallel ? n_gen : (n_prompt + n_batch - 1)/n_batch + n_gen;
+    }
+
     std::vector<double> get_ts() const {
-        int n_tokens = n_prompt + n_gen;
+        int n_tokens = this->n_tokens();
         std::vector<double> ts;
         std::transform(samples_ns.begin(), samples_ns.end(), std::back_inserter(ts), [n_tokens](uint64_t t) { return 1e9 * n_tokens / t; });
         return ts;
@@ -795,6 +921,36 @@ struct test {
         return ::stdev(get_ts());
     }
 
+    std::vector<double> get_seq_ts() const {
+        int n_tokens = n_tokens_seq();
+        std::vector<double> ts;
+        std::transform(samples_ns.begin(), samples_ns.end(), std::back_inserter(ts), [n_tokens](uint64_t t) { return 1e9 * n_tokens / t; });
+        return ts;
+    }
+
+    double avg_seq_ts() const {
+        return ::avg(get_seq_ts());
+    }
+
+    double stdev_seq_ts() const {
+        return ::stdev(get_seq_ts());
+    }
+
+    std::vector<uint64_t> get_step_ns() const {
+        int n_steps = this->n_steps();
+        std::vector<uint64_t> ns;
+        std::transform(samples_ns.begin(), samples_ns.end(), std::back_inserter(ns), [n_steps](uint64_t t) { return t / n_steps; });
+        return ns;
+    }
+
+    uint64_t avg_step_ns() const {
+        return ::avg(get_step_ns());
+    }
+
+    uint64_t stdev_step_ns() const {
+        return ::stdev(get_step_ns());
+    }
+
     static std::string get_backend() {
         if (cuda) {
             return GGML_CUDA_NAME;
@@ -832,9 +988,12 @@ struct test {
             "n_gpu_layers", "split_mode",
             "main_gpu", "no_kv_offload", "flash_attn",
             "tensor_split", "use_mmap", "embeddings",
-            "n_prompt", "n_gen", "test_time",
+            "n_prompt", "n_gen",
+            "n_seq", "n_depth", "n_chunk", "shared_prefix", "test_time",
             "avg_ns", "stddev_ns",
-            "avg_ts", "stddev_ts"
+            "avg_ts", "stddev_ts",
+            "avg_seq_ts", "stddev_seq_ts",
+            "avg_step_ns", "stddev_step_ns"
         };
         return fields;
     }
@@ -847,15 +1006,17 @@ struct test {
             field == "model_size" || field == "model_n_params" ||
             field == "n_gpu_layers" || field == "main_gpu" ||
             field == "n_prompt" || field == "n_gen" ||
-            field == "avg_ns" || field == "stddev_ns") {
+            field == "n_seq" || field == "n_depth" || field == "n_chunk" ||
+            field == "avg_ns" || field == "stddev_ns" ||
+            field == "avg_step_ns" || field == "stddev_step_ns") {
             return INT;
         }
         if (field == "cuda" || field == "vulkan" || field == "kompute" || field == "metal" ||
             field == "gpu_blas" || field == "blas" || field == "sycl" ||field == "f16_kv" || field == "no_kv_offload" ||
-            field == "flash_attn" || field == "use_mmap" || field == "embeddings") {
+            field == "flash_attn" || field == "use_mmap" || field == "embeddings" || field == "shared_prefix") {
             return BOOL;
         }
-        if (field == "avg_ts" || field == "stddev_ts") {
+        if (field == "avg_ts" || field == "stddev_ts" || field == "avg_seq_ts" || field == "stddev_seq_ts") {
             return FLOAT;
         }
         return STRING;
@@ -888,9 +1049,12 @@ struct test {
             std::to_string(n_gpu_layers), split_mode_str(split_mode),
             std::to_string(main_gpu), std::to_string(no_kv_offload), std::to_string(flash_attn),
             tensor_split_str, std::to_string(use_mmap), std::to_string(embeddings),
-            std::to_string(n_prompt), std::to_string(n_gen), test_time,
+            std::to_string(n_prompt), std::to_string(n_gen),
+            std::to_string(n_seq), std::to_string(n_depth), std::to_string(n_chunk), std::to_string(shared_prefix), test_time,
             std::to_string(avg_ns()), std::to_string(stdev_ns()),
-            std::to_string(avg_ts()), std::to_string(stdev_ts())
+            std::to_string(avg_ts()), std::to_string(stdev_ts()),
+            std::to_string(avg_seq_ts()), std::to_string(stdev_seq_ts()),
+            std::to_string(avg_step_ns()), std::to_string(stdev_step_ns())
         };
         return values;
     }
@@ -1017,14 +1181,18 @@ struct json_printer : public printer {
 
 struct markdown_printer : public printer {
     std::vector<std::string> fields;
+    bool parallel = false; // the names of the parallel tests are longer
 
-    static int get_field_width(const std::string & field) {
+    int get_field_width(const std::string & field) const {
         if (field == "model") {
             return -30;
         }
-        if (field == "t/s") {
+        if (field == "t/s" || field == "seq t/s") {
             return 16;
         }
+        if (field == "step ms") {
+            return 14;
+        }
         if (field == "size" || field == "params") {
             return 10;
         }
@@ -1053,7 +1221,7 @@ struct markdown_printer : public printer {
             return 4;
         }
         if (field == "test") {
-            return 13;
+            return parallel ? 24 : 13;
         }
 
         int width = std::max((int)field.length(), 10);
@@ -1140,6 +1308,11 @@ struct markdown_printer : public printer {
         }
         fields.emplace_back("test");
         fields.emplace_back("t/s");
+        if (!params.parallel.empty()) {
+            parallel = true;
+            fields.emplace_back("seq t/s");
+            fields.emplace_back("step ms");
+        }
 
         fprintf(fout, "|");
         for (const auto & field : fields) {
@@ -1183,7 +1356,16 @@ struct markdown_printer : public printer {
                     value += "+RPC";
                 }
             } else if (field == "test") {
-                if (t.n_prompt > 0 && t.n_gen == 0) {
+                if (t.parallel) {
+                    // e.g. tg128 x8 @d512 +pp32, @p for a shared prefix
+                    int n = snprintf(buf, sizeof(buf), "tg%d x%d", t.n_gen, t.n_seq);
+                    if (t.n_depth > 0) {
+                        n += snprintf(buf + n, sizeof(buf) - n, " @%s%d", t.shared_prefix ? "p" : "d", t.n_depth);
+                    }
+                    if (t.n_chunk > 0) {
+                        snprintf(buf + n, sizeof(buf) - n, " +pp%d", t.n_chunk);
+                    }
+                } else if (t.n_prompt > 0 && t.n_gen == 0) {
                     snprintf(buf, sizeof(buf), "pp%d", t.n_prompt);
                 } else if (t.n_gen > 0 && t.n_prompt == 0) {
                     snprintf(buf, sizeof(buf), "tg%d", t.n_gen);
@@ -1194,6 +1376,12 @@ struct markdown_printer : public printer {
             } else if (field == "t/s") {
                 snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ts(), t.stdev_ts());
                 value = buf;
+            } else if (field == "seq t/s") {
+                snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_seq_ts(), t.stdev_seq_ts());
+                value = buf;
+            } else if (field == "step ms") {
+                snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_step_ns() / 1e6, t.stdev_step_ns() / 1e6);
+                value = buf;
             } else if (vmap.find(field) != vmap.end()) {
                 value = vmap.at(field);
             } else {
@@ -1202,7 +1390,7 @@ struct markdown_printer : public printer {
             }
 
             int width = get_field_width(field);
-            if (field == "t/s") {
+            if (field == "t/s" || field == "seq t/s" || field == "step ms") {
                 // HACK: the utf-8 character is 2 bytes
                 width += 1;
             }
@@ -1254,7 +1442,7 @@ struct sql_printer : public printer {
     }
 };
 
-static void test_prompt(llama_context * ctx, int n_prompt, int n_past, int n_batch, int n_threads) {
+static void test_prompt(llama_context * ctx, int n_prompt, int n_past, int n_batch, int n_threads, llama_seq_id seq_id = 0) {
     llama_set_n_threads(ctx, n_threads, n_threads);
 
     const llama_model * model = llama_get_model(ctx);
@@ -1270,7 +1458,7 @@ static void test_prompt(llama_context * ctx, int n_prompt, int n_past, int n_bat
         for (int i = 1; i < n_tokens; i++) {
             tokens[i] = std::rand() % n_vocab;
         }
-        llama_decode(ctx, llama_batch_get_one(tokens.data(), n_tokens, n_past + n_processed, 0));
+        llama_decode(ctx, llama_batch_get_one(tokens.data(), n_tokens, n_past + n_processed, seq_id));
         n_processed += n_tokens;
     }
 
@@ -1292,6 +1480,65 @@ static void test_gen(llama_context * ctx, int n_gen, int n_past, int n_threads)
     }
 }
 
+// fill the KV cache of the sequences of a parallel test, not timed
+static void test_parallel_setup(llama_context * ctx, const test & t) {
+    llama_kv_cache_clear(ctx);
+
+    if (t.n_depth == 0) {
+        return;
+    }
+
+    if (t.shared_prefix) {
+        test_prompt(ctx, t.n_depth, 0, t.n_batch, t.n_threads, 0);
+        for (int s = 1; s < t.n_seq; s++) {
+            llama_kv_cache_seq_cp(ctx, 0, s, -1, -1);
+        }
+    } else {
+        for (int s = 0; s < t.n_seq; s++) {
+            test_prompt(ctx, t.n_depth, 0, t.n_batch, t.n_threads, s);
+        }
+    }
+}
+
+// n_gen steps decoding one token of each sequence, plus n_chunk prompt tokens of sequence n_seq
+static void test_parallel(llama_context * ctx, const test & t, int n_gen) {
+    llama_set_n_threads(ctx, t.n_threads, t.n_threads);
+
+    const llama_model * model = llama_get_model(ctx);
+    const int32_t n_vocab = llama_n_vocab(model);
+
+    llama_batch batch = llama_batch_init(t.n_seq + t.n_chunk, 0, 1);
+
+    for (int i = 0; i < n_gen; i++) {
+        llama_batch_clear(batch);
+        for (int s = 0; s < t.n_seq; s++) {
+            llama_batch_add(batch, std::rand() % n_vocab, t.n_depth + i, { s }, true);
+        }
+        for (int j = 0; j < t.n_chunk; j++) {
+            llama_batch_add(batch, std::rand() % n_vocab, i*t.n_chunk + j, { t.n_seq }, j == t.n_chunk - 1);
+        }
+
+        // a step larger than the batch size is split, as the server does
+        for (int32_t k = 0; k < batch.n_tokens; k += t.n_batch) {
+            const int32_t n_tokens = std::min(t.n_batch, batch.n_tokens - k);
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token    + k,
+                nullptr,
+                batch.pos      + k,
+                batch.n_seq_id + k,
+                batch.seq_id   + k,
+                batch.logits   + k,
+                0, 0, 0, // unused
+            };
+            llama_decode(ctx, batch_view);
+        }
+        llama_synchronize(ctx);
+    }
+
+    llama_batch_free(batch);
+}
+
 static void llama_null_log_callback(enum ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) text;
@@ -1358,6 +1605,9 @@ int main(int argc, char ** argv) {
     llama_model * lmodel = nullptr;
     const cmd_params_instance * prev_inst = nullptr;
 
+    ggml_profiler * profiler = params.profile.empty() ? nullptr : ggml_profiler_init(1 << 20);
+    int n_test = 0;
+
     for (const auto & inst : params_instances) {
         // keep the same model between tests when possible
         if (!lmodel || !prev_inst || !inst.equal_mparams(*prev_inst)) {
@@ -1385,24 +1635,42 @@ int main(int argc, char ** argv) {
         llama_kv_cache_clear(ctx);
 
         // warmup run
+        if (t.parallel) {
+            test_parallel_setup(ctx, t);
+            test_parallel(ctx, t, 1);
+        }
         if (t.n_prompt > 0) {
             //test_prompt(ctx, std::min(t.n_batch, std::min(t.n_prompt, 32)), 0, t.n_batch, t.n_threads);
             test_prompt(ctx, t.n_prompt, 0, t.n_batch, t.n_threads);
         }
-        if (t.n_gen > 0) {
+        if (t.n_gen > 0 && !t.parallel) {
             test_gen(ctx, 1, 0, t.n_threads);
         }
 
+        // only the timed repetitions are profiled
+        if (profiler) {
+            ggml_profiler_reset(profiler);
+            llama_set_profiler(ctx, profiler);
+        }
+
         for (int i = 0; i < params.reps; i++) {
             llama_kv_cache_clear(ctx);
 
+            if (t.parallel) {
+                test_parallel_setup(ctx, t);
+            }
+
             uint64_t t_start = get_time_ns();
 
-            if (t.n_prompt > 0) {
-                test_prompt(ctx, t.n_prompt, 0, t.n_batch, t.n_threads);
-            }
-            if (t.n_gen > 0) {
-                test_gen(ctx, t.n_gen, t.n_prompt, t.n_threads);
+            if (t.parallel) {
+                test_parallel(ctx, t, t.n_gen);
+            } else {
+                if (t.n_prompt > 0) {
+                    test_prompt(ctx, t.n_prompt, 0, t.n_batch, t.n_threads);
+                }
+                if (t.n_gen > 0) {
+                    test_gen(ctx, t.n_gen, t.n_prompt, t.n_threads);
+                }
             }
 
             uint64_t t_ns = get_time_ns() - t_start;
@@ -1421,9 +1689,32 @@ int main(int argc, char ** argv) {
 
         llama_print_timings(ctx);
 
+        if (profiler) {
+            // one trace per test: name.json, name-1.json, ...
+            std::string fname = params.profile;
+            if (n_test > 0) {
+                const size_t dot = fname.find_last_of('.');
+                const std::string suffix = "-" + std::to_string(n_test);
+                fname = dot == std::string::npos ? fname + suffix : fname.substr(0, dot) + suffix + fname.substr(dot);
+            }
+
+            fprintf(stderr, "\n%s\n", llama_profiler_report(profiler, GGML_PROFILE_FORMAT_TABLE).c_str());
+
+            FILE * f = ggml_fopen(fname.c_str(), "w");
+            if (f) {
+                fputs(llama_profiler_report(profiler, GGML_PROFILE_FORMAT_TRACE).c_str(), f);
+                fclose(f);
+                fprintf(stderr, "%s: wrote the trace to %s\n", __func__, fname.c_str());
+            } else {
+                fprintf(stderr, "%s: failed to open %s\n", __func__, fname.c_str());
+            }
+        }
+        n_test++;
+
         llama_free(ctx);
     }
 
+    ggml_profiler_free(profiler);
     llama_free_model(lmodel);
 
     if (p) {
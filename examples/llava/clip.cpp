@@ -24,9 +24,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <regex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 #include <sstream>
 #include <cinttypes>
@@ -518,8 +520,18 @@ struct clip_ctx {
 
     ggml_backend_t backend       = NULL;
     ggml_gallocr_t compute_alloc = NULL;
+
+    // scratch buffers of clip_image_preprocess, reused across calls
+    clip_image_u8      preproc_u8;
+    clip_image_u8      preproc_u8_resized;
+    std::vector<float> preproc_f32;
 };
 
+// the MLP projectors work on each patch embedding, so all the images of a batch can go through them at once
+static bool clip_proj_supports_batch(const clip_ctx * ctx) {
+    return ctx->proj_type == PROJECTOR_TYPE_MLP || ctx->proj_type == PROJECTOR_TYPE_MLP_NORM;
+}
+
 static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32_batch * imgs) {
     if (!ctx->has_vision_encoder) {
         LOG_TEE("This gguf file seems to have no vision encoder\n");
@@ -543,7 +555,7 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     const int batch_size = imgs->size;
 
     if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1);
+        GGML_ASSERT(batch_size == 1 || clip_proj_supports_batch(ctx));
     }
 
     struct ggml_init_params params = {
@@ -575,7 +587,12 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
         embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
         ggml_set_name(embeddings, "embeddings");
         ggml_set_input(embeddings);
-        embeddings = ggml_acc(ctx0, embeddings, model.class_embedding,
+        struct ggml_tensor * class_embedding = model.class_embedding;
+        if (batch_size > 1) {
+            // one class embedding at the start of each image
+            class_embedding = ggml_repeat(ctx0, class_embedding, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, 1, batch_size));
+        }
+        embeddings = ggml_acc(ctx0, embeddings, class_embedding,
                 embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], 0);
         embeddings = ggml_acc(ctx0, embeddings, inp,
                 embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
@@ -688,14 +705,12 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
     // llava projector
     {
-        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1]);
-
-        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches);
+        struct ggml_tensor * patches = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, num_patches, batch_size);
         ggml_set_name(patches, "patches");
         ggml_set_input(patches);
 
-        // shape [1, 576, 1024]
-        // ne is whcn, ne = [1024, 576, 1, 1]
+        // shape [batch_size, 576, 1024]
+        // ne is whcn, ne = [1024, 576, batch_size, 1]
         embeddings = ggml_get_rows(ctx0, embeddings, patches);
 
         // print_tensor_info(embeddings, "embeddings");
@@ -1412,15 +1427,47 @@ static void bilinear_resize(const clip_image_u8& src, clip_image_u8& dst, int ta
     }
 }
 
+// runs f(i0, i1) on contiguous ranges of [0, n), on several threads when there are at least min_n items per thread
+static void clip_parallel_for(int n, int min_n, const std::function<void(int, int)> & f) {
+    const int n_threads = std::max(1, std::min((int) std::thread::hardware_concurrency(), n / std::max(1, min_n)));
+    if (n_threads == 1) {
+        f(0, n);
+        return;
+    }
+
+    const int chunk = (n + n_threads - 1) / n_threads;
+
+    std::vector<std::thread> workers;
+    for (int i0 = chunk; i0 < n; i0 += chunk) {
+        workers.emplace_back(f, i0, std::min(n, i0 + chunk));
+    }
+    f(0, std::min(n, chunk));
+
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
 // Normalize image to float32 - careful with pytorch .to(model.device, dtype=torch.float16) - this sometimes reduces precision (32>16>32), sometimes not
-static void normalize_image_u8_to_f32(const clip_image_u8* src, clip_image_f32* dst, const float mean[3], const float std[3]) {
-    dst->nx = src->nx;
-    dst->ny = src->ny;
-    dst->buf.resize(src->buf.size());
+// the 256 possible values of each channel are normalized once: lut[c][v] = (v/255 - mean[c]) / std[c]
+static void clip_build_norm_lut(const float mean[3], const float std[3], float lut[3][256]) {
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            lut[c][v] = (static_cast<float>(v) / 255.0f - mean[c]) / std[c];
+        }
+    }
+}
 
-    for (size_t i = 0; i < src->buf.size(); ++i) {
-        int c = i % 3; // rgb
-        dst->buf[i] = (static_cast<float>(src->buf[i]) / 255.0f - mean[c]) / std[c];
+// normalizes the rows [y0, y1) of the region of src starting at (x0, yoff) with the size of dst
+static void normalize_region_u8_to_f32(const clip_image_u8 & src, int x0, int yoff, clip_image_f32 & dst, int y0, int y1, const float lut[3][256]) {
+    for (int y = y0; y < y1; y++) {
+        const uint8_t * s = &src.buf[3 * ((yoff + y) * src.nx + x0)];
+        float         * d = &dst.buf[3 * y * dst.nx];
+        for (int x = 0; x < dst.nx; x++) {
+            d[3*x + 0] = lut[0][s[3*x + 0]];
+            d[3*x + 1] = lut[1][s[3*x + 1]];
+            d[3*x + 2] = lut[2][s[3*x + 2]];
+        }
     }
 }
 
@@ -1428,7 +1475,21 @@ inline float clip(float x, float lower, float upper) {
     return std::max(lower, std::min(x, upper));
 }
 
-static bool bicubic_resize(const clip_image_u8 &img, clip_image_u8 &dst, int target_width, int target_height) {
+// cubic interpolation between c1 and c2, at t in [0, 1)
+static inline float clip_cubic(float c0, float c1, float c2, float c3, float t) {
+    const float d0 = c0 - c1;
+    const float d2 = c2 - c1;
+    const float d3 = c3 - c1;
+    const float a0 = c1;
+    const float a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
+    const float a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
+    const float a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+    return a0 + a1 * t + a2 * t * t + a3 * t * t * t;
+}
+
+// separable bicubic resize: the horizontal pass is computed once for each source row that the vertical pass needs,
+// into the scratch buffer, instead of four times per output pixel
+static void bicubic_resize(const clip_image_u8 & img, clip_image_u8 & dst, int target_width, int target_height, std::vector<float> & scratch) {
     const int nx = img.nx;
     const int ny = img.ny;
 
@@ -1436,63 +1497,79 @@ static bool bicubic_resize(const clip_image_u8 &img, clip_image_u8 &dst, int tar
     dst.ny = target_height;
     dst.buf.resize(3 * target_width * target_height);
 
-    float Cc;
-    float C[5];
-    float d0, d2, d3, a0, a1, a2, a3;
-    int i, j, k, jj;
-    int x, y;
-    float dx, dy;
-    float tx, ty;
-
-    tx = (float)nx / (float)target_width;
-    ty = (float)ny / (float)target_height;
+    const float tx = (float)nx / (float)target_width;
+    const float ty = (float)ny / (float)target_height;
 
     // Bicubic interpolation; adapted from ViT.cpp, inspired from :
     //    -> https://github.com/yglukhov/bicubic-interpolation-image-processing/blob/master/libimage.c#L36
     //    -> https://en.wikipedia.org/wiki/Bicubic_interpolation
 
-    for (i = 0; i < target_height; i++) {
-        for (j = 0; j < target_width; j++) {
-            x = (int)(tx * j);
-            y = (int)(ty * i);
-
-            dx = tx * j - x;
-            dy = ty * i - y;
-
-            for (k = 0; k < 3; k++) {
-                for (jj = 0; jj <= 3; jj++) {
-                    d0 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x - 1, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                    d2 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x + 1, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                    d3 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x + 2, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                    a0 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-
-                    a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
-                    a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
-                    a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
-
-                    C[jj] = a0 + a1 * dx + a2 * dx * dx + a3 * dx * dx * dx;
-
-                    d0 = C[0] - C[1];
-                    d2 = C[2] - C[1];
-                    d3 = C[3] - C[1];
-                    a0 = C[1];
-                    a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
-                    a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
-                    a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
-                    Cc = a0 + a1 * dy + a2 * dy * dy + a3 * dy * dy * dy;
-
-                    const uint8_t Cc2 = std::min(std::max(std::round(Cc), 0.0f), 255.0f);
-                    dst.buf[(i * target_width + j) * 3 + k] = float(Cc2);
-                }
+    // the 4 source columns and the offset of each target column
+    std::vector<int>   xs(4 * target_width);
+    std::vector<float> dxs(target_width);
+    for (int j = 0; j < target_width; j++) {
+        const int x = (int)(tx * j);
+        for (int jj = 0; jj <= 3; jj++) {
+            xs[4*j + jj] = std::max(0, std::min(x - 1 + jj, nx - 1));
+        }
+        dxs[j] = tx * j - x;
+    }
+
+    // the 4 source rows and the offset of each target row, the rows index the horizontal pass
+    std::vector<int>   row_idx(ny, -1);
+    std::vector<int>   rows;
+    std::vector<int>   ys(4 * target_height);
+    std::vector<float> dys(target_height);
+    for (int i = 0; i < target_height; i++) {
+        const int y = (int)(ty * i);
+        for (int jj = 0; jj <= 3; jj++) {
+            const int r = std::max(0, std::min(y - 1 + jj, ny - 1));
+            if (row_idx[r] < 0) {
+                row_idx[r] = rows.size();
+                rows.push_back(r);
             }
+            ys[4*i + jj] = row_idx[r];
         }
+        dys[i] = ty * i - y;
     }
 
-    return true;
+    const int n_row = 3 * target_width;
+
+    scratch.resize((size_t) rows.size() * n_row);
+
+    // horizontal pass
+    clip_parallel_for(rows.size(), 16, [&](int r0, int r1) {
+        for (int r = r0; r < r1; r++) {
+            const uint8_t * src = &img.buf[3 * rows[r] * nx];
+            float         * out = &scratch[(size_t) r * n_row];
+            for (int j = 0; j < target_width; j++) {
+                const int * x = &xs[4*j];
+                for (int k = 0; k < 3; k++) {
+                    out[3*j + k] = clip_cubic(src[3*x[0] + k], src[3*x[1] + k], src[3*x[2] + k], src[3*x[3] + k], dxs[j]);
+                }
+            }
+        }
+    });
+
+    // vertical pass
+    clip_parallel_for(target_height, 16, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            const float * c0 = &scratch[(size_t) ys[4*i + 0] * n_row];
+            const float * c1 = &scratch[(size_t) ys[4*i + 1] * n_row];
+            const float * c2 = &scratch[(size_t) ys[4*i + 2] * n_row];
+            const float * c3 = &scratch[(size_t) ys[4*i + 3] * n_row];
+            uint8_t * out = &dst.buf[(size_t) i * n_row];
+            for (int j = 0; j < n_row; j++) {
+                const float Cc = clip_cubic(c0[j], c1[j], c2[j], c3[j], dys[i]);
+                out[j] = std::min(std::max(std::round(Cc), 0.0f), 255.0f);
+            }
+        }
+    });
 }
 
 // llava-1.6 type of resize_and_pad (black)
-static void resize_and_pad_image(const clip_image_u8& image, clip_image_u8 &image_output, const std::pair<int, int>& target_resolution) {
+static void resize_and_pad_image(const clip_image_u8& image, clip_image_u8 &image_output, const std::pair<int, int>& target_resolution,
+        clip_image_u8 & resized_image, std::vector<float> & scratch) {
     int target_width = target_resolution.first;
     int target_height = target_resolution.second;
 
@@ -1509,14 +1586,12 @@ static void resize_and_pad_image(const clip_image_u8& image, clip_image_u8 &imag
         new_width = std::min(static_cast<int>(std::ceil(image.nx * scale_h)), target_width);
     }
 
-    clip_image_u8 resized_image;
     // bilinear_resize(image, resized_image, new_width, new_height);
-    bicubic_resize(image, resized_image, new_width, new_height);
+    bicubic_resize(image, resized_image, new_width, new_height, scratch);
 
-    clip_image_u8 padded_image;
-    padded_image.nx = target_width;
-    padded_image.ny = target_height;
-    padded_image.buf.resize(3 * target_width * target_height, 0); // Initialize with black
+    image_output.nx = target_width;
+    image_output.ny = target_height;
+    image_output.buf.assign(3 * target_width * target_height, 0); // Initialize with black
 
     // Calculate padding offsets
     int pad_x = (target_width - new_width) / 2;
@@ -1524,13 +1599,8 @@ static void resize_and_pad_image(const clip_image_u8& image, clip_image_u8 &imag
 
     // Copy the resized image into the center of the padded buffer
     for (int y = 0; y < new_height; ++y) {
-        for (int x = 0; x < new_width; ++x) {
-            for (int c = 0; c < 3; ++c) {
-                padded_image.buf[3 * ((y + pad_y) * target_width + (x + pad_x)) + c] = resized_image.buf[3 * (y * new_width + x) + c];
-            }
-        }
+        memcpy(&image_output.buf[3 * ((y + pad_y) * target_width + pad_x)], &resized_image.buf[3 * y * new_width], 3 * new_width);
     }
-    image_output = std::move(padded_image);
 }
 
 /**
@@ -1566,29 +1636,6 @@ static std::pair<int, int> select_best_resolution(const std::pair<int, int> & or
     return best_fit;
 }
 
-static std::vector<clip_image_u8*> divide_to_patches_u8(const clip_image_u8 & image, int patch_size) {
-    std::vector<clip_image_u8*> patches;
-    int width = image.nx;
-    int height = image.ny;
-    for (int i = 0; i < height; i += patch_size) {
-        for (int j = 0; j < width; j += patch_size) {
-            clip_image_u8 *patch = clip_image_u8_init();
-            patch->nx = std::min(patch_size, width - j);
-            patch->ny = std::min(patch_size, height - i);
-            patch->buf.resize(3 * patch->nx * patch->ny);
-            for (int y = 0; y < patch->ny; ++y) {
-                for (int x = 0; x < patch->nx; ++x) {
-                    for (int c = 0; c < 3; ++c) {
-                        patch->buf[3 * (y * patch->nx + x) + c] = image.buf[3 * ((i + y) * width + (j + x)) + c];
-                    }
-                }
-            }
-            patches.push_back(patch);
-        }
-    }
-    return patches;
-}
-
 // returns the normalized float tensor for llava-1.5, for spatial_unpad with anyres processing for llava-1.6 it returns the normalized image patch tensors as a vector
 // res_imgs memory is being allocated here, previous allocations will be freed if found
 bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, clip_image_f32_batch * res_imgs) {
@@ -1609,90 +1656,107 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, cli
     res_imgs->data = nullptr;
     res_imgs->size = 0;
 
+    float lut[3][256];
+    clip_build_norm_lut(ctx->image_mean, ctx->image_std, lut);
+
+    // the intermediate images are kept in the context and reused by the next calls
+    clip_image_u8 & temp = ctx->preproc_u8;
+
     // the logic below is to pad the shorter side to the longer side with a background color: rgb(122, 116, 104)
     // see https://github.com/haotian-liu/LLaVA/blob/e854a2bf85118c504f6f16bf5c3c7c92f8fa8c6b/llava/conversation.py#L113-L156
 
-    clip_image_u8 * temp = clip_image_u8_init(); // we will keep the input image data here temporarily
+    const clip_image_u8 * src = img;
     if (pad_to_square && img->nx != img->ny) {
         int longer_side = std::max(img->nx, img->ny);
-        temp->nx = longer_side;
-        temp->ny = longer_side;
-        temp->buf.resize(3 * longer_side * longer_side);
+        temp.nx = longer_side;
+        temp.ny = longer_side;
+        temp.buf.resize(3 * longer_side * longer_side);
         const uint8_t bc[3] = {122, 116, 104}; // background color in RGB from LLaVA (this is the mean rgb color * 255)
 
         // fill with background color
-        for (size_t i = 0; i < temp->buf.size(); i++) {
-            temp->buf[i] = bc[i % 3];
+        for (size_t i = 0; i < temp.buf.size(); i += 3) {
+            temp.buf[i]   = bc[0];
+            temp.buf[i+1] = bc[1];
+            temp.buf[i+2] = bc[2];
         }
 
         // copy from the input image
         for (int y = 0; y < img->ny; y++) {
-            for (int x = 0; x < img->nx; x++) {
-                const int i = 3 * (y * img->nx + x);
-                const int j = 3 * (y * temp->nx + x);
-                temp->buf[j]   = img->buf[i];
-                temp->buf[j+1] = img->buf[i+1];
-                temp->buf[j+2] = img->buf[i+2];
-            }
+            memcpy(&temp.buf[3 * y * temp.nx], &img->buf[3 * y * img->nx], 3 * img->nx);
         }
-    } else {
-        if (params.image_grid_pinpoints[0] != 0) {
-            // "spatial_unpad" with "anyres" processing for llava-1.6
-            std::vector<std::pair<int, int>> possible_resolutions;
-            for (int i = 0; i < 32 && params.image_grid_pinpoints[i] != 0; i+=2) {
-                possible_resolutions.push_back({params.image_grid_pinpoints[i], params.image_grid_pinpoints[i+1]});
-            }
-            std::pair<int, int> best_resolution = select_best_resolution({img->nx, img->ny}, possible_resolutions);
-            // clip_image_save_to_bmp(*img, "input.bmp");
-            resize_and_pad_image(*img, *temp, best_resolution);  // we do not pad with mean-bg color anymore in llava-1.6
-            // clip_image_save_to_bmp(*temp, "resized.bmp");
-            // visually verify normalized image:
-            // normalize_image_u8_to_f32(*temp, *res, ctx->image_mean, ctx->image_std);
-            // {
-            //     clip_image_u8 * temp2 = clip_image_u8_init();
-            //     clip_image_convert_f32_to_u8(*res, *temp2);
-            //     clip_image_save_to_bmp(*temp2, "resized_normalized_f32.bmp");
-            //     clip_image_u8_free(temp2);
-            // }
-
-            std::vector<clip_image_u8 *> patches = divide_to_patches_u8(*temp, params.image_size); // prepare spatial sorted main patches of image_size each (336 in llava-1.6)
-
-            clip_image_u8 *image_original_resize = clip_image_u8_init();
-            // bilinear_resize(*img, *image_original_resize, params.image_size, params.image_size); // in python this is "shortest_edge", but all CLIP are square
-            bicubic_resize(*img, *image_original_resize, params.image_size, params.image_size); // in python this is "shortest_edge", but all CLIP are square
-            patches.insert(patches.begin(), image_original_resize);
-            // clip_image_f32_batch_init(patches.size());
-            res_imgs->size = patches.size();
-            res_imgs->data = new clip_image_f32[res_imgs->size];
-            int num=0;
-            for (auto& patch : patches) {
-                normalize_image_u8_to_f32(patch, &res_imgs->data[num], ctx->image_mean, ctx->image_std);
-                num++;
-            }
 
-            for (size_t i = 0; i < patches.size(); i++) {
-                // LOG_TEE("patch %d: %d %d\n", i, patches[i]->nx, patches[i]->ny);
-                clip_image_u8_free(patches[i]);
+        src = &temp;
+    } else if (params.image_grid_pinpoints[0] != 0) {
+        // "spatial_unpad" with "anyres" processing for llava-1.6
+        std::vector<std::pair<int, int>> possible_resolutions;
+        for (int i = 0; i < 32 && params.image_grid_pinpoints[i] != 0; i+=2) {
+            possible_resolutions.push_back({params.image_grid_pinpoints[i], params.image_grid_pinpoints[i+1]});
+        }
+        std::pair<int, int> best_resolution = select_best_resolution({img->nx, img->ny}, possible_resolutions);
+        // clip_image_save_to_bmp(*img, "input.bmp");
+        resize_and_pad_image(*img, temp, best_resolution, ctx->preproc_u8_resized, ctx->preproc_f32);  // we do not pad with mean-bg color anymore in llava-1.6
+        // clip_image_save_to_bmp(temp, "resized.bmp");
+
+        const int image_size = params.image_size;
+
+        clip_image_u8 & image_original_resize = ctx->preproc_u8_resized;
+        // bilinear_resize(*img, image_original_resize, params.image_size, params.image_size); // in python this is "shortest_edge", but all CLIP are square
+        bicubic_resize(*img, image_original_resize, image_size, image_size, ctx->preproc_f32); // in python this is "shortest_edge", but all CLIP are square
+
+        // the resized original image, followed by the spatial sorted main patches of image_size each (336 in llava-1.6)
+        const int n_patches_x = (temp.nx + image_size - 1) / image_size;
+        const int n_patches_y = (temp.ny + image_size - 1) / image_size;
+
+        res_imgs->size = 1 + n_patches_x * n_patches_y;
+        res_imgs->data = new clip_image_f32[res_imgs->size];
+
+        std::vector<const clip_image_u8 *> srcs(res_imgs->size);
+        std::vector<std::pair<int, int>>   offsets(res_imgs->size);
+
+        srcs[0] = &image_original_resize;
+        offsets[0] = {0, 0};
+        res_imgs->data[0].nx = image_size;
+        res_imgs->data[0].ny = image_size;
+
+        for (int i = 0; i < n_patches_y; i++) {
+            for (int j = 0; j < n_patches_x; j++) {
+                const int k = 1 + i * n_patches_x + j;
+                srcs[k] = &temp;
+                offsets[k] = {j * image_size, i * image_size};
+                res_imgs->data[k].nx = std::min(image_size, temp.nx - j * image_size);
+                res_imgs->data[k].ny = std::min(image_size, temp.ny - i * image_size);
             }
+        }
 
-            clip_image_u8_free(temp);
-
-            return true;
-        } else {
-            temp->nx = img->nx;
-            temp->ny = img->ny;
-            temp->buf.resize(img->buf.size());
-            memcpy(temp->buf.data(), img->buf.data(), temp->buf.size());
+        for (size_t k = 0; k < res_imgs->size; k++) {
+            res_imgs->data[k].buf.resize(3 * res_imgs->data[k].nx * res_imgs->data[k].ny);
         }
+
+        // normalize the rows of all the images directly into the batch
+        clip_parallel_for(res_imgs->size * image_size, 64, [&](int r0, int r1) {
+            for (int r = r0; r < r1; r++) {
+                const int k = r / image_size;
+                const int y = r % image_size;
+                if (y < res_imgs->data[k].ny) {
+                    normalize_region_u8_to_f32(*srcs[k], offsets[k].first, offsets[k].second, res_imgs->data[k], y, y + 1, lut);
+                }
+            }
+        });
+
+        return true;
     }
 
-    const int nx = temp->nx;
-    const int ny = temp->ny;
-    // clip_image_save_to_bmp(*temp, "resized_vanilla.bmp");
+    const int nx = src->nx;
+    const int ny = src->ny;
+    // clip_image_save_to_bmp(*src, "resized_vanilla.bmp");
 
     const int nx2 = ctx->vision_model.hparams.image_size;
     const int ny2 = ctx->vision_model.hparams.image_size;
-    clip_image_f32 * res = clip_image_f32_init();
+
+    res_imgs->size = 1;
+    res_imgs->data = new clip_image_f32[res_imgs->size];
+
+    clip_image_f32 * res = &res_imgs->data[0];
     res->nx = nx2;
     res->ny = ny2;
     res->buf.resize(3 * nx2 * ny2);
@@ -1702,49 +1766,47 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, cli
     const int nx3 = int(nx / scale + 0.5f);
     const int ny3 = int(ny / scale + 0.5f);
 
-    const auto & m3 = ctx->image_mean; // {0.48145466f, 0.4578275f, 0.40821073f};
-    const auto & s3 = ctx->image_std;  // {0.26862954f, 0.26130258f, 0.27577711f};
+    clip_parallel_for(ny3, 16, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < nx3; x++) {
+                for (int c = 0; c < 3; c++) {
+                    // linear interpolation
+                    const float sx = (x + 0.5f) * scale - 0.5f;
+                    const float sy = (y + 0.5f) * scale - 0.5f;
 
-    for (int y = 0; y < ny3; y++) {
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                // linear interpolation
-                const float sx = (x + 0.5f) * scale - 0.5f;
-                const float sy = (y + 0.5f) * scale - 0.5f;
-
-                const int x0 = std::max(0, (int)std::floor(sx));
-                const int y0 = std::max(0, (int)std::floor(sy));
+                    const int x0 = std::max(0, (int)std::floor(sx));
+                    const int y0 = std::max(0, (int)std::floor(sy));
 
-                const int x1 = std::min(x0 + 1, nx - 1);
-                const int y1 = std::min(y0 + 1, ny - 1);
+                    const int x1 = std::min(x0 + 1, nx - 1);
+                    const int y1 = std::min(y0 + 1, ny - 1);
 
-                const float dx = sx - x0;
-                const float dy = sy - y0;
+                    const float dx = sx - x0;
+                    const float dy = sy - y0;
 
-                const int j00 = 3 * (y0 * nx + x0) + c;
-                const int j01 = 3 * (y0 * nx + x1) + c;
-                const int j10 = 3 * (y1 * nx + x0) + c;
-                const int j11 = 3 * (y1 * nx + x1) + c;
+                    const int j00 = 3 * (y0 * nx + x0) + c;
+                    const int j01 = 3 * (y0 * nx + x1) + c;
+                    const int j10 = 3 * (y1 * nx + x0) + c;
+                    const int j11 = 3 * (y1 * nx + x1) + c;
 
-                const float v00 = temp->buf[j00];
-                const float v01 = temp->buf[j01];
-                const float v10 = temp->buf[j10];
-                const float v11 = temp->buf[j11];
+                    const float v00 = src->buf[j00];
+                    const float v01 = src->buf[j01];
+                    const float v10 = src->buf[j10];
+                    const float v11 = src->buf[j11];
 
-                const float v0 = v00 * (1.0f - dx) + v01 * dx;
-                const float v1 = v10 * (1.0f - dx) + v11 * dx;
+                    const float v0 = v00 * (1.0f - dx) + v01 * dx;
+                    const float v1 = v10 * (1.0f - dx) + v11 * dx;
 
-                const float v = v0 * (1.0f - dy) + v1 * dy;
+                    const float v = v0 * (1.0f - dy) + v1 * dy;
 
-                const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
+                    const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
 
-                const int i = 3 * (y * nx3 + x) + c;
+                    const int i = 3 * (y * nx3 + x) + c;
 
-                res->buf[i] = ((float(v2) / 255.0f) - m3[c]) / s3[c];
+                    res->buf[i] = lut[c][v2];
+                }
             }
         }
-    }
-    clip_image_u8_free(temp);
+    });
 
     // {
     //     clip_image_u8 * temp2 = clip_image_u8_init();
@@ -1752,12 +1814,6 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, cli
     //     clip_image_save_to_bmp(*temp2, "resized_normalized_f32_vanilla.bmp");
     //     clip_image_u8_free(temp2);
     // }
-    // res_imgs.push_back(res);
-
-    res_imgs->size = 1;
-    res_imgs->data = new clip_image_f32[res_imgs->size];
-    res_imgs->data[0] = *res;
-    clip_image_f32_free(res);
 
     return true;
 }
@@ -1831,8 +1887,14 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     }
 
     int batch_size = imgs->size;
-    if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1); // TODO: support multiple images
+    if (ctx->has_llava_projector && batch_size > 1 && !clip_proj_supports_batch(ctx)) {
+        // encode the images one by one
+        for (int b = 0; b < batch_size; b++) {
+            if (!clip_image_encode(ctx, n_threads, &imgs->data[b], vec + b*clip_embd_nbytes(ctx)/sizeof(float))) {
+                return false;
+            }
+        }
+        return true;
     }
 
     // build the inference graph
@@ -1852,19 +1914,17 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         struct ggml_tensor * inp_raw = ggml_graph_get_tensor(gf, "inp_raw");
         float * data = (float *)malloc(ggml_nbytes(inp_raw));
 
-        for (size_t i = 0; i < imgs->size; i++) {
-            const int nx = imgs->data[i].nx;
-            const int ny = imgs->data[i].ny;
+        for (int b = 0; b < batch_size; b++) {
+            const int nx = imgs->data[b].nx;
+            const int ny = imgs->data[b].ny;
             GGML_ASSERT(nx == image_size && ny == image_size);
 
             const int n = nx * ny;
 
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].buf[3 * (y * nx + x) + k];
-                        }
+            for (int k = 0; k < 3; k++) {
+                for (int y = 0; y < ny; y++) {
+                    for (int x = 0; x < nx; x++) {
+                        data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].buf[3 * (y * nx + x) + k];
                     }
                 }
             }
@@ -1898,8 +1958,10 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     {
         struct ggml_tensor * patches = ggml_graph_get_tensor(gf, "patches");
         int* patches_data = (int*)malloc(ggml_nbytes(patches));
-        for (int i = 0; i < num_patches; i++) {
-            patches_data[i] = i + 1;
+        for (int b = 0; b < batch_size; b++) {
+            for (int i = 0; i < num_patches; i++) {
+                patches_data[b*num_patches + i] = i + 1;
+            }
         }
         ggml_backend_tensor_set(patches, patches_data, 0, ggml_nbytes(patches));
         free(patches_data);
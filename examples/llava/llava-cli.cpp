@@ -110,6 +110,7 @@ struct llava_context {
     struct clip_ctx * ctx_clip = NULL;
     struct llama_context * ctx_llama = NULL;
     struct llama_model * model = NULL;
+    struct llava_image_embed_cache * image_cache = NULL;
 };
 
 static void print_usage(int argc, char ** argv, const gpt_params & params) {
@@ -136,7 +137,11 @@ static struct llava_image_embed * load_image(llava_context * ctx_llava, gpt_para
         }
         params->prompt = remove_image_from_prompt(prompt);
     } else {
-        embed = llava_image_embed_make_with_filename(ctx_llava->ctx_clip, params->n_threads, fname.c_str());
+        if (ctx_llava->image_cache) {
+            embed = llava_image_embed_make_with_filename_cached(ctx_llava->image_cache, ctx_llava->ctx_clip, params->n_threads, fname.c_str());
+        } else {
+            embed = llava_image_embed_make_with_filename(ctx_llava->ctx_clip, params->n_threads, fname.c_str());
+        }
         if (!embed) {
             fprintf(stderr, "%s: is %s really an image file?\n", __func__, fname.c_str());
             return NULL;
@@ -255,6 +260,11 @@ static struct llava_context * llava_init_context(gpt_params * params, llama_mode
     ctx_llava->ctx_llama = ctx_llama;
     ctx_llava->ctx_clip = ctx_clip;
     ctx_llava->model = model;
+    ctx_llava->image_cache = NULL;
+    if (params->image_cache_size > 0 || !params->image_cache_dir.empty()) {
+        ctx_llava->image_cache = llava_image_embed_cache_init((size_t) params->image_cache_size*1024*1024,
+                                                              params->image_cache_dir.empty() ? NULL : params->image_cache_dir.c_str());
+    }
     return ctx_llava;
 }
 
@@ -263,6 +273,10 @@ static void llava_free(struct llava_context * ctx_llava) {
         clip_free(ctx_llava->ctx_clip);
         ctx_llava->ctx_clip = NULL;
     }
+    if (ctx_llava->image_cache) {
+        llava_image_embed_cache_free(ctx_llava->image_cache);
+        ctx_llava->image_cache = NULL;
+    }
 
     llama_free(ctx_llava->ctx_llama);
     llama_free_model(ctx_llava->model);
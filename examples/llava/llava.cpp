@@ -4,8 +4,16 @@
 #include "llava.h"
 #include "base64.hpp"
 
+#define XXH_INLINE_ALL
+#include "../gguf-hash/deps/xxhash/xxhash.h"
+
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <numeric>
 
@@ -230,16 +238,20 @@ static bool encode_image_with_clip(clip_ctx * ctx_clip, int n_threads, const cli
         }
     } else {
         // spatial_unpad llava-1.6 type embedding
-        // TODO: CLIP needs batching support - in HF the llm projection is separate after encoding, which might be a solution to quickly get batching working
+        // all the subimages are encoded in one batch, so that the weights are read once per image
+        float * image_embd_batch = (float *)malloc(clip_embd_nbytes(ctx_clip)*img_res_v.size); // 576 patches * 4096 embeddings * 4 bytes = 9437184 per subimage
+        const bool encoded = clip_image_batch_encode(ctx_clip, n_threads, &img_res_v, image_embd_batch); // image data is in 3x336x336 format and will be converted to 336x336x3 inside
+        if (!encoded) {
+            LOG_TEE("Unable to encode image - spatial_unpad - %d subimages\n", (int) img_res_v.size);
+            free(image_embd_batch);
+            delete[] img_res_v.data;
+            return false;
+        }
+
         std::vector<float *> image_embd_v;
         image_embd_v.resize(img_res_v.size);
         for (size_t i = 0; i < img_res_v.size; i++) {
-            image_embd_v[i] = (float *)malloc(clip_embd_nbytes(ctx_clip)); // 576 patches * 4096 embeddings * 4 bytes = 9437184
-            const bool encoded = clip_image_encode(ctx_clip, n_threads, &img_res_v.data[i], image_embd_v[i]); // image data is in 3x336x336 format and will be converted to 336x336x3 inside
-            if (!encoded) {
-                LOG_TEE("Unable to encode image - spatial_unpad - subimage %d of %d\n", (int) i+1, (int) img_res_v.size);
-                return false;
-            }
+            image_embd_v[i] = image_embd_batch + i*clip_embd_nbytes(ctx_clip)/sizeof(float);
         }
         const int64_t t_img_enc_batch_us = ggml_time_us();
         LOG_TEE("%s: %d segments encoded in %8.2f ms\n", __func__, (int)img_res_v.size, (t_img_enc_batch_us - t_img_enc_start_us) / 1000.0);
@@ -264,9 +276,7 @@ static bool encode_image_with_clip(clip_ctx * ctx_clip, int n_threads, const cli
         clip_llava_handle_patches(ctx_clip, image_embd_v, grid_shape, image_embd, &n_img_pos_out);
         *n_img_pos = n_img_pos_out;
 
-        for (size_t i = 0; i < image_embd_v.size(); i++) {
-            free(image_embd_v[i]);
-        }
+        free(image_embd_batch);
         image_embd_v.clear();
 
         // debug image/segment/normalization content:
@@ -409,3 +419,180 @@ void llava_image_embed_free(struct llava_image_embed * embed) {
     free(embed->embed);
     free(embed);
 }
+
+//
+// image embed cache
+//
+
+struct llava_image_embed_cache_entry {
+    uint64_t key;
+    int n_image_pos;
+    std::vector<float> embed;
+};
+
+struct llava_image_embed_cache {
+    size_t max_bytes;
+    size_t n_bytes = 0;
+
+    std::string dir;
+
+    // most recently used first
+    std::list<llava_image_embed_cache_entry> entries;
+    std::unordered_map<uint64_t, std::list<llava_image_embed_cache_entry>::iterator> index;
+
+    std::mutex mutex;
+};
+
+// file format of the embeds stored in the cache directory: magic, n_image_pos, n_embd, then the embed as float32
+static const uint32_t LLAVA_IMAGE_EMBED_CACHE_MAGIC = 0x4345494c; // "LIEC"
+
+struct llava_image_embed_cache * llava_image_embed_cache_init(size_t max_bytes, const char * dir) {
+    auto * cache = new llava_image_embed_cache;
+    cache->max_bytes = max_bytes;
+    cache->dir       = dir ? dir : "";
+    return cache;
+}
+
+void llava_image_embed_cache_free(struct llava_image_embed_cache * cache) {
+    delete cache;
+}
+
+// the key covers the image bytes and the parameters of the projector, so that a directory can be shared by several models
+static uint64_t llava_image_embed_cache_key(const struct clip_ctx * ctx_clip, const unsigned char * image_bytes, int image_bytes_length) {
+    const std::string model = std::to_string(clip_n_mmproj_embd(ctx_clip)) + " " + std::to_string(clip_n_patches(ctx_clip)) + " " +
+                              std::to_string(clip_image_size(ctx_clip))     + " " + std::to_string(clip_hidden_size(ctx_clip)) + " " +
+                              clip_patch_merge_type(ctx_clip);
+    const uint64_t seed = XXH3_64bits(model.data(), model.size());
+    return XXH3_64bits_withSeed(image_bytes, image_bytes_length, seed);
+}
+
+static std::string llava_image_embed_cache_path(const llava_image_embed_cache * cache, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".embd", key);
+    return cache->dir + "/" + name;
+}
+
+static bool llava_image_embed_cache_read(const llava_image_embed_cache * cache, uint64_t key, int n_embd, llava_image_embed_cache_entry & entry) {
+    FILE * f = fopen(llava_image_embed_cache_path(cache, key).c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    uint32_t header[3];
+    bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == LLAVA_IMAGE_EMBED_CACHE_MAGIC && (int) header[2] == n_embd;
+    if (ok) {
+        entry.key         = key;
+        entry.n_image_pos = header[1];
+        entry.embed.resize((size_t) entry.n_image_pos * n_embd);
+        ok = fread(entry.embed.data(), sizeof(float), entry.embed.size(), f) == entry.embed.size();
+    }
+    fclose(f);
+
+    return ok;
+}
+
+static void llava_image_embed_cache_write(const llava_image_embed_cache * cache, const llava_image_embed_cache_entry & entry, int n_embd) {
+    // write to a temporary file first, so that a concurrent reader never sees a partial embed
+    const std::string path = llava_image_embed_cache_path(cache, entry.key);
+    const std::string path_tmp = path + ".tmp";
+
+    FILE * f = fopen(path_tmp.c_str(), "wb");
+    if (!f) {
+        LOG_TEE("%s: failed to write %s\n", __func__, path_tmp.c_str());
+        return;
+    }
+
+    const uint32_t header[3] = { LLAVA_IMAGE_EMBED_CACHE_MAGIC, (uint32_t) entry.n_image_pos, (uint32_t) n_embd };
+    const bool ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                    fwrite(entry.embed.data(), sizeof(float), entry.embed.size(), f) == entry.embed.size();
+    fclose(f);
+
+    if (!ok || rename(path_tmp.c_str(), path.c_str()) != 0) {
+        LOG_TEE("%s: failed to write %s\n", __func__, path.c_str());
+        remove(path_tmp.c_str());
+    }
+}
+
+// the cache mutex must be held
+static void llava_image_embed_cache_insert(llava_image_embed_cache * cache, llava_image_embed_cache_entry && entry) {
+    const size_t size = entry.embed.size() * sizeof(float);
+    if (size > cache->max_bytes || cache->index.count(entry.key)) {
+        return;
+    }
+
+    while (cache->n_bytes + size > cache->max_bytes) {
+        const auto & last = cache->entries.back();
+        cache->n_bytes -= last.embed.size() * sizeof(float);
+        cache->index.erase(last.key);
+        cache->entries.pop_back();
+    }
+
+    cache->entries.push_front(std::move(entry));
+    cache->index[cache->entries.front().key] = cache->entries.begin();
+    cache->n_bytes += size;
+}
+
+static struct llava_image_embed * llava_image_embed_from_entry(const llava_image_embed_cache_entry & entry) {
+    auto result = (llava_image_embed*)malloc(sizeof(llava_image_embed));
+    result->embed = (float *)malloc(entry.embed.size() * sizeof(float));
+    memcpy(result->embed, entry.embed.data(), entry.embed.size() * sizeof(float));
+    result->n_image_pos = entry.n_image_pos;
+    return result;
+}
+
+struct llava_image_embed * llava_image_embed_make_with_bytes_cached(struct llava_image_embed_cache * cache, struct clip_ctx * ctx_clip, int n_threads, const unsigned char * image_bytes, int image_bytes_length) {
+    const uint64_t key = llava_image_embed_cache_key(ctx_clip, image_bytes, image_bytes_length);
+    const int n_embd = clip_n_mmproj_embd(ctx_clip);
+
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+
+        auto it = cache->index.find(key);
+        if (it != cache->index.end()) {
+            cache->entries.splice(cache->entries.begin(), cache->entries, it->second);
+            return llava_image_embed_from_entry(*it->second);
+        }
+    }
+
+    llava_image_embed_cache_entry entry;
+    if (!cache->dir.empty() && llava_image_embed_cache_read(cache, key, n_embd, entry)) {
+        llava_image_embed * result = llava_image_embed_from_entry(entry);
+
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        llava_image_embed_cache_insert(cache, std::move(entry));
+        return result;
+    }
+
+    llava_image_embed * result = llava_image_embed_make_with_bytes(ctx_clip, n_threads, image_bytes, image_bytes_length);
+    if (!result) {
+        return NULL;
+    }
+
+    entry.key         = key;
+    entry.n_image_pos = result->n_image_pos;
+    entry.embed.assign(result->embed, result->embed + (size_t) result->n_image_pos * n_embd);
+
+    if (!cache->dir.empty()) {
+        llava_image_embed_cache_write(cache, entry, n_embd);
+    }
+
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    llava_image_embed_cache_insert(cache, std::move(entry));
+
+    return result;
+}
+
+struct llava_image_embed * llava_image_embed_make_with_filename_cached(struct llava_image_embed_cache * cache, struct clip_ctx * ctx_clip, int n_threads, const char * image_path) {
+    unsigned char* image_bytes;
+    long image_bytes_length;
+    auto loaded = load_file_to_bytes(image_path, &image_bytes, &image_bytes_length);
+    if (!loaded) {
+        LOG_TEE("%s: failed to load %s\n", __func__, image_path);
+        return NULL;
+    }
+
+    llava_image_embed *embed = llava_image_embed_make_with_bytes_cached(cache, ctx_clip, n_threads, image_bytes, image_bytes_length);
+    free(image_bytes);
+
+    return embed;
+}
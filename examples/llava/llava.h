@@ -40,6 +40,18 @@ LLAVA_API struct llava_image_embed * llava_image_embed_make_with_filename(struct
 LLAVA_API void llava_image_embed_free(struct llava_image_embed * embed);
 /** free an embedding made with llava_image_embed_make_* */
 
+/** cache of image embeds keyed by a hash of the image file bytes, so that the same image is encoded only once
+    the embeds are kept in memory up to max_bytes (least recently used first out), and also in the directory dir if it is not NULL */
+struct llava_image_embed_cache;
+
+LLAVA_API struct llava_image_embed_cache * llava_image_embed_cache_init(size_t max_bytes, const char * dir);
+LLAVA_API void llava_image_embed_cache_free(struct llava_image_embed_cache * cache);
+
+/** same as llava_image_embed_make_with_bytes and llava_image_embed_make_with_filename, but reuse the embed of the same image if it is in the cache
+    the returned embed is a copy, free it with llava_image_embed_free */
+LLAVA_API struct llava_image_embed * llava_image_embed_make_with_bytes_cached(struct llava_image_embed_cache * cache, struct clip_ctx * ctx_clip, int n_threads, const unsigned char * image_bytes, int image_bytes_length);
+LLAVA_API struct llava_image_embed * llava_image_embed_make_with_filename_cached(struct llava_image_embed_cache * cache, struct clip_ctx * ctx_clip, int n_threads, const char * image_path);
+
 /** write the image represented by embed into the llama context with batch size n_batch, starting at context pos n_past. on completion, n_past points to the next position in the context after the image embed. */
 LLAVA_API bool llava_eval_image_embed(struct llama_context * ctx_llama, const struct llava_image_embed * embed, int n_batch, int * n_past);
 
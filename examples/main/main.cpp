@@ -52,6 +52,18 @@ static bool file_is_empty(const std::string & path) {
     return f.tellg() == 0;
 }
 
+static bool save_session_file(llama_context * ctx, const gpt_params & params, const std::string & path, const std::vector<llama_token> & tokens) {
+    if (!params.prompt_cache_compact) {
+        return llama_state_save_file(ctx, path.c_str(), tokens.data(), tokens.size());
+    }
+
+    llama_state_file_params sparams = llama_state_file_default_params();
+    // the logits are reused when the prompt matches the whole session
+    sparams.outputs = true;
+
+    return llama_state_save_file_ext(ctx, path.c_str(), tokens.data(), tokens.size(), sparams);
+}
+
 static void write_logfile(
     const llama_context * ctx, const gpt_params & params, const llama_model * model,
     const std::vector<llama_token> & input_tokens, const std::string & output,
@@ -723,7 +735,7 @@ int main(int argc, char ** argv) {
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
                 need_to_save_session = false;
-                llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+                save_session_file(ctx, params, path_session, session_tokens);
 
                 LOG("saved session to %s\n", path_session.c_str());
             }
@@ -972,10 +984,11 @@ int main(int argc, char ** argv) {
 
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
-        llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        save_session_file(ctx, params, path_session, session_tokens);
     }
 
     llama_print_timings(ctx);
+    llama_model_print_expert_stats(model);
     write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
 
     if (ctx_guidance) { llama_free(ctx_guidance); }
@@ -101,15 +101,8 @@ static std::vector<float> softmax(const std::vector<float>& logits) {
 }
 
 static results_log_softmax log_softmax(int n_vocab, const float * logits, int tok) {
-    float max_logit = logits[0];
-    for (int i = 1; i < n_vocab; ++i) {
-        max_logit = std::max(max_logit, logits[i]);
-    }
-    double sum_exp = 0.0;
-    for (int i = 0; i < n_vocab; ++i) {
-        sum_exp += expf(logits[i] - max_logit);
-    }
-    return {logits[tok] - max_logit - log(sum_exp), logits[tok], expf(logits[tok] - max_logit) / (float) sum_exp};
+    const float log_sum_exp = ggml_log_sum_exp_f32(logits, n_vocab);
+    return {logits[tok] - log_sum_exp, logits[tok], expf(logits[tok] - log_sum_exp)};
 }
 
 static inline int nearest_int(float fval) {
@@ -127,11 +120,7 @@ static double log_softmax(int n_vocab, const float * logits, uint16_t * log_prob
         min_logit = std::min(min_logit, logits[i]);
     }
     min_logit = std::max(min_logit, max_logit - 16);
-    double sum_exp = 0.0;
-    for (int i = 0; i < n_vocab; ++i) {
-        sum_exp += expf(logits[i] - max_logit);
-    }
-    const float log_sum_exp = log(sum_exp);
+    const float log_sum_exp = ggml_log_sum_exp_f32(logits, n_vocab) - max_logit;
     const float min_log_prob = min_logit - max_logit - log_sum_exp;
     const float scale = (max_logit - min_logit)/65535.f;
     float * d = (float *)log_prob;
@@ -240,11 +229,7 @@ static std::pair<double, float> log_softmax(int n_vocab, const float * logits, c
             imax = i;
         }
     }
-    double sum_exp = 0.0;
-    for (int i = 0; i < n_vocab; ++i) {
-        sum_exp += expf(logits[i] - max_logit);
-    }
-    const float log_sum_exp = log(sum_exp);
+    const float log_sum_exp = ggml_log_sum_exp_f32(logits, n_vocab) - max_logit;
     const float * d = (const float *)base_log_prob;
     const float scale = d[0];
     const float min_log_prob = d[1];
@@ -334,6 +319,33 @@ static void process_logits(int n_vocab, const float * logits, const int * tokens
     }
 }
 
+// reduces the logits of a batch to the statistics in a background thread, while the next batch is being evaluated
+// the logits are copied out of the context first, since the next llama_decode overwrites them, so that only the
+// outputs of one batch are kept in memory regardless of the context size
+struct logits_reducer {
+    std::vector<float> logits;
+    std::thread thread;
+
+    ~logits_reducer() {
+        wait();
+    }
+
+    void wait() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // f is called with the logits of the last batch, after the previously submitted reduction has finished
+    template <typename F>
+    void submit(llama_context * ctx, int n_outputs, int n_vocab, F && f) {
+        wait();
+        logits.resize((size_t)n_outputs*n_vocab);
+        memcpy(logits.data(), llama_get_logits(ctx), logits.size()*sizeof(float));
+        thread = std::thread(std::forward<F>(f), (const float *) logits.data());
+    }
+};
+
 static results_perplexity perplexity_v2(llama_context * ctx, const gpt_params & params) {
     // Download: https://huggingface.co/datasets/ggml-org/ci/resolve/main/wikitext-2-raw-v1.zip
     // Run `./perplexity -m models/7B/ggml-model-q4_0.bin -f wiki.test.raw`
@@ -345,7 +357,7 @@ static results_perplexity perplexity_v2(llama_context * ctx, const gpt_params &
 
     fprintf(stderr, "%s: tokenizing the input ..\n", __func__);
 
-    std::vector<llama_token> tokens = ::llama_tokenize(ctx, params.prompt, true);
+    std::vector<llama_token> tokens = ::llama_tokenize_parallel(ctx, params.prompt, true, false, params.n_threads);
 
     const int n_ctx = llama_n_ctx(ctx);
 
@@ -498,7 +510,7 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     auto tim1 = std::chrono::high_resolution_clock::now();
     fprintf(stderr, "%s: tokenizing the input ..\n", __func__);
 
-    std::vector<llama_token> tokens = ::llama_tokenize(ctx, params.prompt, true);
+    std::vector<llama_token> tokens = ::llama_tokenize_parallel(ctx, params.prompt, true, false, params.n_threads);
 
     auto tim2 = std::chrono::high_resolution_clock::now();
     fprintf(stderr, "%s: tokenization took %g ms\n",__func__,1e-3*std::chrono::duration_cast<std::chrono::microseconds>(tim2-tim1).count());
@@ -534,11 +546,6 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
     llama_batch batch = llama_batch_init(std::min(n_batch, n_ctx*n_seq), 0, 1);
 
-    std::vector<float> logits;
-    if (num_batches > 1) {
-        logits.reserve((size_t)n_ctx * n_vocab);
-    }
-
     fprintf(stderr, "%s: calculating perplexity over %d chunks, n_ctx=%d, batch_size=%d, n_seq=%d\n", __func__, n_chunk, n_ctx, n_batch, n_seq);
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
@@ -549,9 +556,11 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         logits_stream.write((const char *)&n_chunk, sizeof(n_chunk));
         logits_stream.write((const char *)tokens.data(), n_chunk*n_ctx*sizeof(tokens[0]));
         const int nv = 2*((n_vocab + 1)/2) + 4;
-        log_probs.resize(n_ctx * nv);
+        log_probs.resize((size_t)std::min(n_batch, n_ctx) * nv);
     }
 
+    logits_reducer reducer;
+
     // We get the logits for all the tokens in the context window (params.n_ctx)
     // from llama_eval above.  Now, based on https://huggingface.co/docs/transformers/perplexity,
     // calculate the perplexity over the last half of the window (so the model always has
@@ -613,13 +622,55 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
             if (llama_decode(ctx, batch)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                reducer.wait();
                 return {tokens, -1, logit_history, prob_history};
             }
 
-            if (num_batches > 1 && n_outputs > 0) {
-                const auto * batch_logits = llama_get_logits(ctx);
-                logits.insert(logits.end(), batch_logits, batch_logits + n_outputs * n_vocab);
+            if (n_outputs == 0) {
+                continue;
             }
+
+            // the outputs of each sequence are the positions [p0, j*n_batch + batch_size) of the chunk
+            // the last position of the chunk has no next token to predict
+            const int p0       = std::max(first, j*n_batch);
+            const int n_out    = j*n_batch + batch_size - p0;
+            const int n_token  = std::min(n_out, n_ctx - 1 - p0);
+            const bool last    = j == num_batches - 1;
+
+            reducer.submit(ctx, n_outputs, n_vocab, [&, i, start, p0, n_out, n_token, n_seq_batch, last] (const float * batch_logits) {
+                for (int seq = 0; seq < n_seq_batch; seq++) {
+                    const float * seq_logits = batch_logits + (size_t)seq*n_out*n_vocab;
+                    const int i0 = start + seq*n_ctx + p0;
+
+                    if (!params.logits_file.empty()) {
+                        process_logits(logits_stream, n_vocab, seq_logits,
+                                tokens.data() + i0, n_token,
+                                workers, log_probs, nll, nll2);
+                    } else {
+                        process_logits(n_vocab, seq_logits,
+                                tokens.data() + i0, n_token,
+                                workers, nll, nll2,
+                                logit_history.data() + i0,
+                                prob_history.data()  + i0);
+                    }
+                    count += n_token;
+
+                    if (!last) {
+                        continue;
+                    }
+
+                    // perplexity is e^(average negative log-likelihood)
+                    if (params.ppl_output_type == 0) {
+                        printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+                    } else {
+                        double av = nll/count;
+                        double av2 = nll2/count - av*av;
+                        if (av2 > 0) av2 = sqrt(av2/(count-1));
+                        printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
+                    }
+                }
+                fflush(stdout);
+            });
         }
 
 
@@ -636,37 +687,8 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
         }
 
-        for (int seq = 0; seq < n_seq_batch; seq++) {
-            const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
-
-            llama_token * tokens_data = tokens.data() + start + seq*n_ctx + first;
-            if (!params.logits_file.empty()) {
-                process_logits(logits_stream, n_vocab, all_logits,
-                        tokens_data, n_ctx - 1 - first,
-                        workers, log_probs, nll, nll2);
-            } else {
-                process_logits(n_vocab, all_logits,
-                        tokens_data, n_ctx - 1 - first,
-                        workers, nll, nll2,
-                        logit_history.data() + start + seq*n_ctx + first,
-                        prob_history.data()  + start + seq*n_ctx + first);
-            }
-            count += n_ctx - first - 1;
-
-            // perplexity is e^(average negative log-likelihood)
-            if (params.ppl_output_type == 0) {
-                printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
-            } else {
-                double av = nll/count;
-                double av2 = nll2/count - av*av;
-                if (av2 > 0) av2 = sqrt(av2/(count-1));
-                printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
-            }
-        }
-        fflush(stdout);
-
-        logits.clear();
     }
+    reducer.wait();
     printf("\n");
 
     nll2 /= count;
@@ -740,15 +762,7 @@ static void compute_logprobs(const float * batch_logits, int n_vocab, std::vecto
             size_t last = std::min(first + K_TOKEN_CHUNK, eval_results.size());
             for (size_t i = first; i < last; ++i) {
                 auto logits = batch_logits + eval_pairs[i].first * n_vocab;
-                float max_logit = logits[0];
-                for (int j = 1; j < n_vocab; ++j) {
-                    max_logit = std::max(max_logit, logits[j]);
-                }
-                float sum_p = 0.f;
-                for (int j = 0; j < n_vocab; ++j) {
-                    sum_p += expf(logits[j] - max_logit);
-                }
-                local_logprobs[i - first] = logits[eval_pairs[i].second] - max_logit - std::log(sum_p);
+                local_logprobs[i - first] = logits[eval_pairs[i].second] - ggml_log_sum_exp_f32(logits, n_vocab);
             }
             std::memcpy(eval_results.data() + first, local_logprobs, (last - first)*sizeof(float));
         }
@@ -1736,13 +1750,15 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
     GGML_ASSERT(llama_add_eos_token(llama_get_model(ctx)) != 1);
 
-    std::vector<uint16_t> log_probs_uint16(size_t(n_ctx - 1 - n_ctx/2) * nv);
+    // the base log-probs of the batch being evaluated and of the batch being reduced
+    std::vector<uint16_t> log_probs_uint16[2];
+    for (auto & lp : log_probs_uint16) {
+        lp.resize(size_t(std::min(n_batch, (int) n_ctx)) * nv);
+    }
     std::vector<float>    kld_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
     std::vector<float> p_diff_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
-    std::vector<float> logits;
-    if (num_batches > 1) {
-        logits.reserve(n_ctx * n_vocab);
-    }
+
+    llama_batch batch = llama_batch_init(std::min(n_batch, (int) n_ctx), 0, 1);
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
@@ -1768,17 +1784,17 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     auto    kld_ptr =    kld_values.data();
     auto p_diff_ptr = p_diff_values.data();
 
+    const int first = n_ctx/2;
+    int n_submitted = 0;
+
+    logits_reducer reducer;
+
     for (int i = 0; i < n_chunk; ++i) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
-        if (in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t)).fail()) {
-            fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, i);
-            return;
-        }
-
         // clear the KV cache
         llama_kv_cache_clear(ctx);
 
@@ -1794,8 +1810,16 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
                 tokens[batch_start] = llama_token_bos(llama_get_model(ctx));
             }
 
-            // TODO: use llama_batch.logits instead of relying on logits_all == true
-            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
+            int n_outputs = 0;
+
+            llama_batch_clear(batch);
+            for (int k = 0; k < batch_size; ++k) {
+                const bool output = j*n_batch + k >= first;
+                llama_batch_add(batch, tokens[batch_start + k], j*n_batch + k, { 0 }, output);
+                n_outputs += output;
+            }
+
+            if (llama_decode(ctx, batch)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
                 return;
             }
@@ -1803,65 +1827,82 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             // restore the original token in case it was set to BOS
             tokens[batch_start] = token_org;
 
-            if (num_batches > 1) {
-                const auto * batch_logits = llama_get_logits(ctx);
-                logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+            if (n_outputs == 0) {
+                continue;
             }
-        }
 
-        const auto t_end = std::chrono::high_resolution_clock::now();
+            // the last position of the chunk has no next token to predict
+            const int p0      = std::max(first, j*n_batch);
+            const int n_token = std::min(n_outputs, (int) n_ctx - 1 - p0);
+            const bool last   = j == num_batches - 1;
 
-        if (i == 0) {
-            const float t_total = std::chrono::duration<float>(t_end - t_start).count();
-            fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
-            if (total_seconds >= 60*60) {
-                fprintf(stderr, "%d hours ", total_seconds / (60*60));
-                total_seconds = total_seconds % (60*60);
+            // the base log-probs are stored for the positions [first, n_ctx - 1) of each chunk, in order
+            auto * log_probs = &log_probs_uint16[n_submitted++ % 2];
+            if (in.read((char *)log_probs->data(), size_t(n_token)*nv*sizeof(uint16_t)).fail()) {
+                fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, i);
+                return;
             }
-            fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
 
-            printf("\nchunk             PPL               ln(PPL(Q)/PPL(base))          KL Divergence              Δp RMS            Same top p\n");
-        }
+            if (i == 0 && last) {
+                llama_synchronize(ctx);
+                const auto t_end = std::chrono::high_resolution_clock::now();
+                const float t_total = std::chrono::duration<float>(t_end - t_start).count();
+                fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
+                int total_seconds = (int)(t_total * n_chunk);
+                if (total_seconds >= 60*60) {
+                    fprintf(stderr, "%d hours ", total_seconds / (60*60));
+                    total_seconds = total_seconds % (60*60);
+                }
+                fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
+            }
 
-        const int first = n_ctx/2;
-        const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-        process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                workers, log_probs_uint16, kld, kld_ptr, p_diff_ptr);
-        p_diff_ptr += n_ctx - 1 - first;
-        kld_ptr    += n_ctx - 1 - first;
+            reducer.submit(ctx, n_outputs, n_vocab, [&, i, p0, n_token, last, start, log_probs] (const float * batch_logits) {
+                if (i == 0 && p0 == first) {
+                    printf("\nchunk             PPL               ln(PPL(Q)/PPL(base))          KL Divergence              Δp RMS            Same top p\n");
+                }
 
-        printf("%4d", i+1);
+                process_logits(n_vocab, batch_logits, tokens.data() + start + p0, n_token,
+                        workers, *log_probs, kld, kld_ptr, p_diff_ptr);
+                p_diff_ptr += n_token;
+                kld_ptr    += n_token;
 
-        auto log_ppl = mean_and_uncertainty(kld.sum_nll, kld.sum_nll2, kld.count);
-        const double ppl_val = exp(log_ppl.first);
-        const double ppl_unc = ppl_val * log_ppl.second; // ppl_unc = sqrt( (dexp(x) / dx) ** 2 * log_ppl.second ** 2 )
-        printf("    %9.4lf ± %9.4lf", ppl_val, ppl_unc);
+                if (!last) {
+                    return;
+                }
 
-        auto log_ppl_base = mean_and_uncertainty(kld.sum_nll_base, kld.sum_nll_base2, kld.count);
-        const double log_ppl_cov = covariance(kld.sum_nll, kld.sum_nll_base, kld.sum_nll_nll_base, kld.count);
-        const double log_ppl_ratio_val = log_ppl.first - log_ppl_base.first;
-        const double log_ppl_ratio_unc = sqrt(log_ppl.second*log_ppl.second + log_ppl_base.second*log_ppl_base.second - 2.0*log_ppl_cov);
-        printf("    %10.5lf ± %10.5lf", log_ppl_ratio_val, log_ppl_ratio_unc);
+                printf("%4d", i+1);
 
-        auto kl_div = mean_and_uncertainty(kld.sum_kld, kld.sum_kld2, kld.count);
-        printf("    %10.5lf ± %10.5lf", kl_div.first, kl_div.second);
+                auto log_ppl = mean_and_uncertainty(kld.sum_nll, kld.sum_nll2, kld.count);
+                const double ppl_val = exp(log_ppl.first);
+                const double ppl_unc = ppl_val * log_ppl.second; // ppl_unc = sqrt( (dexp(x) / dx) ** 2 * log_ppl.second ** 2 )
+                printf("    %9.4lf ± %9.4lf", ppl_val, ppl_unc);
 
-        auto p_diff_mse   = mean_and_uncertainty(kld.sum_p_diff2, kld.sum_p_diff4, kld.count);
-        const double p_diff_rms_val = sqrt(p_diff_mse.first);
-        const double p_diff_rms_unc = 0.5/p_diff_rms_val * p_diff_mse.second;
-        printf("    %6.3lf ± %6.3lf %%", 100.0*p_diff_rms_val, 100.0*p_diff_rms_unc);
+                auto log_ppl_base = mean_and_uncertainty(kld.sum_nll_base, kld.sum_nll_base2, kld.count);
+                const double log_ppl_cov = covariance(kld.sum_nll, kld.sum_nll_base, kld.sum_nll_nll_base, kld.count);
+                const double log_ppl_ratio_val = log_ppl.first - log_ppl_base.first;
+                const double log_ppl_ratio_unc = sqrt(log_ppl.second*log_ppl.second + log_ppl_base.second*log_ppl_base.second - 2.0*log_ppl_cov);
+                printf("    %10.5lf ± %10.5lf", log_ppl_ratio_val, log_ppl_ratio_unc);
 
-        double p_top_val = 1.*kld.n_same_top/kld.count;
-        double p_top_unc = sqrt(p_top_val*(1 - p_top_val)/(kld.count - 1));
-        printf("    %6.3lf ± %6.3lf %%", 100.0*p_top_val, 100.0*p_top_unc);
+                auto kl_div = mean_and_uncertainty(kld.sum_kld, kld.sum_kld2, kld.count);
+                printf("    %10.5lf ± %10.5lf", kl_div.first, kl_div.second);
 
-        printf("\n");
+                auto p_diff_mse   = mean_and_uncertainty(kld.sum_p_diff2, kld.sum_p_diff4, kld.count);
+                const double p_diff_rms_val = sqrt(p_diff_mse.first);
+                const double p_diff_rms_unc = 0.5/p_diff_rms_val * p_diff_mse.second;
+                printf("    %6.3lf ± %6.3lf %%", 100.0*p_diff_rms_val, 100.0*p_diff_rms_unc);
 
-        fflush(stdout);
+                double p_top_val = 1.*kld.n_same_top/kld.count;
+                double p_top_unc = sqrt(p_top_val*(1 - p_top_val)/(kld.count - 1));
+                printf("    %6.3lf ± %6.3lf %%", 100.0*p_top_val, 100.0*p_top_unc);
 
-        logits.clear();
+                printf("\n");
+
+                fflush(stdout);
+            });
+        }
     }
+    reducer.wait();
+    llama_batch_free(batch);
     printf("\n");
 
     if (kld.count < 100) return; // we do not wish to do statistics on so few values
@@ -95,17 +95,22 @@ static void batch_decode(llama_context * ctx, llama_batch & batch, float * outpu
             continue;
         }
 
+        float * out = output + batch.seq_id[i][0] * n_embd;
+
         // try to get sequence embeddings - supported only when pooling_type is not NONE
+        // these are already normalized in the graph
         const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
+        if (embd != NULL) {
+            std::copy(embd, embd + n_embd, out);
+            continue;
+        }
+
+        embd = llama_get_embeddings_ith(ctx, i);
         if (embd == NULL) {
-            embd = llama_get_embeddings_ith(ctx, i);
-            if (embd == NULL) {
-                fprintf(stderr, "%s: failed to get embeddings for token %d\n", __func__, i);
-                continue;
-            }
+            fprintf(stderr, "%s: failed to get embeddings for token %d\n", __func__, i);
+            continue;
         }
 
-        float * out = output + batch.seq_id[i][0] * n_embd;
         llama_embd_normalize(embd, out, n_embd);
     }
 }
@@ -206,6 +206,61 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "%s : seq 1 restored, %zd bytes\n", __func__, nset);
     }
 
+    // save the second half of seq 1 as a delta and restore it over the removed cells
+    {
+        const llama_pos p0 = n_past / 2;
+
+        std::vector<uint8_t> delta_store(llama_state_seq_get_size_delta(ctx3, 1, p0));
+        const size_t ncopy = llama_state_seq_get_data_delta(ctx3, delta_store.data(), 1, p0);
+        if (ncopy != delta_store.size()) {
+            fprintf(stderr, "\n%s : seq delta data length %zd does not match expected length %zd\n", __func__, ncopy, delta_store.size());
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 1 delta from pos %d copied, %zd bytes\n", __func__, p0, ncopy);
+
+        llama_kv_cache_seq_rm(ctx3, 1, p0, -1);
+
+        const size_t nset = llama_state_seq_set_data_delta(ctx3, delta_store.data(), 1);
+        if (nset != delta_store.size()) {
+            fprintf(stderr, "\n%s : seq delta set data length %zd does not match expected length %zd\n", __func__, nset, delta_store.size());
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 1 delta restored, %zd bytes\n", __func__, nset);
+    }
+
+    // round-trip seq 1 through a compressed compact file that keeps the cache type
+    {
+        llama_state_file_params sparams = llama_state_file_default_params();
+        sparams.type_kv  = GGML_TYPE_COUNT;
+        sparams.compress = true;
+
+        const size_t nsave = llama_state_seq_save_file_ext(ctx3, "dump_seq_compact.bin", 1, tokens.data(), tokens.size(), sparams);
+        if (nsave == 0) {
+            fprintf(stderr, "\n%s : failed to save compact seq state\n", __func__);
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+
+        llama_kv_cache_clear(ctx3);
+
+        std::vector<llama_token> tokens_out(tokens.size());
+        size_t n_token_count_out = 0;
+
+        const size_t nload = llama_state_seq_load_file(ctx3, "dump_seq_compact.bin", 1, tokens_out.data(), tokens_out.size(), &n_token_count_out);
+        if (nload != nsave || tokens_out != tokens) {
+            fprintf(stderr, "\n%s : compact seq state load failed (%zd bytes of %zd)\n", __func__, nload, nsave);
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 1 restored from a compact file, %zd bytes\n", __func__, nload);
+    }
+
     // third run with seq 1 instead of 0
     for (auto i = 0; i < params.n_predict; i++) {
         auto * logits = llama_get_logits(ctx3);
@@ -0,0 +1,537 @@
+// Load generator for llama-server: replays a JSONL trace of completion requests and reports the latency percentiles
+//
+// Each line of the trace is a JSON object:
+//   timestamp      : arrival time of the request in seconds, relative to the first request (open-loop mode only)
+//   prompt         : the prompt text, or
+//   prompt_tokens  : the length of a synthetic prompt made of random token ids
+//   prefix_tokens  : number of leading synthetic tokens shared by all the requests with the same prefix_id
+//   prefix_id      : id of the shared prefix (default: 0)
+//   n_predict      : number of tokens to generate (default: --n-predict)
+//   params         : extra fields merged into the /completion request body, e.g. {"priority": "batch"}
+
+#include "httplib.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+enum bench_mode {
+    BENCH_MODE_OPEN,   // requests are sent at their arrival time, whether the previous ones have completed or not
+    BENCH_MODE_CLOSED, // a fixed number of clients, each sending its next request when the previous one has completed
+};
+
+struct bench_params {
+    std::string url         = "http://127.0.0.1:8080";
+    std::string trace;
+    std::string output;
+    std::string prompt_key  = "prompt";
+    bench_mode  mode        = BENCH_MODE_OPEN;
+    int         n_clients   = 8;
+    int         n_requests  = -1;
+    int         n_predict   = 128;
+    double      time_scale  = 1.0;
+    double      rate        = 0.0; // req/s, when > 0 the arrivals follow a Poisson process instead of the trace timestamps
+    bool        cache_prompt = true;
+    int         timeout     = 600;
+    uint32_t    seed        = 42;
+};
+
+struct bench_request {
+    double t_arrival = 0.0; // s
+    json   body;
+};
+
+struct bench_result {
+    bool        ok          = false;
+    std::string error;
+    double      t_send      = 0.0; // s, since the start of the benchmark
+    double      ttft        = 0.0; // s
+    double      latency     = 0.0; // s
+    int         n_prompt    = 0;
+    int         n_cached    = 0; // prompt tokens reused from the prompt cache
+    int         n_predicted = 0;
+    std::vector<double> itl;       // s, between consecutive streamed tokens
+};
+
+static void print_usage(int /* argc */, char ** argv) {
+    const bench_params def;
+
+    printf("usage: %s -f <trace.jsonl> [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help\n");
+    printf("  -f, --trace <filename>              JSONL trace to replay\n");
+    printf("  -u, --url <url>                     (default: %s)\n", def.url.c_str());
+    printf("  --mode <open|closed>                (default: open)\n");
+    printf("  -c, --clients <n>                   number of clients in closed-loop mode (default: %d)\n", def.n_clients);
+    printf("  -n, --n-requests <n>                number of requests to send, the trace is repeated if needed (default: trace size)\n");
+    printf("  --n-predict <n>                     tokens to generate when the trace does not specify it (default: %d)\n", def.n_predict);
+    printf("  --time-scale <f>                    multiply the trace timestamps by f (default: %.1f)\n", def.time_scale);
+    printf("  --rate <r>                          Poisson arrivals at r req/s instead of the trace timestamps (default: disabled)\n");
+    printf("  --prompt-key <key>                  field of the trace holding the prompt text (default: %s)\n", def.prompt_key.c_str());
+    printf("  --no-cache-prompt                   do not reuse the prompt cache of the slots\n");
+    printf("  --timeout <s>                       timeout of a request (default: %d)\n", def.timeout);
+    printf("  -s, --seed <n>                      seed of the synthetic prompts and of the arrivals (default: %u)\n", def.seed);
+    printf("  -o, --output <filename>             write the JSON summary to filename\n");
+}
+
+static bool parse_params(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        } else if ((arg == "-f" || arg == "--trace") && has_value) {
+            params.trace = argv[++i];
+        } else if ((arg == "-u" || arg == "--url") && has_value) {
+            params.url = argv[++i];
+        } else if (arg == "--mode" && has_value) {
+            const std::string value = argv[++i];
+            if (value == "open") {
+                params.mode = BENCH_MODE_OPEN;
+            } else if (value == "closed") {
+                params.mode = BENCH_MODE_CLOSED;
+            } else {
+                fprintf(stderr, "error: invalid mode: %s\n", value.c_str());
+                return false;
+            }
+        } else if ((arg == "-c" || arg == "--clients") && has_value) {
+            params.n_clients = std::stoi(argv[++i]);
+        } else if ((arg == "-n" || arg == "--n-requests") && has_value) {
+            params.n_requests = std::stoi(argv[++i]);
+        } else if (arg == "--n-predict" && has_value) {
+            params.n_predict = std::stoi(argv[++i]);
+        } else if (arg == "--time-scale" && has_value) {
+            params.time_scale = std::stod(argv[++i]);
+        } else if (arg == "--rate" && has_value) {
+            params.rate = std::stod(argv[++i]);
+        } else if (arg == "--prompt-key" && has_value) {
+            params.prompt_key = argv[++i];
+        } else if (arg == "--no-cache-prompt") {
+            params.cache_prompt = false;
+        } else if (arg == "--timeout" && has_value) {
+            params.timeout = std::stoi(argv[++i]);
+        } else if ((arg == "-s" || arg == "--seed") && has_value) {
+            params.seed = std::stoul(argv[++i]);
+        } else if ((arg == "-o" || arg == "--output") && has_value) {
+            params.output = argv[++i];
+        } else {
+            fprintf(stderr, "error: invalid argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            return false;
+        }
+    }
+
+    if (params.trace.empty()) {
+        fprintf(stderr, "error: no trace given, use -f\n");
+        return false;
+    }
+    if (params.n_clients < 1) {
+        fprintf(stderr, "error: the number of clients must be at least 1\n");
+        return false;
+    }
+
+    return true;
+}
+
+// synthetic token ids are drawn from [1000, 2000) so that they are regular tokens with any common vocabulary
+static void append_random_tokens(json & tokens, int n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> dist(1000, 1999);
+    for (int i = 0; i < n; ++i) {
+        tokens.push_back(dist(rng));
+    }
+}
+
+static bool load_trace(const bench_params & params, std::vector<bench_request> & requests) {
+    std::ifstream fin(params.trace);
+    if (!fin) {
+        fprintf(stderr, "error: failed to open %s\n", params.trace.c_str());
+        return false;
+    }
+
+    std::string line;
+    int n_line = 0;
+    while (std::getline(fin, line)) {
+        n_line++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        json entry;
+        try {
+            entry = json::parse(line);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "error: %s:%d: %s\n", params.trace.c_str(), n_line, e.what());
+            return false;
+        }
+
+        bench_request req;
+        req.t_arrival = entry.value("timestamp", 0.0) * params.time_scale;
+
+        if (entry.contains(params.prompt_key)) {
+            req.body["prompt"] = entry.at(params.prompt_key);
+        } else if (entry.contains("prompt_tokens")) {
+            const int n_prompt = entry.at("prompt_tokens");
+            const int n_prefix = std::min(n_prompt, entry.value("prefix_tokens", 0));
+
+            json tokens = json::array();
+            append_random_tokens(tokens, n_prefix, params.seed + 0x9e3779b9u*(1 + entry.value("prefix_id", 0)));
+            append_random_tokens(tokens, n_prompt - n_prefix, params.seed + n_line);
+            req.body["prompt"] = tokens;
+        } else {
+            fprintf(stderr, "error: %s:%d: no \"%s\" or \"prompt_tokens\" field\n", params.trace.c_str(), n_line, params.prompt_key.c_str());
+            return false;
+        }
+
+        // the target length is reached whatever the model generates
+        req.body["n_predict"]    = entry.value("n_predict", params.n_predict);
+        req.body["ignore_eos"]   = true;
+        req.body["stream"]       = true;
+        req.body["cache_prompt"] = params.cache_prompt;
+
+        if (entry.contains("params")) {
+            for (const auto & el : entry.at("params").items()) {
+                req.body[el.key()] = el.value();
+            }
+        }
+
+        requests.push_back(std::move(req));
+    }
+
+    if (requests.empty()) {
+        fprintf(stderr, "error: %s is empty\n", params.trace.c_str());
+        return false;
+    }
+
+    // the first request arrives at t = 0
+    std::stable_sort(requests.begin(), requests.end(), [](const bench_request & a, const bench_request & b) {
+        return a.t_arrival < b.t_arrival;
+    });
+    const double t0 = requests[0].t_arrival;
+    for (auto & req : requests) {
+        req.t_arrival -= t0;
+    }
+
+    // repeat the trace to reach the requested number of requests, shifted by its duration
+    if (params.n_requests > 0) {
+        const size_t n_trace = requests.size();
+        const double t_trace = requests.back().t_arrival;
+        for (size_t i = n_trace; i < (size_t) params.n_requests; ++i) {
+            bench_request req = requests[i % n_trace];
+            req.t_arrival += (i / n_trace) * t_trace;
+            requests.push_back(std::move(req));
+        }
+        requests.resize(params.n_requests);
+    }
+
+    if (params.rate > 0.0) {
+        std::mt19937 rng(params.seed);
+        std::exponential_distribution<double> dist(params.rate);
+        double t = 0.0;
+        for (auto & req : requests) {
+            req.t_arrival = t;
+            t += dist(rng);
+        }
+    }
+
+    return true;
+}
+
+static double time_s(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static bench_result send_request(const bench_params & params, const bench_request & request, std::chrono::steady_clock::time_point t0) {
+    bench_result result;
+
+    httplib::Client cli(params.url);
+    cli.set_connection_timeout(params.timeout, 0);
+    cli.set_read_timeout(params.timeout, 0);
+
+    std::string buffer;
+    double t_last = 0.0;
+
+    httplib::Request req;
+    req.method = "POST";
+    req.path   = "/completion";
+    req.body   = request.body.dump();
+    req.set_header("Content-Type", "application/json");
+
+    // the server streams one "data: {...}\n\n" event per token, and a final event with stop = true
+    req.content_receiver = [&](const char * data, size_t len, uint64_t, uint64_t) {
+        const double t_now = time_s(t0);
+        buffer.append(data, len);
+
+        size_t pos;
+        while ((pos = buffer.find("\n\n")) != std::string::npos) {
+            const std::string event = buffer.substr(0, pos);
+            buffer.erase(0, pos + 2);
+
+            if (event.compare(0, 6, "data: ") != 0) {
+                continue;
+            }
+
+            json chunk;
+            try {
+                chunk = json::parse(event.substr(6));
+            } catch (const std::exception & e) {
+                result.error = e.what();
+                return false;
+            }
+
+            if (chunk.contains("error")) {
+                result.error = chunk.at("error").dump();
+                return false;
+            }
+
+            if (chunk.value("stop", false)) {
+                result.ok          = true;
+                result.latency     = t_now - result.t_send;
+                result.n_prompt    = chunk.value("tokens_evaluated", 0);
+                // tokens_cached also counts the generated tokens, the prompt tokens that were not evaluated come from the cache
+                result.n_cached    = std::max(0, result.n_prompt - chunk.at("timings").value("prompt_n", result.n_prompt));
+                result.n_predicted = chunk.value("tokens_predicted", 0);
+                continue;
+            }
+
+            if (t_last == 0.0) {
+                result.ttft = t_now - result.t_send;
+            } else {
+                result.itl.push_back(t_now - t_last);
+            }
+            t_last = t_now;
+        }
+
+        return true;
+    };
+
+    result.t_send = time_s(t0);
+
+    auto res = cli.send(req);
+    if (!res) {
+        result.ok    = false;
+        result.error = httplib::to_string(res.error());
+    } else if (res->status != 200) {
+        result.ok    = false;
+        result.error = "HTTP " + std::to_string(res->status) + (result.error.empty() ? "" : ": " + result.error);
+    } else if (!result.ok && result.error.empty()) {
+        result.error = "the stream ended before the final event";
+    }
+
+    return result;
+}
+
+struct bench_stats {
+    size_t n    = 0;
+    double mean = 0.0;
+    double p50  = 0.0;
+    double p90  = 0.0;
+    double p95  = 0.0;
+    double p99  = 0.0;
+    double max  = 0.0;
+
+    json to_json() const {
+        return json {
+            {"n",    n},
+            {"mean", mean},
+            {"p50",  p50},
+            {"p90",  p90},
+            {"p95",  p95},
+            {"p99",  p99},
+            {"max",  max},
+        };
+    }
+};
+
+// percentiles with linear interpolation between the closest ranks
+static bench_stats compute_stats(std::vector<double> v) {
+    bench_stats st;
+    if (v.empty()) {
+        return st;
+    }
+
+    std::sort(v.begin(), v.end());
+
+    auto percentile = [&](double p) {
+        const double r  = p / 100.0 * (v.size() - 1);
+        const size_t lo = (size_t) std::floor(r);
+        const size_t hi = std::min(lo + 1, v.size() - 1);
+        return v[lo] + (r - lo) * (v[hi] - v[lo]);
+    };
+
+    double sum = 0.0;
+    for (double x : v) {
+        sum += x;
+    }
+
+    st.n    = v.size();
+    st.mean = sum / v.size();
+    st.p50  = percentile(50);
+    st.p90  = percentile(90);
+    st.p95  = percentile(95);
+    st.p99  = percentile(99);
+    st.max  = v.back();
+
+    return st;
+}
+
+int main(int argc, char ** argv) {
+    bench_params params;
+    if (!parse_params(argc, argv, params)) {
+        return 1;
+    }
+
+    std::vector<bench_request> requests;
+    if (!load_trace(params, requests)) {
+        return 1;
+    }
+
+    {
+        httplib::Client cli(params.url);
+        cli.set_connection_timeout(params.timeout, 0);
+        auto res = cli.Get("/health");
+        if (!res || res->status != 200) {
+            fprintf(stderr, "error: the server at %s is not ready\n", params.url.c_str());
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "%s: replaying %zu requests against %s in %s-loop mode\n", __func__,
+            requests.size(), params.url.c_str(), params.mode == BENCH_MODE_OPEN ? "open" : "closed");
+
+    std::vector<bench_result> results(requests.size());
+
+    const auto t0 = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+
+    if (params.mode == BENCH_MODE_OPEN) {
+        // one thread per request, started at the arrival time of the request
+        for (size_t i = 0; i < requests.size(); ++i) {
+            std::this_thread::sleep_until(t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(requests[i].t_arrival)));
+            workers.emplace_back([&, i]() {
+                results[i] = send_request(params, requests[i], t0);
+            });
+        }
+    } else {
+        std::atomic<size_t> next(0);
+        for (int c = 0; c < params.n_clients; ++c) {
+            workers.emplace_back([&]() {
+                size_t i;
+                while ((i = next++) < requests.size()) {
+                    results[i] = send_request(params, requests[i], t0);
+                }
+            });
+        }
+    }
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    const double t_total = time_s(t0);
+
+    // aggregate
+    std::vector<double> ttft;
+    std::vector<double> itl;
+    std::vector<double> latency;
+    std::vector<double> tpot; // mean time per output token of each request, after the first one
+
+    size_t   n_ok        = 0;
+    uint64_t n_prompt    = 0;
+    uint64_t n_cached    = 0;
+    uint64_t n_predicted = 0;
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result & r = results[i];
+        if (!r.ok) {
+            fprintf(stderr, "%s: request %zu failed: %s\n", __func__, i, r.error.c_str());
+            continue;
+        }
+        n_ok++;
+        n_prompt    += r.n_prompt;
+        n_cached    += r.n_cached;
+        n_predicted += r.n_predicted;
+
+        ttft.push_back(r.ttft);
+        latency.push_back(r.latency);
+        itl.insert(itl.end(), r.itl.begin(), r.itl.end());
+        if (r.n_predicted > 1) {
+            tpot.push_back((r.latency - r.ttft) / (r.n_predicted - 1));
+        }
+    }
+
+    const bench_stats st_ttft    = compute_stats(ttft);
+    const bench_stats st_itl     = compute_stats(itl);
+    const bench_stats st_tpot    = compute_stats(tpot);
+    const bench_stats st_latency = compute_stats(latency);
+
+    printf("\n");
+    printf("| %-16s | %10s | %10s | %10s | %10s | %10s | %10s |\n", "metric (ms)", "mean", "p50", "p90", "p95", "p99", "max");
+    printf("| %-16s | %10s | %10s | %10s | %10s | %10s | %10s |\n", "----------------", "---------:", "---------:", "---------:", "---------:", "---------:", "---------:");
+    auto print_row = [](const char * name, const bench_stats & st) {
+        printf("| %-16s | %10.2f | %10.2f | %10.2f | %10.2f | %10.2f | %10.2f |\n", name,
+                1e3*st.mean, 1e3*st.p50, 1e3*st.p90, 1e3*st.p95, 1e3*st.p99, 1e3*st.max);
+    };
+    print_row("ttft",    st_ttft);
+    print_row("itl",     st_itl);
+    print_row("tpot",    st_tpot);
+    print_row("latency", st_latency);
+    printf("\n");
+    printf("requests:          %zu ok, %zu failed\n", n_ok, results.size() - n_ok);
+    printf("duration:          %.2f s\n", t_total);
+    printf("request rate:      %.2f req/s\n", n_ok / t_total);
+    printf("prompt tokens:     %" PRIu64 " (%" PRIu64 " cached, %.1f%%)\n", n_prompt, n_cached, n_prompt ? 100.0 * n_cached / n_prompt : 0.0);
+    printf("output tokens:     %" PRIu64 "\n", n_predicted);
+    printf("output throughput: %.2f t/s\n", n_predicted / t_total);
+    printf("total throughput:  %.2f t/s\n", (n_prompt + n_predicted) / t_total);
+
+    if (!params.output.empty()) {
+        const json summary = {
+            {"url",                params.url},
+            {"trace",              params.trace},
+            {"mode",               params.mode == BENCH_MODE_OPEN ? "open" : "closed"},
+            {"n_clients",          params.mode == BENCH_MODE_CLOSED ? params.n_clients : 0},
+            {"n_requests",         results.size()},
+            {"n_ok",               n_ok},
+            {"n_failed",           results.size() - n_ok},
+            {"duration_s",         t_total},
+            {"request_throughput", n_ok / t_total},
+            {"output_throughput",  n_predicted / t_total},
+            {"total_throughput",   (n_prompt + n_predicted) / t_total},
+            {"n_prompt_tokens",    n_prompt},
+            {"n_cached_tokens",    n_cached},
+            {"n_predicted_tokens", n_predicted},
+            {"ttft_s",             st_ttft.to_json()},
+            {"itl_s",              st_itl.to_json()},
+            {"tpot_s",             st_tpot.to_json()},
+            {"latency_s",          st_latency.to_json()},
+        };
+
+        std::ofstream fout(params.output);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open %s\n", params.output.c_str());
+            return 1;
+        }
+        fout << summary.dump(4) << std::endl;
+    }
+
+    return n_ok == results.size() ? 0 : 1;
+}
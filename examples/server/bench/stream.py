@@ -0,0 +1,85 @@
+from __future__ import annotations
+
+import argparse
+import json
+import threading
+import time
+
+import requests
+from statistics import mean, quantiles
+
+
+def main(args_in: list[str] | None = None) -> None:
+    parser = argparse.ArgumentParser(description="Many synthetic streaming clients against a running server")
+    parser.add_argument("--url", type=str, help="Server url", default="http://localhost:8080")
+    parser.add_argument("--clients", type=int, help="Number of concurrent streaming clients", default=256)
+    parser.add_argument("--requests", type=int, help="Number of requests per client", default=4)
+    parser.add_argument("--n-predict", type=int, help="Tokens to predict per request", default=128)
+    parser.add_argument("--prompt", type=str, help="Prompt of each request", default="Write a long story about a cat.")
+    args = parser.parse_args(args_in)
+
+    lock = threading.Lock()
+    ttft: list[float] = []  # time to first token
+    itl: list[float] = []   # inter-token latency
+    n_tokens = 0
+    n_errors = 0
+
+    def client(i_client: int) -> None:
+        nonlocal n_tokens, n_errors
+        with requests.Session() as session:
+            for _ in range(args.requests):
+                t_last = time.perf_counter()
+                t_client: list[float] = []
+                first = True
+                try:
+                    with session.post(f"{args.url}/completion", stream=True, json={
+                        "prompt": args.prompt,
+                        "n_predict": args.n_predict,
+                        "stream": True,
+                        "cache_prompt": False,
+                    }) as response:
+                        response.raise_for_status()
+                        for line in response.iter_lines():
+                            if not line.startswith(b"data: "):
+                                continue
+                            data = json.loads(line[6:])
+                            t_now = time.perf_counter()
+                            if first:
+                                with lock:
+                                    ttft.append(t_now - t_last)
+                                first = False
+                            else:
+                                t_client.append(t_now - t_last)
+                            t_last = t_now
+                            if data.get("stop"):
+                                break
+                except requests.RequestException as e:
+                    print(f"client {i_client}: {e}")
+                    with lock:
+                        n_errors += 1
+                    continue
+                with lock:
+                    itl.extend(t_client)
+                    n_tokens += len(t_client) + 1
+
+    t_start = time.perf_counter()
+    threads = [threading.Thread(target=client, args=(i,)) for i in range(args.clients)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    t_total = time.perf_counter() - t_start
+
+    def ms(values: list[float], q: int) -> float:
+        if len(values) < 2:
+            return 1e3 * mean(values) if values else 0.0
+        return 1e3 * quantiles(values, n=100)[q - 1]
+
+    print(f"clients: {args.clients}, requests: {args.clients * args.requests}, errors: {n_errors}")
+    print(f"tokens: {n_tokens} in {t_total:.2f} s, {n_tokens / t_total:.2f} tokens/s")
+    print(f"time to first token: p50 {ms(ttft, 50):.2f} ms, p99 {ms(ttft, 99):.2f} ms")
+    print(f"inter-token latency: p50 {ms(itl, 50):.2f} ms, p99 {ms(itl, 99):.2f} ms")
+
+
+if __name__ == '__main__':
+    main()
@@ -33,13 +33,17 @@
 #include "prompt-formats.js.hpp"
 #include "json-schema-to-grammar.mjs.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <set>
 #include <mutex>
+#include <numeric>
 #include <thread>
+#include <unordered_map>
 #include <signal.h>
 #include <memory>
 
@@ -70,14 +74,43 @@ enum server_state {
     SERVER_STATE_ERROR           // An error occurred, load_model failed
 };
 
+// priority classes of completion requests, see the "priority" request parameter
+// prompts of a higher class are scheduled first and deferred requests of a higher class get the next free slot
+enum server_priority {
+    SERVER_PRIORITY_INTERACTIVE,
+    SERVER_PRIORITY_NORMAL,
+    SERVER_PRIORITY_BATCH,
+    SERVER_PRIORITY_COUNT,
+};
+
+static const char * server_priority_name(server_priority priority) {
+    switch (priority) {
+        case SERVER_PRIORITY_INTERACTIVE: return "interactive";
+        case SERVER_PRIORITY_NORMAL:      return "normal";
+        case SERVER_PRIORITY_BATCH:       return "batch";
+        default:                          return "unknown";
+    }
+}
+
+static server_priority server_priority_from_name(const std::string & name) {
+    for (int i = 0; i < SERVER_PRIORITY_COUNT; ++i) {
+        if (name == server_priority_name((server_priority) i)) {
+            return (server_priority) i;
+        }
+    }
+    return SERVER_PRIORITY_NORMAL;
+}
+
 enum server_task_type {
     SERVER_TASK_TYPE_COMPLETION,
     SERVER_TASK_TYPE_CANCEL,
     SERVER_TASK_TYPE_NEXT_RESPONSE,
     SERVER_TASK_TYPE_METRICS,
+    SERVER_TASK_TYPE_PROFILE,
     SERVER_TASK_TYPE_SLOT_SAVE,
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
+    SERVER_TASK_TYPE_EMBEDDING,
 };
 
 struct server_task {
@@ -90,6 +123,9 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    server_priority priority = SERVER_PRIORITY_NORMAL;
+    int64_t         t_queued = 0; // us
 };
 
 struct server_task_result {
@@ -98,6 +134,10 @@ struct server_task_result {
 
     json data;
 
+    // streamed tokens are sent as partial_response and serialized by the http thread, see stream_writer
+    bool partial = false;
+    partial_response data_partial;
+
     bool stop;
     bool error;
 };
@@ -136,6 +176,15 @@ struct server_slot {
     // used to determine the slot that has been used the longest
     int64_t t_last_used = -1;
 
+    // scheduling of the prompt processing
+    server_priority priority = SERVER_PRIORITY_NORMAL;
+    int64_t t_queued         = 0; // us, when the task was received
+    int64_t t_last_scheduled = 0; // us, last time prompt tokens of this slot were added to the batch
+
+    // dynamic slots: the KV cache of the sequence is kept in host memory while the slot is swapped out
+    bool swapped = false;
+    std::vector<uint8_t> swap_data;
+
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
@@ -187,10 +236,15 @@ struct server_slot {
 
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token; // us, when the previous token was sampled
 
     double t_prompt_processing; // ms
     double t_token_generation; // ms
 
+    // prompt cache, accumulated over the lifetime of the slot
+    uint64_t n_prompt_tokens_total        = 0;
+    uint64_t n_prompt_tokens_cached_total = 0; // reused from cache_tokens
+
     void reset() {
         n_prompt_tokens    = 0;
         generated_text     = "";
@@ -205,8 +259,11 @@ struct server_slot {
         infill             = false;
         ga_i               = 0;
         n_past_se          = 0;
+        swapped            = false;
 
         generated_token_probs.clear();
+        swap_data.clear();
+        swap_data.shrink_to_fit();
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -336,6 +393,47 @@ struct server_slot {
     }
 };
 
+// Prometheus histogram with fixed bucket bounds
+// the counters are atomic so that the histogram can be updated and exported from different threads without locking
+struct server_histogram {
+    std::vector<uint64_t> bounds; // inclusive upper bound of each bucket, the +Inf bucket is implicit
+    std::vector<std::atomic<uint64_t>> counts;
+    std::atomic<uint64_t> sum;
+
+    explicit server_histogram(std::vector<uint64_t> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1), sum(0) {
+        for (auto & c : counts) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void observe(uint64_t value) {
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // the observations are divided by scale in the exported values, e.g. 1e6 to export us as seconds
+    void to_prometheus(std::stringstream & ss, const std::string & name, const std::string & help, double scale) const {
+        ss << "# HELP llamacpp:" << name << " " << help << "\n"
+           << "# TYPE llamacpp:" << name << " histogram\n";
+
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            cumulative += counts[i].load(std::memory_order_relaxed);
+            ss << "llamacpp:" << name << "_bucket{le=\"";
+            if (i < bounds.size()) {
+                ss << bounds[i] / scale;
+            } else {
+                ss << "+Inf";
+            }
+            ss << "\"} " << cumulative << "\n";
+        }
+
+        ss << "llamacpp:" << name << "_sum "   << sum.load(std::memory_order_relaxed) / scale << "\n"
+           << "llamacpp:" << name << "_count " << cumulative << "\n";
+    }
+};
+
 struct server_metrics {
     int64_t t_start = 0;
 
@@ -350,15 +448,57 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    // per priority class
+    struct priority_metrics {
+        uint64_t n_requests_total    = 0;
+        uint64_t t_queue_total       = 0; // us, from reception to slot assignment
+        uint64_t n_first_token_total = 0;
+        uint64_t t_first_token_total = 0; // us, from reception to the first generated token
+    };
+
+    priority_metrics priorities[SERVER_PRIORITY_COUNT];
+
+    // latency distributions in us, batch sizes in tokens
+    server_histogram queue_wait     {{ 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000 }};
+    server_histogram time_to_first  {{ 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000 }};
+    server_histogram inter_token    {{ 5000, 10000, 20000, 30000, 50000, 75000, 100000, 150000, 250000, 500000, 1000000, 2500000 }};
+    server_histogram batch_n_tokens {{ 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192 }};
+
     void init() {
         t_start = ggml_time_us();
     }
 
+    void on_slot_launch(const server_slot & slot) {
+        const int64_t t_queue = ggml_time_us() - slot.t_queued;
+
+        priorities[slot.priority].n_requests_total += 1;
+        priorities[slot.priority].t_queue_total    += t_queue;
+
+        queue_wait.observe(t_queue);
+    }
+
     void on_prompt_eval(const server_slot & slot) {
         n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+
+        priorities[slot.priority].n_first_token_total += 1;
+        priorities[slot.priority].t_first_token_total += slot.t_start_generation - slot.t_queued;
+
+        time_to_first.observe(slot.t_start_generation - slot.t_queued);
+    }
+
+    void on_token(server_slot & slot) {
+        const int64_t t_now = ggml_time_us();
+        if (slot.n_decoded > 1) {
+            inter_token.observe(t_now - slot.t_last_token);
+        }
+        slot.t_last_token = t_now;
+    }
+
+    void on_decode(int32_t n_tokens) {
+        batch_n_tokens.observe(n_tokens);
     }
 
     void on_prediction(const server_slot & slot) {
@@ -437,8 +577,11 @@ struct server_queue {
 
     // Call when the state of one slot is changed
     void notify_slot_changed() {
-        // move deferred tasks back to main loop
+        // move deferred tasks back to main loop - higher priority classes first
         std::unique_lock<std::mutex> lock(mutex_tasks);
+        std::stable_sort(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [](const server_task & a, const server_task & b) {
+            return a.priority < b.priority;
+        });
         for (auto & task : queue_tasks_deferred) {
             queue_tasks.push_back(std::move(task));
         }
@@ -544,21 +687,24 @@ struct server_response {
     typedef std::function<void(int, int, server_task_result &)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
 
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
+    // each waiting task has its own result queue and condition variable, so that send() only wakes up
+    // the thread that is waiting for this particular task
+    struct task_channel {
+        std::deque<server_task_result> results;
+        std::condition_variable condition;
+    };
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // for keeping track of all tasks waiting for the result
+    std::unordered_map<int, std::shared_ptr<task_channel>> waiting_tasks;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         LOG_VERBOSE("waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        waiting_tasks.emplace(id_task, std::make_shared<task_channel>());
     }
 
     // when the request is finished, we can remove task associated with it
@@ -566,28 +712,26 @@ struct server_response {
         LOG_VERBOSE("remove waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        waiting_tasks.erase(id_task);
     }
 
     // This function blocks the thread until there is a response for this id_task
     server_task_result recv(int id_task) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+        std::unique_lock<std::mutex> lock(mutex_results);
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (queue_results[i].id == id_task) {
-                    assert(queue_results[i].id_multi == -1);
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
-        }
+        // keep a reference, the channel must outlive a concurrent remove_waiting_task_id()
+        const auto it = waiting_tasks.find(id_task);
+        GGML_ASSERT(it != waiting_tasks.end() && "recv() called for a task that is not waiting");
+        const std::shared_ptr<task_channel> channel = it->second;
 
-        // should never reach here
+        channel->condition.wait(lock, [&]{
+            return !channel->results.empty();
+        });
+
+        server_task_result res = std::move(channel->results.front());
+        channel->results.pop_front();
+        assert(res.id_multi == -1);
+        return res;
     }
 
     // Register the function to update multitask
@@ -600,21 +744,18 @@ struct server_response {
         LOG_VERBOSE("send new result", {{"id_task", result.id}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", id_task);
-            // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.id_multi == id_task) {
-                LOG_VERBOSE("callback_update_multitask", {{"id_task", id_task}});
-                callback_update_multitask(id_task, result.id, result);
-                continue;
-            }
 
-            if (result.id == id_task) {
-                LOG_VERBOSE("queue_results.push_back", {{"id_task", id_task}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
-                return;
-            }
+        // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
+        if (result.id_multi != -1 && waiting_tasks.count(result.id_multi) > 0) {
+            LOG_VERBOSE("callback_update_multitask", {{"id_task", result.id_multi}});
+            callback_update_multitask(result.id_multi, result.id, result);
+        }
+
+        const auto it = waiting_tasks.find(result.id);
+        if (it != waiting_tasks.end()) {
+            LOG_VERBOSE("queue_results.push_back", {{"id_task", result.id}});
+            it->second->results.push_back(std::move(result));
+            it->second->condition.notify_one();
         }
     }
 };
@@ -647,6 +788,9 @@ struct server_context {
 
     server_metrics metrics;
 
+    // per-op timings of the graphs computed on the CPU, when enabled with --profile
+    ggml_profiler * profiler = nullptr;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -656,6 +800,8 @@ struct server_context {
             ctx = nullptr;
         }
 
+        ggml_profiler_free(profiler);
+
         if (model) {
             llama_free_model(model);
             model = nullptr;
@@ -686,6 +832,11 @@ struct server_context {
 
         n_ctx = llama_n_ctx(ctx);
 
+        if (params.endpoint_profile) {
+            profiler = ggml_profiler_init(1 << 20);
+            llama_set_profiler(ctx, profiler);
+        }
+
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
@@ -701,7 +852,8 @@ struct server_context {
     }
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        // with dynamic slots, the slots draw the KV cells from the whole cache on demand
+        const int32_t n_ctx_slot = params.dynamic_slots ? n_ctx : n_ctx / params.n_parallel;
 
         LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
 
@@ -1388,35 +1540,34 @@ struct server_context {
         res.id_multi = slot.id_multi;
         res.error    = false;
         res.stop     = false;
-        res.data     = json {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"id_slot",    slot.id},
-            {"multimodal", false}
-        };
+        res.partial  = true;
+
+        partial_response & partial = res.data_partial;
+        partial.content = std::move(tkn.text_to_send);
+        partial.id_slot = slot.id;
 
         if (slot.sparams.n_probs > 0) {
-            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
+            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, partial.content, false);
             const size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
             const size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
 
-            std::vector<completion_token_output> probs_output;
             if (probs_pos < probs_stop_pos) {
-                probs_output = std::vector<completion_token_output>(
+                partial.probs = std::vector<completion_token_output>(
                         slot.generated_token_probs.begin() + probs_pos,
                         slot.generated_token_probs.begin() + probs_stop_pos);
             }
             slot.n_sent_token_probs = probs_stop_pos;
 
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+            partial.has_probs = true;
         }
 
         if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
+            partial.oaicompat           = true;
+            partial.oaicompat_token_ctr = slot.n_decoded;
+            partial.model               = slot.oaicompat_model;
         }
 
-        queue_results.send(res);
+        queue_results.send(std::move(res));
     }
 
     void send_final_response(const server_slot & slot) {
@@ -1485,25 +1636,28 @@ struct server_context {
                 continue;
             }
 
+            // the sequence embeddings are normalized in the graph
             const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL) {
+            if (embd != NULL) {
+                std::copy(embd, embd + n_embd, embd_res.begin());
+            } else {
                 embd = llama_get_embeddings_ith(ctx, i);
-            }
 
-            if (embd == NULL) {
-                LOG_ERROR("failed to get embeddings", {
-                    {"token",  batch.token [i]},
-                        {"seq_id", batch.seq_id[i][0]}
-                });
+                if (embd == NULL) {
+                    LOG_ERROR("failed to get embeddings", {
+                        {"token",  batch.token [i]},
+                            {"seq_id", batch.seq_id[i][0]}
+                    });
 
-                res.data = json {
-                    {"embedding", std::vector<float>(n_embd, 0.0f)},
-                };
+                    res.data = json {
+                        {"embedding", std::vector<float>(n_embd, 0.0f)},
+                    };
 
-                continue;
-            }
+                    continue;
+                }
 
-            llama_embd_normalize(embd, embd_res.data(), n_embd);
+                llama_embd_normalize(embd, embd_res.data(), n_embd);
+            }
 
             res.data = json {
                 {"embedding", embd_res},
@@ -1513,6 +1667,160 @@ struct server_context {
         queue_results.send(res);
     }
 
+    // embeddings of all the inputs of a request, computed outside of the slots:
+    // the inputs are sorted by length and packed into batches of up to n_ubatch tokens, one sequence per input
+    // non-causal models need the whole sequence in one ubatch, so an input cannot be larger than n_ubatch
+    void process_embeddings(const server_task & task) {
+        const json & prompt = task.data.at("prompt");
+
+        // same rules as request_completion: an array with numbers is a single prompt
+        std::vector<json> inputs;
+        if (prompt.is_array() && std::none_of(prompt.begin(), prompt.end(), [](const json & e) { return e.is_number(); })) {
+            inputs.assign(prompt.begin(), prompt.end());
+        } else {
+            inputs.push_back(prompt);
+        }
+
+        if (inputs.empty()) {
+            send_error(task, "\"input\" must not be empty", ERROR_TYPE_INVALID_REQUEST);
+            return;
+        }
+
+        const int32_t n_ubatch = llama_n_ubatch(ctx);
+        const int32_t n_embd   = llama_n_embd(model);
+
+        std::vector<std::vector<llama_token>> tokens(inputs.size());
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            tokens[i] = tokenize(inputs[i], true);
+
+            if (tokens[i].empty()) {
+                send_error(task, "input " + std::to_string(i) + " is empty", ERROR_TYPE_INVALID_REQUEST);
+                return;
+            }
+            if ((int32_t) tokens[i].size() > n_ubatch) {
+                send_error(task, "input " + std::to_string(i) + " is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+                return;
+            }
+        }
+
+        // longest first, so that the inputs of a batch have similar lengths and the short ones fill the gaps at the end
+        std::vector<size_t> order(inputs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return tokens[a].size() > tokens[b].size();
+        });
+
+        // the sequence ids after the ones of the slots, removed from the cache after each batch
+        const llama_seq_id seq_id_base = params.n_parallel + 1;
+
+        std::vector<json> results(inputs.size());
+
+        llama_batch batch_embd = llama_batch_init(n_ubatch, 0, 1);
+
+        std::vector<size_t>  packed;   // input of each sequence of the batch
+        std::vector<int32_t> i_last;   // index of the last token of each sequence in the batch
+        std::vector<float>   embd_res(n_embd, 0.0f);
+
+        int n_batches = 0;
+
+        const int64_t t_start = ggml_time_us();
+
+        for (size_t i = 0; i < order.size(); ) {
+            llama_batch_clear(batch_embd);
+            packed.clear();
+            i_last.clear();
+
+            while (i < order.size() && batch_embd.n_tokens + (int32_t) tokens[order[i]].size() <= n_ubatch) {
+                const auto & toks = tokens[order[i]];
+                const llama_seq_id seq_id = seq_id_base + packed.size();
+
+                for (size_t j = 0; j < toks.size(); ++j) {
+                    llama_batch_add(batch_embd, toks[j], j, { seq_id }, j == toks.size() - 1);
+                }
+
+                packed.push_back(order[i]);
+                i_last.push_back(batch_embd.n_tokens - 1);
+                ++i;
+            }
+
+            llama_set_embeddings(ctx, true);
+
+            const int ret = llama_decode(ctx, batch_embd);
+            if (ret == 0) {
+                metrics.on_decode(batch_embd.n_tokens);
+            }
+
+            for (size_t k = 0; k < packed.size(); ++k) {
+                const llama_seq_id seq_id = seq_id_base + k;
+
+                if (ret == 0) {
+                    // the sequence embeddings are normalized in the graph
+                    const float * embd = llama_get_embeddings_seq(ctx, seq_id);
+                    const bool pooled = embd != NULL;
+                    if (!pooled) {
+                        embd = llama_get_embeddings_ith(ctx, i_last[k]);
+                    }
+
+                    if (embd == NULL) {
+                        LOG_ERROR("failed to get embeddings", {
+                            {"id_task", task.id},
+                            {"seq_id",  seq_id}
+                        });
+
+                        results[packed[k]] = json {
+                            {"embedding", std::vector<float>(n_embd, 0.0f)},
+                        };
+                    } else {
+                        if (pooled) {
+                            std::copy(embd, embd + n_embd, embd_res.begin());
+                        } else {
+                            llama_embd_normalize(embd, embd_res.data(), n_embd);
+                        }
+
+                        results[packed[k]] = json {
+                            {"embedding", embd_res},
+                        };
+                    }
+                }
+
+                llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            }
+
+            if (ret != 0) {
+                LOG_ERROR("failed to decode the embeddings batch", {
+                    {"id_task",  task.id},
+                    {"n_tokens", batch_embd.n_tokens},
+                    {"ret",      ret}
+                });
+
+                llama_batch_free(batch_embd);
+                send_error(task, "failed to decode the embeddings batch, try a larger context", ERROR_TYPE_SERVER);
+                return;
+            }
+
+            n_batches++;
+        }
+
+        llama_batch_free(batch_embd);
+
+        LOG_VERBOSE("embeddings done", {
+            {"id_task",   task.id},
+            {"n_inputs",  inputs.size()},
+            {"n_batches", n_batches},
+            {"t_ms",      (ggml_time_us() - t_start) / 1e3}
+        });
+
+        server_task_result res;
+        res.id    = task.id;
+        res.stop  = true;
+        res.error = false;
+        res.data  = json {
+            {"results", results},
+        };
+
+        queue_results.send(res);
+    }
+
     void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding) {
         server_task task;
         task.id        = id_task;
@@ -1522,6 +1830,8 @@ struct server_context {
         task.infill    = infill;
         task.embedding = embedding;
         task.type      = SERVER_TASK_TYPE_COMPLETION;
+        task.priority  = server_priority_from_name(json_value(task.data, "priority", std::string("normal")));
+        task.t_queued  = ggml_time_us();
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1633,10 +1943,16 @@ struct server_context {
                     slot->infill    = task.infill;
                     slot->embedding = task.embedding;
 
+                    slot->priority         = task.priority;
+                    slot->t_queued         = task.t_queued;
+                    slot->t_last_scheduled = task.t_queued;
+
                     if (!launch_slot_with_task(*slot, task)) {
                         LOG_ERROR("error while launching slot", task.data);
                         break;
                     }
+
+                    metrics.on_slot_launch(*slot);
                 } break;
             case SERVER_TASK_TYPE_CANCEL:
                 {
@@ -1659,11 +1975,19 @@ struct server_context {
                     int n_idle_slots       = 0;
                     int n_processing_slots = 0;
 
+                    int n_processing_priority[SERVER_PRIORITY_COUNT] = {};
+                    int n_deferred_priority  [SERVER_PRIORITY_COUNT] = {};
+
+                    for (const server_task & task_deferred : queue_tasks.queue_tasks_deferred) {
+                        n_deferred_priority[task_deferred.priority]++;
+                    }
+
                     for (server_slot & slot : slots) {
                         json slot_data = get_formated_generation(slot);
                         slot_data["id"]         = slot.id;
                         slot_data["id_task"]    = slot.id_task;
                         slot_data["state"]      = slot.state;
+                        slot_data["swapped"]    = slot.swapped;
                         slot_data["prompt"]     = slot.prompt;
                         slot_data["next_token"] = {
                             {"has_next_token", slot.has_next_token},
@@ -1679,6 +2003,7 @@ struct server_context {
                             n_idle_slots++;
                         } else {
                             n_processing_slots++;
+                            n_processing_priority[slot.priority]++;
                         }
 
                         slots_data.push_back(slot_data);
@@ -1723,11 +2048,80 @@ struct server_context {
                         { "slots",                           slots_data },
                     };
 
+                    for (int i = 0; i < SERVER_PRIORITY_COUNT; ++i) {
+                        const auto & m = metrics.priorities[i];
+                        res.data["priorities"].push_back({
+                            { "priority",            server_priority_name((server_priority) i) },
+                            { "processing",          n_processing_priority[i] },
+                            { "deferred",            n_deferred_priority[i] },
+                            { "n_requests_total",    m.n_requests_total },
+                            { "t_queue_total",       m.t_queue_total },
+                            { "n_first_token_total", m.n_first_token_total },
+                            { "t_first_token_total", m.t_first_token_total },
+                        });
+                    }
+
+                    // per slot KV cache fragmentation: the fraction of the cells spanned by the sequence that hold other data
+                    {
+                        std::vector<int32_t> n_cells(slots.size(), 0);
+                        std::vector<int32_t> first  (slots.size(), -1);
+                        std::vector<int32_t> last   (slots.size(), -1);
+
+                        llama_kv_cache_view kvc_view = llama_kv_cache_view_init(ctx, params.n_parallel + 1);
+                        llama_kv_cache_view_update(ctx, &kvc_view);
+
+                        for (int32_t i = 0; i < kvc_view.n_cells; ++i) {
+                            const llama_seq_id * cs = kvc_view.cells_sequences + i * kvc_view.n_seq_max;
+                            for (int32_t j = 0; j < kvc_view.n_seq_max; ++j) {
+                                const int id_slot = cs[j] - 1; // slot i uses the sequence i + 1
+                                if (id_slot < 0 || id_slot >= (int) slots.size()) {
+                                    continue;
+                                }
+                                n_cells[id_slot] += 1;
+                                if (first[id_slot] < 0) {
+                                    first[id_slot] = i;
+                                }
+                                last[id_slot] = i;
+                            }
+                        }
+
+                        llama_kv_cache_view_free(&kvc_view);
+
+                        for (const server_slot & slot : slots) {
+                            const int32_t span = last[slot.id] - first[slot.id] + 1;
+                            res.data["slots_cache"].push_back({
+                                { "id",                           slot.id },
+                                { "kv_fragmentation",             n_cells[slot.id] > 0 ? 1.0 - (double) n_cells[slot.id] / span : 0.0 },
+                                { "n_prompt_tokens_total",        slot.n_prompt_tokens_total },
+                                { "n_prompt_tokens_cached_total", slot.n_prompt_tokens_cached_total },
+                            });
+                        }
+                    }
+
                     if (json_value(task.data, "reset_bucket", false)) {
                         metrics.reset_bucket();
                     }
                     queue_results.send(res);
                 } break;
+            case SERVER_TASK_TYPE_PROFILE:
+                {
+                    // the profiler is only updated by llama_decode in this thread
+                    const bool trace = json_value(task.data, "format", std::string("table")) == "trace";
+
+                    server_task_result res;
+                    res.id       = task.id;
+                    res.id_multi = task.id_multi;
+                    res.stop     = true;
+                    res.error    = false;
+                    res.data     = {
+                        { "report", llama_profiler_report(profiler, trace ? GGML_PROFILE_FORMAT_TRACE : GGML_PROFILE_FORMAT_TABLE) },
+                    };
+
+                    if (json_value(task.data, "reset", false)) {
+                        ggml_profiler_reset(profiler);
+                    }
+                    queue_results.send(res);
+                } break;
             case SERVER_TASK_TYPE_SLOT_SAVE:
                 {
                     int id_slot = task.data.at("id_slot");
@@ -1847,6 +2241,10 @@ struct server_context {
                     };
                     queue_results.send(result);
                 } break;
+            case SERVER_TASK_TYPE_EMBEDDING:
+                {
+                    process_embeddings(task);
+                } break;
         }
     }
 
@@ -1870,6 +2268,145 @@ struct server_context {
         queue_results.send(result);
     }
 
+    //
+    // dynamic slots
+    //
+
+    // number of KV cells that a slot occupies
+    int32_t slot_n_cells(const server_slot & slot) const {
+        return (int32_t) system_tokens.size() + slot.n_past;
+    }
+
+    int32_t kv_n_free() const {
+        return n_ctx - llama_get_kv_cache_used_cells(ctx);
+    }
+
+    // the generating slots need one new cell per step
+    int32_t kv_n_generating() const {
+        int32_t n = 0;
+        for (const server_slot & slot : slots) {
+            if (slot.state == SLOT_STATE_PROCESSING && !slot.swapped && !slot.embedding) {
+                n++;
+            }
+        }
+        return n;
+    }
+
+    // admit a new prompt if the KV cache has room for it, or if nothing else is running
+    bool kv_can_admit(const server_slot & slot) const {
+        bool other_active = false;
+        for (const server_slot & other : slots) {
+            if (&other != &slot && !other.available()) {
+                other_active = true;
+                break;
+            }
+        }
+        if (!other_active) {
+            return true;
+        }
+
+        return kv_n_free() - kv_n_generating() >= slot.n_prompt_tokens - slot.n_past;
+    }
+
+    void slot_swap_out(server_slot & slot) {
+        const size_t size = llama_state_seq_get_size(ctx, slot.id + 1);
+        slot.swap_data.resize(size);
+        slot.swap_data.resize(llama_state_seq_get_data(ctx, slot.swap_data.data(), slot.id + 1));
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+
+        slot.swapped = true;
+        slot.i_batch = -1;
+
+        LOG_INFO("slot swapped out", {
+            {"id_slot",   slot.id},
+            {"id_task",   slot.id_task},
+            {"n_past",    slot.n_past},
+            {"swap_size", slot.swap_data.size()},
+        });
+    }
+
+    bool slot_swap_in(server_slot & slot) {
+        if (llama_state_seq_set_data(ctx, slot.swap_data.data(), slot.id + 1) == 0) {
+            return false;
+        }
+
+        slot.swapped = false;
+        slot.swap_data.clear();
+        slot.swap_data.shrink_to_fit();
+
+        LOG_INFO("slot swapped in", {
+            {"id_slot", slot.id},
+            {"id_task", slot.id_task},
+            {"n_past",  slot.n_past},
+        });
+
+        return true;
+    }
+
+    // make room in the KV cache for the next token of the generating slots by swapping out the slots of the lowest
+    // priority (most recent first), and swap them back in when there is room again
+    void update_slots_swap() {
+        const auto slot_order = [](const server_slot * a, const server_slot * b) {
+            if (a->priority != b->priority) {
+                return a->priority < b->priority;
+            }
+            return a->t_queued < b->t_queued;
+        };
+
+        std::vector<server_slot *> slots_swapped;
+        for (server_slot & slot : slots) {
+            if (slot.swapped && slot.command != SLOT_COMMAND_RELEASE) {
+                slots_swapped.push_back(&slot);
+            }
+        }
+        std::sort(slots_swapped.begin(), slots_swapped.end(), slot_order);
+
+        // keep some room for the prompts, so that the slots are not swapped in and out at every step
+        const int32_t n_margin = llama_n_ubatch(ctx);
+
+        for (server_slot * slot : slots_swapped) {
+            if (kv_n_free() < slot_n_cells(*slot) + kv_n_generating() + 1 + n_margin) {
+                break;
+            }
+            if (!slot_swap_in(*slot)) {
+                break;
+            }
+        }
+
+        while (kv_n_free() < kv_n_generating()) {
+            std::vector<server_slot *> slots_generating;
+            for (server_slot & slot : slots) {
+                if (slot.state == SLOT_STATE_PROCESSING && !slot.swapped && !slot.embedding && slot.command != SLOT_COMMAND_RELEASE) {
+                    slots_generating.push_back(&slot);
+                }
+            }
+            if (slots_generating.size() <= 1) {
+                break;
+            }
+
+            slot_swap_out(**std::max_element(slots_generating.begin(), slots_generating.end(), slot_order));
+        }
+
+        // a swapped slot that cannot be restored even though nothing else is running will never make progress
+        bool any_active = false;
+        for (const server_slot & slot : slots) {
+            if (!slot.available() && !slot.swapped) {
+                any_active = true;
+                break;
+            }
+        }
+        if (!any_active) {
+            for (server_slot * slot : slots_swapped) {
+                if (slot->swapped && !slot_swap_in(*slot)) {
+                    slot->release();
+                    send_error(*slot, "failed to restore the slot from host memory, the KV cache is too small", ERROR_TYPE_SERVER);
+                }
+                break;
+            }
+        }
+    }
+
     void update_slots() {
         if (system_need_update) {
             system_prompt_update();
@@ -1882,6 +2419,14 @@ struct server_context {
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                if (slot.swapped) {
+                    // the sequence is not in the KV cache anymore
+                    slot.swapped = false;
+                    slot.swap_data.clear();
+                    slot.swap_data.shrink_to_fit();
+                    slot.cache_tokens.clear();
+                }
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -1927,11 +2472,15 @@ struct server_context {
             queue_tasks.post(task);
         }
 
+        if (params.dynamic_slots) {
+            update_slots_swap();
+        }
+
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
             if (slot.ga_n == 1) {
-                if (slot.is_processing() && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
+                if (slot.is_processing() && !slot.swapped && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
                     // Shift context
                     const int n_keep    = slot.params.n_keep + add_bos_token;
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
@@ -1972,7 +2521,7 @@ struct server_context {
 
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
-            if (slot.state == SLOT_STATE_IDLE) {
+            if (slot.state == SLOT_STATE_IDLE || slot.swapped) {
                 continue;
             }
 
@@ -2010,9 +2559,33 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // while other slots are generating, limit the number of prompt tokens in the batch (chunked prefill)
+        // so that a large prompt does not stall the generation of the other slots for a long time
+        int32_t n_batch_prompt = n_batch;
+        if (batch.n_tokens > 0 && params.n_prefill_budget > 0) {
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + params.n_prefill_budget);
+        }
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
+            // prompts are scheduled by priority class, and within a class the slot that was scheduled least
+            // recently goes first, so that the prompt chunks are shared fairly between the slots
+            std::vector<server_slot *> slots_prompt;
             for (auto & slot : slots) {
+                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
+                    slots_prompt.push_back(&slot);
+                }
+            }
+            std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+                if (a->priority != b->priority) {
+                    return a->priority < b->priority;
+                }
+                return a->t_last_scheduled < b->t_last_scheduled;
+            });
+
+            for (server_slot * slot_prompt : slots_prompt) {
+                server_slot & slot = *slot_prompt;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
@@ -2155,6 +2728,9 @@ struct server_context {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
                                 }
                             }
+
+                            slot.n_prompt_tokens_total        += slot.n_prompt_tokens;
+                            slot.n_prompt_tokens_cached_total += slot.n_past;
                         }
 
                         if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0) {
@@ -2180,6 +2756,11 @@ struct server_context {
                         }
                     }
 
+                    // with dynamic slots, a new prompt only starts when the KV cache has room for it
+                    if (params.dynamic_slots && slot.n_prompt_tokens_processed == 0 && !kv_can_admit(slot)) {
+                        continue;
+                    }
+
                     // check that we are in the right batch_type, if not defer the slot
                     bool slot_type = slot.embedding ? 1 : 0;
                     if (batch_type == -1) {
@@ -2225,7 +2806,7 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch_prompt; ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2244,6 +2825,8 @@ struct server_context {
                         slot_npast++;
                     }
 
+                    slot.t_last_scheduled = ggml_time_us();
+
                     LOG_VERBOSE("prompt processing progress", {
                         {"id_slot",  slot.id},
                         {"n_past",   slot.n_past},
@@ -2274,7 +2857,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -2297,7 +2880,7 @@ struct server_context {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
 
             for (auto & slot : slots) {
-                if (slot.ga_n != 1) {
+                if (slot.ga_n != 1 && !slot.swapped) {
                     // context extension via Self-Extend
                     // TODO: simplify and/or abstract this
                     while (slot.n_past_se >= slot.ga_i + slot.ga_w) {
@@ -2368,6 +2951,8 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            metrics.on_decode(n_tokens);
+
             for (auto & slot : slots) {
                 if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2392,6 +2977,7 @@ struct server_context {
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
                 }
+                metrics.on_token(slot);
 
                 llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
                 result.tok = id;
@@ -2562,6 +3148,13 @@ int main(int argc, char ** argv) {
         res.status = json_value(error_data, "code", 500);
     };
 
+    // formats of the body of a request and of its response, see wire_format
+    const auto wire_formats = [](const httplib::Request & req) {
+        const wire_format format_req = wire_format_from_mime(req.get_header_value("Content-Type"));
+        const wire_format format_res = wire_format_from_mime(req.get_header_value("Accept"), format_req);
+        return std::make_pair(format_req, format_res);
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, std::exception_ptr ep) {
         std::string message;
         try {
@@ -2872,6 +3465,56 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // per priority class metrics, labeled with the class name
+        const json priorities_metrics_def = json::array({
+            json {{"name", "priority_requests_total"},                    {"type", "counter"}, {"help", "Number of requests started."},                                   {"key", "n_requests_total"}},
+            json {{"name", "priority_queue_seconds_total"},               {"type", "counter"}, {"help", "Time spent by the requests waiting for a slot."},                {"key", "t_queue_total"}},
+            json {{"name", "priority_first_token_total"},                 {"type", "counter"}, {"help", "Number of requests that generated their first token."},          {"key", "n_first_token_total"}},
+            json {{"name", "priority_time_to_first_token_seconds_total"}, {"type", "counter"}, {"help", "Time from the reception of the requests to their first token."}, {"key", "t_first_token_total"}},
+            json {{"name", "priority_requests_processing"},               {"type", "gauge"},   {"help", "Number of requests processing."},                                {"key", "processing"}},
+            json {{"name", "priority_requests_deferred"},                 {"type", "gauge"},   {"help", "Number of requests deferred."},                                  {"key", "deferred"}},
+        });
+
+        for (const auto & metric_def : priorities_metrics_def) {
+            const std::string name = metric_def.at("name");
+            const std::string type = metric_def.at("type");
+            const std::string help = metric_def.at("help");
+            const std::string key  = metric_def.at("key");
+
+            prometheus << "# HELP llamacpp:" << name << " " << help << "\n"
+                       << "# TYPE llamacpp:" << name << " " << type << "\n";
+
+            for (const auto & priority : data.at("priorities")) {
+                double value = priority.at(key);
+                if (key[0] == 't') {
+                    value /= 1.e6; // us -> s
+                }
+                prometheus << "llamacpp:" << name << "{priority=\"" << priority.at("priority").get<std::string>() << "\"} " << value << "\n";
+            }
+        }
+
+        // per slot metrics, labeled with the slot id
+        prometheus << "# HELP llamacpp:slot_kv_fragmentation_ratio Fraction of the KV cells spanned by the slot that do not belong to it.\n"
+                   << "# TYPE llamacpp:slot_kv_fragmentation_ratio gauge\n";
+        for (const auto & slot : data.at("slots_cache")) {
+            prometheus << "llamacpp:slot_kv_fragmentation_ratio{slot=\"" << slot.at("id").get<int>() << "\"} " << slot.at("kv_fragmentation").get<double>() << "\n";
+        }
+
+        prometheus << "# HELP llamacpp:slot_prompt_cache_hit_ratio Fraction of the prompt tokens reused from the prompt cache of the slot.\n"
+                   << "# TYPE llamacpp:slot_prompt_cache_hit_ratio gauge\n";
+        for (const auto & slot : data.at("slots_cache")) {
+            const uint64_t n_total  = slot.at("n_prompt_tokens_total");
+            const uint64_t n_cached = slot.at("n_prompt_tokens_cached_total");
+            prometheus << "llamacpp:slot_prompt_cache_hit_ratio{slot=\"" << slot.at("id").get<int>() << "\"} " << (n_total ? (double) n_cached / n_total : 0.) << "\n";
+        }
+
+        // the histograms are lock-free, they are read directly from this thread
+        const server_metrics & metrics = ctx_server.metrics;
+        metrics.queue_wait    .to_prometheus(prometheus, "queue_wait_seconds",          "Time spent by the requests waiting for a slot.",                1.e6);
+        metrics.time_to_first .to_prometheus(prometheus, "time_to_first_token_seconds", "Time from the reception of the requests to their first token.", 1.e6);
+        metrics.inter_token   .to_prometheus(prometheus, "inter_token_seconds",         "Time between two consecutive generated tokens of a request.",   1.e6);
+        metrics.batch_n_tokens.to_prometheus(prometheus, "batch_tokens",                "Number of tokens per llama_decode call.",                        1.);
+
         const int64_t t_start = data.at("t_start");
         res.set_header("Process-Start-Time-Unix", std::to_string(t_start));
 
@@ -2879,6 +3522,39 @@ int main(int argc, char ** argv) {
         res.status = 200; // HTTP OK
     };
 
+    const auto handle_profile = [&](const httplib::Request & req, httplib::Response & res) {
+        if (!params.endpoint_profile) {
+            res_error(res, format_error_response("This server does not support profile endpoint.", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        const std::string format = req.has_param("format") ? req.get_param_value("format") : "table";
+        if (format != "table" && format != "trace") {
+            res_error(res, format_error_response("Invalid format, expected \"table\" or \"trace\"", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        server_task task;
+        task.id = ctx_server.queue_tasks.get_new_id();
+        task.id_multi  = -1;
+        task.id_target = -1;
+        task.type = SERVER_TASK_TYPE_PROFILE;
+        task.data = {
+            { "format", format },
+            { "reset",  req.has_param("reset") && req.get_param_value("reset") != "0" },
+        };
+
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+        ctx_server.queue_tasks.post(task);
+
+        server_task_result result = ctx_server.queue_results.recv(task.id);
+        ctx_server.queue_results.remove_waiting_task_id(task.id);
+
+        const std::string report = result.data.at("report");
+        res.set_content(report, format == "trace" ? "application/json; charset=utf-8" : "text/plain; charset=utf-8");
+        res.status = 200; // HTTP OK
+    };
+
     const auto handle_slots_save = [&ctx_server, &res_error, &params](const httplib::Request & req, httplib::Response & res, int id_slot) {
         json request_data = json::parse(req.body);
         std::string filename = request_data.at("filename");
@@ -3005,7 +3681,7 @@ int main(int argc, char ** argv) {
         res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_completions = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions = [&ctx_server, &res_error, &wire_formats](const httplib::Request & req, httplib::Response & res) {
         if (ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
@@ -3013,7 +3689,9 @@ int main(int argc, char ** argv) {
 
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
-        json data = json::parse(req.body);
+        const auto formats = wire_formats(req);
+
+        json data = wire_parse(req.body, formats.first);
 
         const int id_task = ctx_server.queue_tasks.get_new_id();
 
@@ -3023,7 +3701,7 @@ int main(int argc, char ** argv) {
         if (!json_value(data, "stream", false)) {
             server_task_result result = ctx_server.queue_results.recv(id_task);
             if (!result.error && result.stop) {
-                res.set_content(result.data.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
+                res.set_content(wire_dump(result.data, formats.second), wire_format_mime(formats.second));
             } else {
                 res_error(res, result.data);
             }
@@ -3031,13 +3709,19 @@ int main(int argc, char ** argv) {
             ctx_server.queue_results.remove_waiting_task_id(id_task);
         } else {
             const auto chunked_content_provider = [id_task, &ctx_server](size_t, httplib::DataSink & sink) {
+                stream_writer writer;
                 while (true) {
                     server_task_result result = ctx_server.queue_results.recv(id_task);
                     if (!result.error) {
-                        const std::string str =
-                            "data: " +
-                            result.data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                            "\n\n";
+                        writer.out.clear();
+                        if (result.partial) {
+                            writer.write_partial_response(ctx_server.ctx, result.data_partial);
+                        } else {
+                            writer.out += "data: ";
+                            writer.out += result.data.dump(-1, ' ', false, json::error_handler_t::replace);
+                            writer.out += "\n\n";
+                        }
+                        const std::string & str = writer.out;
 
                         LOG_VERBOSE("data stream", {
                             { "to_send", str }
@@ -3133,9 +3817,20 @@ int main(int argc, char ** argv) {
             ctx_server.queue_results.remove_waiting_task_id(id_task);
         } else {
             const auto chunked_content_provider = [id_task, &ctx_server, completion_id](size_t, httplib::DataSink & sink) {
+                stream_writer writer;
                 while (true) {
                     server_task_result result = ctx_server.queue_results.recv(id_task);
-                    if (!result.error) {
+                    if (!result.error && result.partial) {
+                        writer.out.clear();
+                        writer.write_partial_response_oaicompat(result.data_partial, completion_id);
+                        if (!writer.out.empty()) {
+                            LOG_VERBOSE("data stream", {{"to_send", writer.out}});
+                            if (!sink.write(writer.out.c_str(), writer.out.size())) {
+                                ctx_server.queue_results.remove_waiting_task_id(id_task);
+                                return false;
+                            }
+                        }
+                    } else if (!result.error) {
                         std::vector<json> result_array = format_partial_response_oaicompat(result.data, completion_id);
 
                         for (auto it = result_array.begin(); it != result_array.end(); ++it) {
@@ -3182,7 +3877,7 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_infill = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&ctx_server, &res_error, &wire_formats](const httplib::Request & req, httplib::Response & res) {
         if (ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support infill. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
@@ -3190,7 +3885,9 @@ int main(int argc, char ** argv) {
 
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
-        json data = json::parse(req.body);
+        const auto formats = wire_formats(req);
+
+        json data = wire_parse(req.body, formats.first);
 
         const int id_task = ctx_server.queue_tasks.get_new_id();
 
@@ -3200,7 +3897,7 @@ int main(int argc, char ** argv) {
         if (!json_value(data, "stream", false)) {
             server_task_result result = ctx_server.queue_results.recv(id_task);
             if (!result.error && result.stop) {
-                res.set_content(result.data.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
+                res.set_content(wire_dump(result.data, formats.second), wire_format_mime(formats.second));
             } else {
                 res_error(res, result.data);
             }
@@ -3208,13 +3905,19 @@ int main(int argc, char ** argv) {
             ctx_server.queue_results.remove_waiting_task_id(id_task);
         } else {
             const auto chunked_content_provider = [id_task, &ctx_server](size_t, httplib::DataSink & sink) {
+                stream_writer writer;
                 while (true) {
                     server_task_result result = ctx_server.queue_results.recv(id_task);
                     if (!result.error) {
-                        const std::string str =
-                            "data: " +
-                            result.data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                            "\n\n";
+                        writer.out.clear();
+                        if (result.partial) {
+                            writer.write_partial_response(ctx_server.ctx, result.data_partial);
+                        } else {
+                            writer.out += "data: ";
+                            writer.out += result.data.dump(-1, ' ', false, json::error_handler_t::replace);
+                            writer.out += "\n\n";
+                        }
+                        const std::string & str = writer.out;
 
                         LOG_VERBOSE("data stream", {
                             { "to_send", str }
@@ -3247,22 +3950,27 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_tokenize = [&ctx_server](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&ctx_server, &wire_formats](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-        const json body = json::parse(req.body);
+        const auto formats = wire_formats(req);
+        const json body = wire_parse(req.body, formats.first);
 
         std::vector<llama_token> tokens;
         if (body.count("content") != 0) {
             const bool add_special = json_value(body, "add_special", false);
             tokens = ctx_server.tokenize(body.at("content"), add_special);
         }
-        const json data = format_tokenizer_response(tokens);
-        return res.set_content(data.dump(), "application/json; charset=utf-8");
+        json data = format_tokenizer_response(tokens);
+        if (formats.second != WIRE_FORMAT_JSON) {
+            data["tokens"] = wire_pack(tokens);
+        }
+        return res.set_content(wire_dump(data, formats.second), wire_format_mime(formats.second));
     };
 
-    const auto handle_detokenize = [&ctx_server](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&ctx_server, &wire_formats](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-        const json body = json::parse(req.body);
+        const auto formats = wire_formats(req);
+        const json body = wire_parse(req.body, formats.first);
 
         std::string content;
         if (body.count("tokens") != 0) {
@@ -3271,13 +3979,14 @@ int main(int argc, char ** argv) {
         }
 
         const json data = format_detokenized_response(content);
-        return res.set_content(data.dump(), "application/json; charset=utf-8");
+        return res.set_content(wire_dump(data, formats.second), wire_format_mime(formats.second));
     };
 
-    const auto handle_embeddings = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_embeddings = [&ctx_server, &res_error, &wire_formats](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
-        const json body = json::parse(req.body);
+        const auto formats = wire_formats(req);
+        const json body = wire_parse(req.body, formats.first);
         bool is_openai = false;
 
         // an input prompt can be a string or a list of tokens (integer)
@@ -3298,19 +4007,19 @@ int main(int argc, char ** argv) {
         {
             const int id_task = ctx_server.queue_tasks.get_new_id();
             ctx_server.queue_results.add_waiting_task_id(id_task);
-            ctx_server.request_completion(id_task, -1, {{"prompt", prompt}}, false, true);
+
+            server_task task;
+            task.id   = id_task;
+            task.type = SERVER_TASK_TYPE_EMBEDDING;
+            task.data = {{"prompt", prompt}};
+
+            ctx_server.queue_tasks.post(task);
 
             // get the result
             server_task_result result = ctx_server.queue_results.recv(id_task);
             ctx_server.queue_results.remove_waiting_task_id(id_task);
             if (!result.error) {
-                if (result.data.count("results")) {
-                    // result for multi-task
-                    responses = result.data.at("results");
-                } else {
-                    // result for single task
-                    responses = std::vector<json>{result.data};
-                }
+                responses = result.data.at("results");
             } else {
                 // error received, ignore everything else
                 res_error(res, result.data);
@@ -3318,11 +4027,17 @@ int main(int argc, char ** argv) {
             }
         }
 
-        // write JSON response
+        if (formats.second != WIRE_FORMAT_JSON) {
+            for (auto & elem : responses) {
+                elem["embedding"] = wire_pack(elem.at("embedding").get<std::vector<float>>());
+            }
+        }
+
+        // write the response
         json root = is_openai
             ? format_embeddings_response_oaicompat(body, responses)
             : responses[0];
-        return res.set_content(root.dump(), "application/json; charset=utf-8");
+        return res.set_content(wire_dump(root, formats.second), wire_format_mime(formats.second));
     };
 
     auto handle_static_file = [](unsigned char * content, size_t len, const char * mime_type) {
@@ -3365,6 +4080,7 @@ int main(int argc, char ** argv) {
     svr->Get ("/health",              handle_health);
     svr->Get ("/slots",               handle_slots);
     svr->Get ("/metrics",             handle_metrics);
+    svr->Get ("/profile",             handle_profile);
     svr->Get ("/props",               handle_props);
     svr->Get ("/v1/models",           handle_models);
     svr->Post("/completion",          handle_completions); // legacy
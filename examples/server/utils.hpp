@@ -7,6 +7,9 @@
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
 
+#include <cmath>
+#include <cstring>
+#include <ctime>
 #include <string>
 #include <vector>
 #include <sstream>
@@ -343,6 +346,307 @@ static json probs_vector_to_json(const llama_context * ctx, const std::vector<co
     return out;
 }
 
+//
+// streamed responses
+//
+
+// data of a streamed token - it is not converted to json in the main loop, the http thread serializes it
+// directly with stream_writer
+struct partial_response {
+    std::string content;
+    int id_slot = -1;
+
+    bool has_probs = false;
+    std::vector<completion_token_output> probs;
+
+    bool oaicompat = false;
+    int  oaicompat_token_ctr = 0;
+    std::string model;
+};
+
+// serializes streamed responses into a buffer that is reused for all the events of a connection
+// the output is identical to json::dump(-1, ' ', false, json::error_handler_t::replace) of the equivalent json object
+struct stream_writer {
+    std::string out;
+
+    std::string piece; // scratch buffer for token pieces
+
+    void write_string(const std::string & str) {
+        const size_t n_out = out.size();
+
+        out += '"';
+        for (size_t i = 0; i < str.size(); ++i) {
+            const uint8_t c = str[i];
+            if (c >= 0x80) {
+                // multi-byte sequences are copied as is - invalid UTF-8 is left to the json serializer
+                const size_t n = utf8_sequence_len(str, i);
+                if (n == 0) {
+                    out.resize(n_out);
+                    out += json(str).dump(-1, ' ', false, json::error_handler_t::replace);
+                    return;
+                }
+                out.append(str, i, n);
+                i += n - 1;
+                continue;
+            }
+            switch (c) {
+                case '\b': out += "\\b";  break;
+                case '\t': out += "\\t";  break;
+                case '\n': out += "\\n";  break;
+                case '\f': out += "\\f";  break;
+                case '\r': out += "\\r";  break;
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                default:
+                    if (c <= 0x1F) {
+                        char buf[8];
+                        snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        out += buf;
+                    } else {
+                        out += (char) c;
+                    }
+            }
+        }
+        out += '"';
+    }
+
+    void write_float(double value) {
+        if (!std::isfinite(value)) {
+            out += "null";
+            return;
+        }
+
+        char buf[64];
+        const char * end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), value);
+        out.append(buf, end - buf);
+    }
+
+    void write_int(int64_t value) {
+        out += std::to_string(value);
+    }
+
+    // same as tokens_to_output_formatted_string()
+    void write_token_str(const llama_context * ctx, llama_token token) {
+        piece.resize(std::max<size_t>(piece.capacity(), 16));
+        int n_chars = token == -1 ? 0 : llama_token_to_piece(llama_get_model(ctx), token, &piece[0], piece.size(), 0, true);
+        if (n_chars < 0) {
+            piece.resize(-n_chars);
+            n_chars = llama_token_to_piece(llama_get_model(ctx), token, &piece[0], piece.size(), 0, true);
+        }
+        piece.resize(n_chars);
+
+        if (piece.size() == 1 && (piece[0] & 0x80) == 0x80) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "byte: \\x%x", piece[0] & 0xff);
+            piece = buf;
+        }
+
+        write_string(piece);
+    }
+
+    // "data: <json>\n\n" event of /completion and /infill
+    void write_partial_response(const llama_context * ctx, const partial_response & partial) {
+        out += "data: {\"content\":";
+        write_string(partial.content);
+        out += ",\"stop\":false,\"id_slot\":";
+        write_int(partial.id_slot);
+        out += ",\"multimodal\":false";
+
+        if (partial.has_probs) {
+            out += ",\"completion_probabilities\":[";
+            for (size_t i = 0; i < partial.probs.size(); ++i) {
+                const auto & prob = partial.probs[i];
+
+                out += i == 0 ? "{\"content\":" : ",{\"content\":";
+                write_token_str(ctx, prob.tok);
+                out += ",\"probs\":[";
+                for (size_t j = 0; j < prob.probs.size(); ++j) {
+                    out += j == 0 ? "{\"tok_str\":" : ",{\"tok_str\":";
+                    write_token_str(ctx, prob.probs[j].tok);
+                    out += ",\"prob\":";
+                    write_float(prob.probs[j].prob);
+                    out += '}';
+                }
+                out += "]}";
+            }
+            out += ']';
+        }
+
+        if (partial.oaicompat) {
+            out += ",\"oaicompat_token_ctr\":";
+            write_int(partial.oaicompat_token_ctr);
+            out += ",\"model\":";
+            write_string(partial.model);
+        }
+
+        out += "}\n\n";
+    }
+
+    // "data: <json>\n\n" chat.completion.chunk events of /v1/chat/completions - same as format_partial_response_oaicompat()
+    void write_partial_response_oaicompat(const partial_response & partial, const std::string & completion_id) {
+        const bool first = partial.oaicompat_token_ctr == 0;
+
+        // several trailing calls with empty content are ignored, see format_partial_response_oaicompat()
+        if (!first && partial.content.empty()) {
+            return;
+        }
+
+        const std::time_t t = std::time(0);
+
+        const auto write_chunk = [&](const char * delta_key, const std::string & delta_value) {
+            out += "data: {\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"";
+            out += delta_key;
+            out += "\":";
+            write_string(delta_value);
+            out += "}}],\"created\":";
+            write_int(t);
+            out += ",\"id\":";
+            write_string(completion_id);
+            out += ",\"model\":";
+            write_string(partial.model);
+            out += ",\"object\":\"chat.completion.chunk\"}\n\n";
+        };
+
+        if (first) {
+            // we have to send this as two updates to conform to openai behavior
+            write_chunk("role", "assistant");
+        }
+        if (!partial.content.empty()) {
+            write_chunk("content", partial.content);
+        }
+    }
+
+private:
+    // length of the valid UTF-8 sequence starting at str[i], 0 if it is invalid
+    static size_t utf8_sequence_len(const std::string & str, size_t i) {
+        const uint8_t c = str[i];
+
+        size_t n;
+        uint8_t lo = 0x80;
+        uint8_t hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            n = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            n = 3;
+            if (c == 0xE0) { lo = 0xA0; }
+            if (c == 0xED) { hi = 0x9F; }
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 4;
+            if (c == 0xF0) { lo = 0x90; }
+            if (c == 0xF4) { hi = 0x8F; }
+        } else {
+            return 0;
+        }
+
+        if (i + n > str.size()) {
+            return 0;
+        }
+        for (size_t k = 1; k < n; ++k) {
+            const uint8_t cc = str[i + k];
+            if (cc < (k == 1 ? lo : 0x80) || cc > (k == 1 ? hi : 0xBF)) {
+                return 0;
+            }
+        }
+
+        return n;
+    }
+};
+
+//
+// binary wire formats
+//
+
+// a request body in CBOR or MessagePack (selected with Content-Type) gets a response in the same format, or in the one
+// given by Accept; token ids and embeddings are then raw little-endian int32/float32 byte strings instead of arrays
+enum wire_format {
+    WIRE_FORMAT_JSON,
+    WIRE_FORMAT_CBOR,
+    WIRE_FORMAT_MSGPACK,
+};
+
+static wire_format wire_format_from_mime(const std::string & mime, wire_format fallback = WIRE_FORMAT_JSON) {
+    if (mime.find("application/cbor") != std::string::npos) {
+        return WIRE_FORMAT_CBOR;
+    }
+    if (mime.find("application/msgpack") != std::string::npos || mime.find("application/x-msgpack") != std::string::npos) {
+        return WIRE_FORMAT_MSGPACK;
+    }
+    if (mime.find("application/json") != std::string::npos) {
+        return WIRE_FORMAT_JSON;
+    }
+    return fallback;
+}
+
+static const char * wire_format_mime(wire_format format) {
+    switch (format) {
+        case WIRE_FORMAT_CBOR:    return "application/cbor";
+        case WIRE_FORMAT_MSGPACK: return "application/msgpack";
+        default:                  return "application/json; charset=utf-8";
+    }
+}
+
+// byte strings in a request are arrays of int32 (e.g. the token ids of a prompt)
+static json wire_unpack(const json & data) {
+    if (data.is_binary()) {
+        const auto & bytes = data.get_binary();
+        if (bytes.size() % 4 != 0) {
+            throw std::invalid_argument("the size of a byte string must be a multiple of 4");
+        }
+
+        std::vector<int32_t> values(bytes.size() / 4);
+        for (size_t i = 0; i < values.size(); ++i) {
+            values[i] = (int32_t) ((uint32_t) bytes[4*i + 0]       | (uint32_t) bytes[4*i + 1] <<  8 |
+                                   (uint32_t) bytes[4*i + 2] << 16 | (uint32_t) bytes[4*i + 3] << 24);
+        }
+        return values;
+    }
+
+    if (data.is_structured()) {
+        json res = data;
+        for (auto & e : res) {
+            e = wire_unpack(e);
+        }
+        return res;
+    }
+
+    return data;
+}
+
+static json wire_parse(const std::string & body, wire_format format) {
+    switch (format) {
+        case WIRE_FORMAT_CBOR:    return wire_unpack(json::from_cbor(body));
+        case WIRE_FORMAT_MSGPACK: return wire_unpack(json::from_msgpack(body));
+        default:                  return json::parse(body);
+    }
+}
+
+static std::string wire_dump(const json & data, wire_format format) {
+    std::string res;
+    switch (format) {
+        case WIRE_FORMAT_CBOR:    json::to_cbor(data, res);    break;
+        case WIRE_FORMAT_MSGPACK: json::to_msgpack(data, res); break;
+        default:                  res = data.dump(-1, ' ', false, json::error_handler_t::replace); break;
+    }
+    return res;
+}
+
+template <typename T>
+static json wire_pack(const std::vector<T> & values) {
+    static_assert(sizeof(T) == 4, "only 32-bit values are packed");
+
+    std::vector<uint8_t> bytes(values.size() * 4);
+    for (size_t i = 0; i < values.size(); ++i) {
+        uint32_t u;
+        memcpy(&u, &values[i], sizeof(u));
+        bytes[4*i + 0] = u;
+        bytes[4*i + 1] = u >>  8;
+        bytes[4*i + 2] = u >> 16;
+        bytes[4*i + 3] = u >> 24;
+    }
+
+    return json::binary(std::move(bytes));
+}
+
 //
 // OAI utils
 //
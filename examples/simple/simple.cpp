@@ -37,11 +37,8 @@ std::vector<llama_token> parse_target_tokens(llama_context * ctx, const std::str
 // 计算softmax概率
 std::vector<float> compute_softmax(const float* logits, int n_vocab) {
     std::vector<float> probs(n_vocab);
-    float sum_exp = 0.0f;
-    for (int i = 0; i < n_vocab; ++i) {
-        probs[i] = exp(logits[i]);
-        sum_exp += probs[i];
-    }
+    const float max_logit = *std::max_element(logits, logits + n_vocab);
+    const float sum_exp = ggml_exp_sum_f32(logits, probs.data(), n_vocab, max_logit);
     for (int i = 0; i < n_vocab; ++i) {
         probs[i] /= sum_exp;
     }
@@ -347,6 +347,12 @@ extern "C" {
     GGML_API void        ggml_bf16_to_fp32_row(const ggml_bf16_t *, float *, int64_t);
     GGML_API void        ggml_fp32_to_bf16_row(const float *, ggml_bf16_t *, int64_t);
 
+    // vectorized softmax of a row of logits, same kernel as GGML_OP_SOFT_MAX
+    // y[i] = expf(x[i] - max), returns the sum of y (y may be x)
+    GGML_API float       ggml_exp_sum_f32(const float * x, float * y, int64_t n, float max);
+    // log(sum(expf(x[i]))), computed as max + log(sum(expf(x[i] - max)))
+    GGML_API float       ggml_log_sum_exp_f32(const float * x, int64_t n);
+
     struct ggml_object;
     struct ggml_context;
 
@@ -619,6 +625,8 @@ extern "C" {
 
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
+    struct ggml_profiler;
+
     struct ggml_cplan {
         size_t    work_size; // size of work buffer, calculated by `ggml_graph_plan()`
         uint8_t * work_data; // work buffer, to be allocated by caller before calling to `ggml_graph_compute()`
@@ -628,6 +636,9 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // record the time spent in each node when not NULL
+        struct ggml_profiler * profiler;
     };
 
     enum ggml_cgraph_eval_order {
@@ -1530,6 +1541,29 @@ extern "C" {
     GGML_CALL void ggml_rope_yarn_corr_dims(
         int n_dims, int n_ctx_orig, float freq_base, float beta_fast, float beta_slow, float dims[2]);
 
+    // fill the rows [p0, p1) of a RoPE table: row p holds the n_dims/2 (cos, sin) pairs of position p
+    // table - F32 [n_dims, n_pos]
+    GGML_API void ggml_rope_yarn_table(
+            float       * table,
+            int64_t       p0,
+            int64_t       p1,
+            int           n_dims,
+            int           n_ctx_orig,
+            const float * freq_factors,
+            float         freq_base,
+            float         freq_scale,
+            float         ext_factor,
+            float         attn_factor,
+            float         beta_fast,
+            float         beta_slow);
+
+    // make the CPU RoPE kernel read the cos/sin of the positions from a table filled by ggml_rope_yarn_table
+    // with the same parameters as a, instead of computing them per call; positions beyond the table are computed
+    // the rows of the positions in b must be filled when the graph is computed
+    GGML_API void ggml_rope_set_table(
+            struct ggml_tensor * a,
+            struct ggml_tensor * table);
+
     // rotary position embedding backward, i.e compute dx from dy
     // a - dy
     GGML_API struct ggml_tensor * ggml_rope_back(
@@ -2020,6 +2054,22 @@ extern "C" {
     // dump the graph into a file using the dot format
     GGML_API void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph * gf, const char * filename);
 
+    // CPU profiler
+    // ggml_graph_compute() records the time each thread spends computing each node and waiting for the other threads after it,
+    // and the bytes read and written by the node. The totals are kept per op type, per layer (from the "-N" suffix of the node
+    // names) and per thread; the first max_events node executions are also kept for the trace.
+    enum ggml_profile_format {
+        GGML_PROFILE_FORMAT_TABLE, // text tables of the totals
+        GGML_PROFILE_FORMAT_TRACE, // Chrome trace event JSON (chrome://tracing, Perfetto)
+    };
+
+    GGML_API struct ggml_profiler * ggml_profiler_init (size_t max_events);
+    GGML_API void                   ggml_profiler_free (struct ggml_profiler * prof);
+    GGML_API void                   ggml_profiler_reset(struct ggml_profiler * prof);
+
+    // writes the report to buf as a null-terminated string and returns its full length, like snprintf
+    GGML_API size_t                 ggml_profiler_report(const struct ggml_profiler * prof, enum ggml_profile_format format, char * buf, size_t size);
+
     // build gradient checkpointing backward graph gb for gf using provided checkpoints
     // gb_tmp will contain original backward graph with rewritten backward process nodes,
     // but without the second forward pass nodes.
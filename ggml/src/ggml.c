@@ -2644,6 +2644,26 @@ inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x
     *s = 1.f/(*s);
 }
 
+float ggml_exp_sum_f32(const float * x, float * y, int64_t n, float max) {
+    GGML_ASSERT(n <= INT_MAX);
+    return ggml_vec_soft_max_f32(n, y, x, max);
+}
+
+float ggml_log_sum_exp_f32(const float * x, int64_t n) {
+    GGML_ASSERT(n <= INT_MAX);
+
+    float max = -INFINITY;
+    ggml_vec_max_f32(n, &max, x);
+
+    // the exponentials are only summed, so they are computed in chunks that stay in L1
+    float tmp[256];
+    ggml_float sum = 0;
+    for (int64_t i = 0; i < n; i += 256) {
+        sum += ggml_vec_soft_max_f32(MIN(n - i, 256), tmp, x + i, max);
+    }
+    return max + (float) log(sum);
+}
+
 inline static void ggml_vec_argmax_f32(const int n, int * s, const float * x) {
     float max = -INFINITY;
     int idx = 0;
@@ -6392,6 +6412,22 @@ struct ggml_tensor * ggml_rope_ext_inplace(
     );
 }
 
+void ggml_rope_set_table(
+        struct ggml_tensor * a,
+        struct ggml_tensor * table) {
+    GGML_ASSERT(a->op == GGML_OP_ROPE);
+
+    if (table) {
+        const int n_dims = ggml_get_op_params_i32(a, 1);
+
+        GGML_ASSERT(table->type == GGML_TYPE_F32);
+        GGML_ASSERT(table->ne[0] == n_dims);
+        GGML_ASSERT(ggml_is_contiguous(table));
+    }
+
+    a->src[3] = table;
+}
+
 struct ggml_tensor * ggml_rope_custom(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -12395,6 +12431,41 @@ UseGgmlGemm2:;
 
 // ggml_compute_forward_mul_mat_id
 
+// experts with at least this many src1 rows are computed with the tiled sgemm, on blocks of at most
+// MMID_SGEMM_BLCK0 x MMID_SGEMM_BLCK1 that fit the per-thread scratch
+#define MMID_SGEMM_MIN_ROWS 16
+#define MMID_SGEMM_BLCK0    256
+#define MMID_SGEMM_BLCK1    64
+
+struct mmid_row_mapping {
+    int32_t i1;
+    int32_t i2;
+};
+
+// size of the chunks of an expert with nr0 x nr1 rows, out of nr1_total src1 rows over all the experts
+// the src0 rows are split so that there are ~4 chunks per thread in total, in proportion to the rows of each expert
+static void ggml_mul_mat_id_chunk_size(int64_t nr0, int64_t nr1, int64_t nr1_total, int nth, bool tiled, int64_t * dr0, int64_t * dr1) {
+    const int64_t nchunk0 = MAX(1, (4*nth*nr1 + nr1_total - 1)/nr1_total);
+
+    int64_t d0 = MAX(16, GGML_PAD((nr0 + nchunk0 - 1)/nchunk0, 16));
+    if (tiled) {
+        d0 = MIN(d0, MMID_SGEMM_BLCK0);
+    }
+
+    *dr0 = MIN(d0, nr0);
+    *dr1 = tiled ? MIN(nr1, MMID_SGEMM_BLCK1) : nr1;
+}
+
+static bool ggml_mul_mat_id_use_sgemm(int64_t nr1, ggml_gemv_t gemv) {
+#if GGML_USE_LLAMAFILE
+    return nr1 >= MMID_SGEMM_MIN_ROWS && !gemv;
+#else
+    GGML_UNUSED(nr1);
+    GGML_UNUSED(gemv);
+    return false;
+#endif
+}
+
 static void ggml_compute_forward_mul_mat_id(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -12415,8 +12486,7 @@ static void ggml_compute_forward_mul_mat_id(
     ggml_vec_dot_t    const vec_dot         = type_traits[type].vec_dot;
     enum ggml_type    const vec_dot_type    = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float      = type_traits[vec_dot_type].from_float;
-    int64_t           const matmul_num_cols = type_traits[type].ncols;
-    ggml_gemv_t       const gemv            = type_traits[type].gemv;
+    ggml_gemv_t       const gemv            = ((ggml_n_dims(src0) - 1) == 2) ? type_traits[type].gemv : NULL;
 
     // we don't support permuted src0 or src1
     GGML_ASSERT(nb00 == ggml_type_size(type));
@@ -12432,17 +12502,26 @@ static void ggml_compute_forward_mul_mat_id(
     const int n_ids = ids->ne[0]; // n_expert_used
     const int n_as  = ne02;       // n_expert
 
+    const int64_t nr0       = ne01;              // src0 rows
+    const int64_t nr1_total = n_ids*ids->ne[1];  // src1 rows over all the experts
+
+    const void * src1_wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size   = ggml_row_size(vec_dot_type, ne10);
+
     char * wdata_src1_end = (src1->type == vec_dot_type) ?
             (char *) params->wdata :
             (char *) params->wdata + GGML_PAD(ggml_row_size(vec_dot_type, ggml_nelements(src1)), sizeof(int64_t));
 
-    struct mmid_row_mapping {
-        int32_t i1;
-        int32_t i2;
-    };
-
     int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
-    struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne11]
+    struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne12]
+    int64_t * matrix_chunk_offs = (int64_t *) (matrix_rows + n_as*ne12); // [n_as + 1]
+#if GGML_USE_LLAMAFILE
+    int64_t * matrix_row_offs = matrix_chunk_offs + n_as + 1; // [n_as]
+
+    // src1 rows gathered by expert and the per-thread dst blocks of the sgemm
+    char  * wdata_gather = (char *) (matrix_row_offs + n_as);                                 // [nr1_total][row_size]
+    float * wdata_tile   = (float *) (wdata_gather + GGML_PAD(nr1_total*row_size, sizeof(float))) + ith*MMID_SGEMM_BLCK0*MMID_SGEMM_BLCK1;
+#endif
 
     if (src1->type != vec_dot_type) {
         char * wdata = params->wdata;
@@ -12467,6 +12546,14 @@ static void ggml_compute_forward_mul_mat_id(
 
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne12 + (i1)]
 
+    // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+    //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+    //       the original src1 data pointer, so we should index using the indices directly
+#define MMID_SRC1_COL(i11, i12) ((const char *) src1_wdata + \
+        (src1_cont || src1->type != vec_dot_type             \
+        ? ((i11)      + (i12)*ne11)*row_size                 \
+        : ((i11)*nb11 + (i12)*nb12)))
+
     if (ith == 0) {
         // initialize matrix_row_counts
         memset(matrix_row_counts, 0, n_as*sizeof(int64_t));
@@ -12482,34 +12569,133 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        // split every expert in chunks, the experts without rows have none
+        matrix_chunk_offs[0] = 0;
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            const int64_t cne1 = matrix_row_counts[cur_a];
+
+            int64_t nchunk = 0;
+            if (cne1 > 0) {
+                int64_t dr0, dr1;
+                ggml_mul_mat_id_chunk_size(nr0, cne1, nr1_total, nth, ggml_mul_mat_id_use_sgemm(cne1, gemv), &dr0, &dr1);
+                nchunk = ((nr0 + dr0 - 1)/dr0) * ((cne1 + dr1 - 1)/dr1);
+            }
+            matrix_chunk_offs[cur_a + 1] = matrix_chunk_offs[cur_a] + nchunk;
+        }
+
+#if GGML_USE_LLAMAFILE
+        int64_t row_off = 0;
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            matrix_row_offs[cur_a] = row_off;
+            row_off += matrix_row_counts[cur_a];
+        }
+#endif
+
+        // every thread starts at ith, so the first unprocessed chunk is nth
+        atomic_store(&params->shared->current_chunk, nth);
     }
 
     ggml_barrier(params->shared);
 
-    // compute each matrix multiplication in sequence
+#if GGML_USE_LLAMAFILE
+    // gather the src1 rows of the experts computed with sgemm into contiguous matrices
+    bool any_sgemm = false;
     for (int cur_a = 0; cur_a < n_as; ++cur_a) {
         const int64_t cne1 = matrix_row_counts[cur_a];
 
-        if (cne1 == 0) {
+        if (!ggml_mul_mat_id_use_sgemm(cne1, gemv)) {
             continue;
         }
+        any_sgemm = true;
 
-        const char * src0_cur = (const char *) src0->data + cur_a*nb02;
+        for (int64_t ir1 = ith; ir1 < cne1; ir1 += nth) {
+            const struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, ir1);
 
-        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+            memcpy(wdata_gather + (matrix_row_offs[cur_a] + ir1)*row_size,
+                   MMID_SRC1_COL(row_mapping.i1 % ne11, row_mapping.i2), row_size);
+        }
+    }
+
+    if (any_sgemm) {
+        ggml_barrier(params->shared);
+    }
+#endif
+
+    // the chunks of all the experts are distributed over the threads in a single pass, so that the experts with few
+    // rows are computed in parallel instead of one after the other with all the threads synchronizing on each of them
+    const int64_t n_chunk = matrix_chunk_offs[n_as];
+
+    int64_t current_chunk = ith;
 
-        const int64_t nr0 = ne01; // src0 rows
-        const int64_t nr1 = cne1; // src1 rows
+    while (current_chunk < n_chunk) {
+        // find the expert of the chunk
+        int cur_a = 0;
+        {
+            int lo = 0;
+            int hi = n_as - 1;
+            while (lo < hi) {
+                const int mid = (lo + hi + 1)/2;
+                if (matrix_chunk_offs[mid] <= current_chunk) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            cur_a = lo;
+        }
+
+        const int64_t cne1  = matrix_row_counts[cur_a];
+        const bool    tiled = ggml_mul_mat_id_use_sgemm(cne1, gemv);
+
+        int64_t dr0, dr1;
+        ggml_mul_mat_id_chunk_size(nr0, cne1, nr1_total, nth, tiled, &dr0, &dr1);
+
+        const int64_t nchunk0 = (nr0 + dr0 - 1)/dr0;
+        const int64_t ichunk  = current_chunk - matrix_chunk_offs[cur_a];
 
-        if (((ggml_n_dims(src0) - 1) == 2) && gemv) {
-            int64_t src0_cur_start = (ith * ne01) / nth;
-            int64_t src0_cur_end   = ((ith + 1) * ne01) / nth;
-            src0_cur_start = (src0_cur_start % matmul_num_cols) ? src0_cur_start + matmul_num_cols - (src0_cur_start % matmul_num_cols): src0_cur_start;
-            src0_cur_end   = (src0_cur_end % matmul_num_cols) ? src0_cur_end + matmul_num_cols - (src0_cur_end % matmul_num_cols): src0_cur_end;
-            if (src0_cur_start >= src0_cur_end) return;
+        const int64_t ir010 = dr0*(ichunk % nchunk0);
+        const int64_t ir011 = MIN(ir010 + dr0, nr0);
+
+        const int64_t ir110 = dr1*(ichunk / nchunk0);
+        const int64_t ir111 = MIN(ir110 + dr1, cne1);
+
+        const char * src0_cur = (const char *) src0->data + cur_a*nb02;
+
+        bool done = false;
+
+#if GGML_USE_LLAMAFILE
+        if (tiled) {
+            const int64_t m = ir011 - ir010;
+            const int64_t n = ir111 - ir110;
+
+            done = llamafile_sgemm(m, n, ne00/ggml_blck_size(type),
+                                   src0_cur + ir010*nb01,
+                                   nb01/ggml_type_size(type),
+                                   wdata_gather + (matrix_row_offs[cur_a] + ir110)*row_size,
+                                   row_size/ggml_type_size(vec_dot_type),
+                                   wdata_tile,
+                                   m,
+                                   0, 1,
+                                   type,
+                                   vec_dot_type,
+                                   GGML_TYPE_F32);
+
+            if (done) {
+                // scatter the block to the rows of dst
+                for (int64_t ir1 = ir110; ir1 < ir111; ++ir1) {
+                    const struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, ir1);
+
+                    float * dst_col = (float *) ((char *) dst->data + (row_mapping.i1*nb1 + row_mapping.i2*nb2));
+
+                    memcpy(&dst_col[ir010], wdata_tile + (ir1 - ir110)*m, m*sizeof(float));
+                }
+            }
+        }
+#endif
 
-            for (int ir1 = 0; ir1 < nr1; ir1++) {
+        if (!done && gemv) {
+            for (int64_t ir1 = ir110; ir1 < ir111; ++ir1) {
                 struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, ir1);
                 const int id       = row_mapping.i1; // selected expert index
 
@@ -12519,86 +12705,60 @@ static void ggml_compute_forward_mul_mat_id(
                 const int64_t  i1 = id;  // selected expert index
                 const int64_t  i2 = i12; // row
 
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                    ? (i11        + i12 * ne11) * row_size
-                    : (i11 * nb11 + i12 * nb12));
-
-                gemv(ne00, (float *)((char *) dst->data + (i1 * nb1 + i2 * nb2)) + src0_cur_start, ne01,
-                     (const char *) src0_cur + src0_cur_start * nb01, src1_col, 1, src0_cur_end - src0_cur_start);
+                gemv(ne00, (float *)((char *) dst->data + (i1 * nb1 + i2 * nb2)) + ir010, ne01,
+                     (const char *) src0_cur + ir010 * nb01, MMID_SRC1_COL(i11, i12), 1, ir011 - ir010);
             }
-            continue;
+            done = true;
         }
 
-        // distribute the thread work across the inner or outer loop based on which one is larger
-
-        const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-        const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
-
-        const int64_t ith0 = ith % nth0;
-        const int64_t ith1 = ith / nth0;
-
-        const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-        const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
-
-        const int64_t ir010 = dr0*ith0;
-        const int64_t ir011 = MIN(ir010 + dr0, nr0);
-
-        const int64_t ir110 = dr1*ith1;
-        const int64_t ir111 = MIN(ir110 + dr1, nr1);
-
-        // threads with no work simply yield (not sure if it helps)
-        //if (ir010 >= ir011 || ir110 >= ir111) {
-        //    sched_yield();
-        //    continue;
-        //}
+        if (!done) {
+            // block-tiling attempt
+            const int64_t blck_0 = 16;
+            const int64_t blck_1 = 16;
 
-        // block-tiling attempt
-        const int64_t blck_0 = 16;
-        const int64_t blck_1 = 16;
+            // attempt to reduce false-sharing (does not seem to make a difference)
+            float tmp[16];
 
-        // attempt to reduce false-sharing (does not seem to make a difference)
-        float tmp[16];
+            for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+                for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+                    for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+                        const int64_t _i12 = ir1; // logical row index for this expert
 
-        for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
-            for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-                for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
-                    const int64_t _i12 = ir1; // logical row index for this expert
+                        struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, _i12);
+                        const int id       = row_mapping.i1; // selected expert index
 
-                    struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, _i12);
-                    const int id       = row_mapping.i1; // selected expert index
+                        const int64_t  i11 = id % ne11;
+                        const int64_t  i12 = row_mapping.i2; // row index in src1
 
-                    const int64_t  i11 = id % ne11;
-                    const int64_t  i12 = row_mapping.i2; // row index in src1
+                        const int64_t  i1 = id;  // selected expert index
+                        const int64_t  i2 = i12; // row
 
-                    const int64_t  i1 = id;  // selected expert index
-                    const int64_t  i2 = i12; // row
+                        const char * src1_col = MMID_SRC1_COL(i11, i12);
 
-                    // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                    //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                    //       the original src1 data pointer, so we should index using the indices directly
-                    // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                    const char * src1_col = (const char *) wdata +
-                        (src1_cont || src1->type != vec_dot_type
-                        ? (i11      + i12*ne11)*row_size
-                        : (i11*nb11 + i12*nb12));
+                        float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2));
 
-                    float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2));
+                        //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                        //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
+                        //}
 
-                    //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                    //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
-                    //}
+                        for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                            vec_dot(ne00, &tmp[ir0 - iir0], 0, src0_cur + ir0*nb01, 0, src1_col, 0, 1);
+                        }
 
-                    for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                        vec_dot(ne00, &tmp[ir0 - iir0], 0, src0_cur + ir0*nb01, 0, src1_col, 0, 1);
+                        memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
                     }
-
-                    memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
                 }
             }
         }
+
+        if (nth >= n_chunk) {
+            break;
+        }
+
+        current_chunk = atomic_fetch_add(&params->shared->current_chunk, 1);
     }
 
+#undef MMID_SRC1_COL
 #undef MMID_MATRIX_ROW
 }
 
@@ -13943,6 +14103,32 @@ GGML_CALL void ggml_rope_yarn_corr_dims(
     dims[1] = MIN(n_dims - 1, end);
 }
 
+void ggml_rope_yarn_table(
+        float       * table,
+        int64_t       p0,
+        int64_t       p1,
+        int           n_dims,
+        int           n_ctx_orig,
+        const float * freq_factors,
+        float         freq_base,
+        float         freq_scale,
+        float         ext_factor,
+        float         attn_factor,
+        float         beta_fast,
+        float         beta_slow) {
+    GGML_ASSERT(n_dims % 2 == 0);
+
+    // same computation as the CPU kernels, so that the table gives bit-identical results
+    const float theta_scale = powf(freq_base, -2.0f/n_dims);
+
+    float corr_dims[2];
+    ggml_rope_yarn_corr_dims(n_dims, n_ctx_orig, freq_base, beta_fast, beta_slow, corr_dims);
+
+    for (int64_t p = p0; p < p1; ++p) {
+        ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, n_dims, ext_factor, attn_factor, table + p*n_dims, 1.0f, theta_scale);
+    }
+}
+
 static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst,
@@ -14006,6 +14192,10 @@ static void ggml_compute_forward_rope_f32(
         freq_factors = (const float *) src2->data;
     }
 
+    // optional table of cos/sin per position, filled by ggml_rope_yarn_table (forward only)
+    const struct ggml_tensor * src3 = forward ? dst->src[3] : NULL;
+    const int64_t n_table = src3 ? src3->ne[1] : 0;
+
     // backward process uses inverse rotation by cos and sin.
     // cos and sin build a rotation matrix, where the inverse is the transpose.
     // this essentially just switches the sign of sin.
@@ -14015,10 +14205,25 @@ static void ggml_compute_forward_rope_f32(
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
+            // skip the positions without rows for this thread
+            if (ir + ne1 <= ir0) {
+                ir += ne1;
+                continue;
+            }
+            if (ir >= ir1) {
+                break;
+            }
+
             const int64_t p = pos[i2];
 
-            float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+            const float * cache;
+            if (p >= 0 && p < n_table) {
+                cache = (const float *) ((const char *) src3->data + p*src3->nb[1]);
+            } else {
+                float * wcache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
+                ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, wcache, sin_sign, theta_scale);
+                cache = wcache;
+            }
 
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
@@ -14131,6 +14336,10 @@ static void ggml_compute_forward_rope_f16(
         freq_factors = (const float *) src2->data;
     }
 
+    // optional table of cos/sin per position, filled by ggml_rope_yarn_table (forward only)
+    const struct ggml_tensor * src3 = forward ? dst->src[3] : NULL;
+    const int64_t n_table = src3 ? src3->ne[1] : 0;
+
     // backward process uses inverse rotation by cos and sin.
     // cos and sin build a rotation matrix, where the inverse is the transpose.
     // this essentially just switches the sign of sin.
@@ -14140,10 +14349,25 @@ static void ggml_compute_forward_rope_f16(
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
+            // skip the positions without rows for this thread
+            if (ir + ne1 <= ir0) {
+                ir += ne1;
+                continue;
+            }
+            if (ir >= ir1) {
+                break;
+            }
+
             const int64_t p = pos[i2];
 
-            float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+            const float * cache;
+            if (p >= 0 && p < n_table) {
+                cache = (const float *) ((const char *) src3->data + p*src3->nb[1]);
+            } else {
+                float * wcache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
+                ggml_rope_cache_init(p, freq_scale, freq_factors, corr_dims, ne0, ext_factor, attn_factor, wcache, sin_sign, theta_scale);
+                cache = wcache;
+            }
 
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
@@ -18683,6 +18907,12 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     cur += GGML_PAD(cur, sizeof(int64_t));       // align
                     cur += n_as * sizeof(int64_t);               // matrix_row_counts
                     cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+                    cur += (n_as + 1) * sizeof(int64_t);         // matrix_chunk_offs
+#if GGML_USE_LLAMAFILE
+                    cur += n_as * sizeof(int64_t);               // matrix_row_offs
+                    cur += GGML_PAD(ggml_nelements(node->src[2]) * ggml_row_size(vec_dot_type, src1->ne[0]), sizeof(float)); // gathered src1 rows
+                    cur += n_tasks * MMID_SGEMM_BLCK0 * MMID_SGEMM_BLCK1 * sizeof(float); // sgemm tiles
+#endif
                 } break;
             case GGML_OP_OUT_PROD:
                 {
@@ -18784,6 +19014,298 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+// profiler
+
+struct ggml_profile_rec {
+    int64_t t_start; // ns, 0 if the thread did not compute the node
+    int64_t t_end;
+    int64_t t_sync;  // after the barrier that follows the node
+};
+
+struct ggml_profile_stat {
+    int64_t n;
+    int64_t t_wall;
+    int64_t t_busy; // summed over the threads
+    int64_t t_wait;
+    int64_t bytes;
+};
+
+struct ggml_profile_event {
+    int64_t ts;
+    int64_t dur;
+    int     tid;
+    int     layer;
+    enum ggml_op op;
+    char    name[GGML_MAX_NAME];
+};
+
+struct ggml_profiler {
+    // records of the graph being computed, [n_threads][n_nodes]
+    struct ggml_profile_rec * recs;
+    size_t n_recs;
+
+    int64_t t_origin;
+    int     n_graphs;
+
+    struct ggml_profile_stat ops[GGML_OP_COUNT];
+    struct ggml_profile_stat other;  // nodes without a layer
+    struct ggml_profile_stat * layers;
+    int n_layers;
+    struct ggml_profile_stat * threads;
+    int n_threads;
+
+    struct ggml_profile_event * events;
+    size_t n_events;
+    size_t max_events;
+};
+
+static int64_t ggml_profile_time_ns(void) {
+#if defined(_WIN32)
+    return ggml_time_us()*1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + (int64_t)ts.tv_nsec;
+#endif
+}
+
+// the layer of the nodes built with the llama.cpp naming convention "name-il", or -1
+static int ggml_profile_layer(const char * name) {
+    const char * dash = strrchr(name, '-');
+    if (dash == NULL || dash[1] < '0' || dash[1] > '9') {
+        return -1;
+    }
+    char * end;
+    const long il = strtol(dash + 1, &end, 10);
+    return *end == '\0' || *end == ' ' ? (int) il : -1;
+}
+
+struct ggml_profiler * ggml_profiler_init(size_t max_events) {
+    struct ggml_profiler * prof = GGML_CALLOC(1, sizeof(struct ggml_profiler));
+    prof->max_events = max_events;
+    if (max_events > 0) {
+        prof->events = GGML_MALLOC(max_events*sizeof(struct ggml_profile_event));
+    }
+    ggml_profiler_reset(prof);
+    return prof;
+}
+
+void ggml_profiler_free(struct ggml_profiler * prof) {
+    if (prof == NULL) {
+        return;
+    }
+    GGML_FREE(prof->recs);
+    GGML_FREE(prof->layers);
+    GGML_FREE(prof->threads);
+    GGML_FREE(prof->events);
+    GGML_FREE(prof);
+}
+
+void ggml_profiler_reset(struct ggml_profiler * prof) {
+    prof->t_origin = ggml_profile_time_ns();
+    prof->n_graphs = 0;
+    memset(prof->ops,    0, sizeof(prof->ops));
+    memset(&prof->other, 0, sizeof(prof->other));
+    if (prof->layers) {
+        memset(prof->layers,  0, prof->n_layers*sizeof(struct ggml_profile_stat));
+    }
+    if (prof->threads) {
+        memset(prof->threads, 0, prof->n_threads*sizeof(struct ggml_profile_stat));
+    }
+    prof->n_events = 0;
+}
+
+static void ggml_profiler_begin(struct ggml_profiler * prof, const struct ggml_cgraph * cgraph, int n_threads) {
+    const size_t n_recs = (size_t) n_threads*cgraph->n_nodes;
+    if (prof->n_recs < n_recs) {
+        GGML_FREE(prof->recs);
+        prof->recs   = GGML_MALLOC(n_recs*sizeof(struct ggml_profile_rec));
+        prof->n_recs = n_recs;
+    }
+    memset(prof->recs, 0, n_recs*sizeof(struct ggml_profile_rec));
+
+    if (prof->n_threads < n_threads) {
+        prof->threads = realloc(prof->threads, n_threads*sizeof(struct ggml_profile_stat));
+        GGML_ASSERT(prof->threads);
+        memset(prof->threads + prof->n_threads, 0, (n_threads - prof->n_threads)*sizeof(struct ggml_profile_stat));
+        prof->n_threads = n_threads;
+    }
+}
+
+static void ggml_profile_stat_add(struct ggml_profile_stat * stat, int64_t t_wall, int64_t t_busy, int64_t t_wait, int64_t bytes) {
+    stat->n      += 1;
+    stat->t_wall += t_wall;
+    stat->t_busy += t_busy;
+    stat->t_wait += t_wait;
+    stat->bytes  += bytes;
+}
+
+// aggregates the records of the graph that was just computed
+static void ggml_profiler_end(struct ggml_profiler * prof, const struct ggml_cgraph * cgraph, int n_threads) {
+    const int n_nodes = cgraph->n_nodes;
+
+    for (int i = 0; i < n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        int64_t t_start = INT64_MAX;
+        int64_t t_sync  = 0;
+        int64_t t_busy  = 0;
+        int64_t t_wait  = 0;
+        for (int ith = 0; ith < n_threads; ith++) {
+            const struct ggml_profile_rec * rec = &prof->recs[(size_t) ith*n_nodes + i];
+            if (rec->t_start == 0) {
+                continue;
+            }
+            t_start = MIN(t_start, rec->t_start);
+            t_sync  = MAX(t_sync,  rec->t_sync);
+            t_busy += rec->t_end  - rec->t_start;
+            t_wait += rec->t_sync - rec->t_end;
+
+            prof->threads[ith].t_busy += rec->t_end  - rec->t_start;
+            prof->threads[ith].t_wait += rec->t_sync - rec->t_end;
+
+            if (prof->n_events < prof->max_events) {
+                struct ggml_profile_event * ev = &prof->events[prof->n_events++];
+                ev->ts    = rec->t_start - prof->t_origin;
+                ev->dur   = rec->t_end - rec->t_start;
+                ev->tid   = ith;
+                ev->layer = ggml_profile_layer(node->name);
+                ev->op    = node->op;
+                memcpy(ev->name, node->name, sizeof(ev->name));
+            }
+        }
+        if (t_sync == 0) {
+            // not computed, the graph was aborted
+            break;
+        }
+
+        int64_t bytes = ggml_nbytes(node);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j]) {
+                bytes += ggml_nbytes(node->src[j]);
+            }
+        }
+
+        const int64_t t_wall = t_sync - t_start;
+        ggml_profile_stat_add(&prof->ops[node->op], t_wall, t_busy, t_wait, bytes);
+
+        const int il = ggml_profile_layer(node->name);
+        if (il < 0) {
+            ggml_profile_stat_add(&prof->other, t_wall, t_busy, t_wait, bytes);
+        } else {
+            if (il >= prof->n_layers) {
+                prof->layers = realloc(prof->layers, (il + 1)*sizeof(struct ggml_profile_stat));
+                GGML_ASSERT(prof->layers);
+                memset(prof->layers + prof->n_layers, 0, (il + 1 - prof->n_layers)*sizeof(struct ggml_profile_stat));
+                prof->n_layers = il + 1;
+            }
+            ggml_profile_stat_add(&prof->layers[il], t_wall, t_busy, t_wait, bytes);
+        }
+    }
+
+    prof->n_graphs++;
+}
+
+// snprintf into a buffer that may be too small, keeping track of the full length
+struct ggml_profile_writer {
+    char * buf;
+    size_t size;
+    size_t len;
+};
+
+static void ggml_profile_printf(struct ggml_profile_writer * w, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const size_t avail = w->len < w->size ? w->size - w->len : 0;
+    const int n = vsnprintf(avail > 0 ? w->buf + w->len : NULL, avail, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        w->len += n;
+    }
+}
+
+static void ggml_profile_print_stat(struct ggml_profile_writer * w, const char * name, const struct ggml_profile_stat * stat, int64_t t_total) {
+    if (stat->n == 0) {
+        return;
+    }
+    const double wall_ms = stat->t_wall/1e6;
+    ggml_profile_printf(w, "%-24s %8" PRId64 " %12.3f %6.2f%% %12.3f %12.3f %10.3f %9.2f\n",
+        name, stat->n, wall_ms, t_total > 0 ? 100.0*stat->t_wall/t_total : 0.0,
+        stat->t_busy/1e6, stat->t_wait/1e6, stat->bytes/1e9, stat->t_wall > 0 ? (double) stat->bytes/stat->t_wall : 0.0);
+}
+
+static void ggml_profile_print_header(struct ggml_profile_writer * w, const char * name) {
+    ggml_profile_printf(w, "%-24s %8s %12s %7s %12s %12s %10s %9s\n",
+        name, "n", "wall ms", "wall", "busy ms", "wait ms", "GB", "GB/s");
+}
+
+static void ggml_profile_json_string(struct ggml_profile_writer * w, const char * s) {
+    ggml_profile_printf(w, "\"");
+    for (; *s; s++) {
+        const unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            ggml_profile_printf(w, "\\%c", c);
+        } else if (c < 0x20) {
+            ggml_profile_printf(w, "\\u%04x", c);
+        } else {
+            ggml_profile_printf(w, "%c", c);
+        }
+    }
+    ggml_profile_printf(w, "\"");
+}
+
+size_t ggml_profiler_report(const struct ggml_profiler * prof, enum ggml_profile_format format, char * buf, size_t size) {
+    struct ggml_profile_writer w = { buf, size, 0 };
+    if (size > 0) {
+        buf[0] = '\0';
+    }
+
+    if (format == GGML_PROFILE_FORMAT_TRACE) {
+        ggml_profile_printf(&w, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+        for (size_t i = 0; i < prof->n_events; i++) {
+            const struct ggml_profile_event * ev = &prof->events[i];
+            ggml_profile_printf(&w, "{\"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"cat\": \"%s\", \"name\": ",
+                ev->tid, ev->ts/1e3, ev->dur/1e3, ggml_op_name(ev->op));
+            ggml_profile_json_string(&w, ev->name);
+            ggml_profile_printf(&w, ", \"args\": {\"layer\": %d}}%s\n", ev->layer, i + 1 < prof->n_events ? "," : "");
+        }
+        ggml_profile_printf(&w, "]}\n");
+        return w.len;
+    }
+
+    int64_t t_total = 0;
+    for (int op = 0; op < GGML_OP_COUNT; op++) {
+        t_total += prof->ops[op].t_wall;
+    }
+
+    ggml_profile_printf(&w, "graphs: %d, wall time: %.3f ms\n\n", prof->n_graphs, t_total/1e6);
+
+    ggml_profile_print_header(&w, "op");
+    for (int op = 0; op < GGML_OP_COUNT; op++) {
+        ggml_profile_print_stat(&w, ggml_op_name((enum ggml_op) op), &prof->ops[op], t_total);
+    }
+
+    ggml_profile_printf(&w, "\n");
+    ggml_profile_print_header(&w, "layer");
+    for (int il = 0; il < prof->n_layers; il++) {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", il);
+        ggml_profile_print_stat(&w, name, &prof->layers[il], t_total);
+    }
+    ggml_profile_print_stat(&w, "other", &prof->other, t_total);
+
+    ggml_profile_printf(&w, "\n%-24s %12s %12s %7s\n", "thread", "busy ms", "wait ms", "busy");
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        const struct ggml_profile_stat * stat = &prof->threads[ith];
+        const int64_t t = stat->t_busy + stat->t_wait;
+        ggml_profile_printf(&w, "%-24d %12.3f %12.3f %6.2f%%\n", ith, stat->t_busy/1e6, stat->t_wait/1e6, t > 0 ? 100.0*stat->t_busy/t : 0.0);
+    }
+
+    return w.len;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
@@ -18800,17 +19322,31 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.shared=*/ state->shared,
     };
 
+    struct ggml_profile_rec * recs = cplan->profiler ? cplan->profiler->recs + (size_t) state->ith*cgraph->n_nodes : NULL;
+
     for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
+        if (recs) {
+            recs[node_n].t_start = ggml_profile_time_ns();
+        }
+
         ggml_compute_forward(&params, node);
 
+        if (recs) {
+            recs[node_n].t_end = ggml_profile_time_ns();
+        }
+
         if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->ec = GGML_STATUS_ABORTED;
         }
 
         ggml_barrier(state->shared);
 
+        if (recs) {
+            recs[node_n].t_sync = ggml_profile_time_ns();
+        }
+
         if (state->shared->ec != GGML_STATUS_SUCCESS) {
             break;
         }
@@ -18838,6 +19374,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.ec                      =*/ GGML_STATUS_SUCCESS,
     };
 
+    if (cplan->profiler) {
+        ggml_profiler_begin(cplan->profiler, cgraph, n_threads);
+    }
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -18898,6 +19438,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    if (cplan->profiler) {
+        ggml_profiler_end(cplan->profiler, cgraph, cplan->n_threads);
+    }
+
     return state_shared.ec;
 }
 
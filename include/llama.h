@@ -38,6 +38,8 @@
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
+#define LLAMA_FILE_MAGIC_GGSL 0x6767736cu // 'ggsl'
+#define LLAMA_FILE_MAGIC_GGSC 0x67677363u // 'ggsc'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 6
@@ -45,6 +47,12 @@
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
 #define LLAMA_STATE_SEQ_VERSION 1
 
+#define LLAMA_STATE_SEQ_LOG_MAGIC   LLAMA_FILE_MAGIC_GGSL
+#define LLAMA_STATE_SEQ_LOG_VERSION 1
+
+#define LLAMA_STATE_COMPACT_MAGIC   LLAMA_FILE_MAGIC_GGSC
+#define LLAMA_STATE_COMPACT_VERSION 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -185,6 +193,14 @@ extern "C" {
         LLAMA_POOLING_TYPE_LAST = 3,
     };
 
+    // type of the pooled embeddings returned by llama_get_embeddings_seq_data
+    enum llama_embd_type {
+        LLAMA_EMBD_TYPE_F32    = 0,
+        LLAMA_EMBD_TYPE_F16    = 1,
+        LLAMA_EMBD_TYPE_INT8   = 2, // round(127*x), implies embd_normalize
+        LLAMA_EMBD_TYPE_BINARY = 3, // 1 bit per value (x > 0), packed in bytes starting from the LSB
+    };
+
     enum llama_attention_type {
         LLAMA_ATTENTION_TYPE_UNSPECIFIED = -1,
         LLAMA_ATTENTION_TYPE_CAUSAL      = 0,
@@ -288,6 +304,10 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // memory budget for the expert weights of MoE models in bytes, 0 = no limit
+        // the experts are paged in and out of the memory mapped model file as they are used (requires use_mmap)
+        size_t moe_budget;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
@@ -309,6 +329,7 @@ extern "C" {
         enum llama_rope_scaling_type rope_scaling_type; // RoPE scaling type, from `enum llama_rope_scaling_type`
         enum llama_pooling_type      pooling_type;      // whether to pool (sum) embedding results by sequence id
         enum llama_attention_type    attention_type;    // attention type to use for embeddings
+        enum llama_embd_type         embd_type;         // type of the pooled embeddings
 
         // ref: https://github.com/ggerganov/llama.cpp/pull/2054
         float    rope_freq_base;   // RoPE base frequency, 0 = from model
@@ -331,6 +352,7 @@ extern "C" {
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
+        bool embd_normalize; // L2-normalize the pooled embeddings in the graph
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -354,6 +376,13 @@ extern "C" {
         void * kv_overrides;                 // pointer to vector containing overrides
     } llama_model_quantize_params;
 
+    // compact session file parameters
+    typedef struct llama_state_file_params {
+        enum ggml_type type_kv; // store the K/V cache in this type (F32, F16 or a quantized type), GGML_TYPE_COUNT keeps the cache type
+        bool compress;          // entropy code the K/V chunks, mostly useful for F16/F32 data (~15% smaller) on slow storage
+        bool outputs;           // also store the logits and embeddings of the last batch
+    } llama_state_file_params;
+
     // grammar types
     struct llama_grammar;
 
@@ -415,6 +444,7 @@ extern "C" {
     LLAMA_API struct llama_model_params llama_model_default_params(void);
     LLAMA_API struct llama_context_params llama_context_default_params(void);
     LLAMA_API struct llama_model_quantize_params llama_model_quantize_default_params(void);
+    LLAMA_API struct llama_state_file_params llama_state_file_default_params(void);
 
     // Initialize the llama + ggml backend
     // If numa is true, use NUMA optimizations
@@ -504,6 +534,13 @@ extern "C" {
     // to the decoder to start generating output sequence. For other models, it returns -1.
     LLAMA_API llama_token llama_model_decoder_start_token(const struct llama_model * model);
 
+    // Number of tokens routed to each expert of layer il since the model was loaded, when the experts are paged (see moe_budget)
+    // Returns the number of experts of the model, or -1 if the experts are not paged
+    LLAMA_API int32_t llama_model_expert_usage(const struct llama_model * model, int32_t il, uint64_t * counts, int32_t n_counts);
+
+    // Print the paging and per-layer routing statistics of the experts
+    LLAMA_API void llama_model_print_expert_stats(const struct llama_model * model);
+
     // Returns 0 on success
     LLAMA_API uint32_t llama_model_quantize(
             const char * fname_inp,
@@ -760,6 +797,67 @@ extern "C" {
                           size_t   n_token_capacity,
                           size_t * n_token_count_out);
 
+    // Delta sequence state: only the cells of the sequence with a position >= p0, e.g. the cells appended since
+    // a previous snapshot of a sequence that ended at p0
+    LLAMA_API size_t llama_state_seq_get_size_delta(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    LLAMA_API size_t llama_state_seq_get_data_delta(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    // Replace the cells of the sequence from p0 on with the delta (originally copied with `llama_state_seq_get_data_delta`)
+    // Restoring a full snapshot and then its deltas in order restores the sequence
+    // Returns:
+    //  - Positive: Ok
+    //  - Zero: Failed to load
+    LLAMA_API size_t llama_state_seq_set_data_delta(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                    llama_seq_id   dest_seq_id);
+
+    // Append a snapshot of the sequence to a log file, e.g. after each turn of a conversation
+    // When the sequence extends the logged one (same tokens, no cells removed before the end of the last record),
+    // only the new cells and tokens are written, otherwise a full snapshot is appended
+    // Returns the number of bytes appended, 0 on failure
+    LLAMA_API size_t llama_state_seq_save_log_file(
+            struct llama_context * ctx,
+                      const char * filepath,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_token_count);
+
+    // Restore a sequence from a log file, replaying the last full snapshot and the deltas after it
+    LLAMA_API size_t llama_state_seq_load_log_file(
+            struct llama_context * ctx,
+                      const char * filepath,
+                    llama_seq_id   dest_seq_id,
+                     llama_token * tokens_out,
+                          size_t   n_token_capacity,
+                          size_t * n_token_count_out);
+
+    // Save a compact session file: the K/V cache is stored per layer chunk, optionally converted to another type
+    // (e.g. Q8_0) and compressed, and the logits are dropped unless requested
+    // The files are loaded with llama_state_load_file and llama_state_seq_load_file, which detect the format
+    LLAMA_API bool llama_state_save_file_ext(
+            struct llama_context * ctx,
+                      const char * path_session,
+               const llama_token * tokens,
+                          size_t   n_token_count,
+  struct llama_state_file_params   params);
+
+    LLAMA_API size_t llama_state_seq_save_file_ext(
+            struct llama_context * ctx,
+                      const char * filepath,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_token_count,
+  struct llama_state_file_params   params);
+
     //
     // Decoding
     //
@@ -827,6 +925,10 @@ extern "C" {
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // Record the time spent in each op of the graphs computed on the CPU, NULL to stop (see ggml_profiler_init)
+    // The profiler is updated by llama_decode/llama_encode, read it after llama_synchronize
+    LLAMA_API void llama_set_profiler(struct llama_context * ctx, struct ggml_profiler * profiler);
+
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
@@ -861,10 +963,18 @@ extern "C" {
     LLAMA_API float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i);
 
     // Get the embeddings for a sequence id
-    // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE
+    // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE or if embd_type is not LLAMA_EMBD_TYPE_F32
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
+    // Get the embeddings for a sequence id in the type given by llama_context_params.embd_type
+    // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE
+    // size: llama_embd_seq_size(ctx) bytes
+    LLAMA_API const void * llama_get_embeddings_seq_data(struct llama_context * ctx, llama_seq_id seq_id);
+
+    // Size in bytes of the embeddings of a sequence returned by llama_get_embeddings_seq_data
+    LLAMA_API size_t llama_embd_seq_size(const struct llama_context * ctx);
+
     //
     // Vocab
     //
@@ -921,6 +1031,19 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize(), but large inputs are split into chunks that are tokenized on n_threads threads.
+    /// The text is only split at newlines that the tokenizer never merges across, so the result is identical to llama_tokenize().
+    /// Falls back to llama_tokenize() for small inputs and for tokenizers that cannot be split (UGM, MPT pre-tokenizer).
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_model * model,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
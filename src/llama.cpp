@@ -2348,8 +2348,10 @@ struct llama_cparams {
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
+    bool embd_normalize;
 
     enum llama_pooling_type pooling_type;
+    enum llama_embd_type    embd_type;
 
     ggml_backend_sched_eval_callback cb_eval;
     void * cb_eval_user_data;
@@ -2571,6 +2573,90 @@ struct llama_control_vector {
     }
 };
 
+// cos/sin of the RoPE of each position, shared by the rope ops of all the layers and kept across graphs
+// the table is filled up to the largest position seen so far, so that each position is computed only once
+struct llama_rope_table {
+    struct ggml_context * ctx = nullptr;
+    ggml_backend_buffer_t buf = nullptr;
+
+    struct ggml_tensor * table = nullptr; // F32 [n_rot, n_ctx]
+
+    // parameters of the rope ops the table is computed for, taken from the first rope of the positions in the graph
+    bool init = false;
+    int32_t op_params[11];
+    std::vector<float> freq_factors;
+
+    int64_t n_filled = 0;
+
+    bool matches(const struct ggml_tensor * rope) const {
+        if (memcmp(op_params, rope->op_params, sizeof(op_params)) != 0) {
+            return false;
+        }
+
+        const struct ggml_tensor * ff = rope->src[2];
+        if (ff == nullptr) {
+            return freq_factors.empty();
+        }
+
+        return !freq_factors.empty() && ggml_backend_buffer_is_host(ff->buffer) &&
+            memcmp(freq_factors.data(), ff->data, freq_factors.size()*sizeof(float)) == 0;
+    }
+
+    // use the table for a rope op on the positions of the batch
+    void attach(struct ggml_tensor * rope) {
+        if (!init) {
+            const int n_dims = rope->op_params[1];
+            if (n_dims != table->ne[0]) {
+                return;
+            }
+
+            const struct ggml_tensor * ff = rope->src[2];
+            if (ff != nullptr) {
+                if (ff->buffer == nullptr || !ggml_backend_buffer_is_host(ff->buffer)) {
+                    return;
+                }
+                freq_factors.assign((const float *) ff->data, (const float *) ff->data + n_dims/2);
+            }
+
+            memcpy(op_params, rope->op_params, sizeof(op_params));
+            init = true;
+        }
+
+        if (matches(rope)) {
+            ggml_rope_set_table(rope, table);
+        }
+    }
+
+    // compute the rows of the positions [n_filled, n_pos)
+    void fill(int64_t n_pos) {
+        n_pos = std::min(n_pos, table->ne[1]);
+        if (!init || n_pos <= n_filled) {
+            return;
+        }
+
+        float freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow;
+        memcpy(&freq_base,   op_params +  5, sizeof(float));
+        memcpy(&freq_scale,  op_params +  6, sizeof(float));
+        memcpy(&ext_factor,  op_params +  7, sizeof(float));
+        memcpy(&attn_factor, op_params +  8, sizeof(float));
+        memcpy(&beta_fast,   op_params +  9, sizeof(float));
+        memcpy(&beta_slow,   op_params + 10, sizeof(float));
+
+        GGML_ASSERT(ggml_backend_buffer_is_host(table->buffer));
+
+        ggml_rope_yarn_table((float *) table->data, n_filled, n_pos, op_params[1], op_params[4],
+            freq_factors.empty() ? nullptr : freq_factors.data(),
+            freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow);
+
+        n_filled = n_pos;
+    }
+
+    ~llama_rope_table() {
+        ggml_free(ctx);
+        ggml_backend_buffer_free(buf);
+    }
+};
+
 struct llama_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -2593,7 +2679,15 @@ struct llama_vocab {
     std::vector<id>    cache_special_tokens;
     std::vector<token> cache_token_to_piece; // llama_token_to_piece(special = true);
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    bool can_split_at_newline = false; // see llama_tokenize_parallel
+
+    // BPE merges keyed on the (left, right) token id pair - see bpe_key()
+    struct bpe_merge {
+        int rank;
+        id  merged;
+    };
+
+    std::unordered_map<uint64_t, bpe_merge> bpe_merges;
 
     // default LLaMA special tokens
     id special_bos_id  = 1;
@@ -2622,21 +2716,274 @@ struct llama_vocab {
 
     std::vector<char> precompiled_charsmap;
 
-    int find_bpe_rank(const std::string & token_left, const std::string & token_right) const {
-        GGML_ASSERT(token_left.find(' ') == std::string::npos);
-        GGML_ASSERT(token_left.find('\n') == std::string::npos);
-        GGML_ASSERT(token_right.find(' ') == std::string::npos);
-        GGML_ASSERT(token_right.find('\n') == std::string::npos);
+    static uint64_t bpe_key(id left, id right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
-            return -1;
+    const bpe_merge * find_bpe_merge(id left, id right) const {
+        if (left < 0 || right < 0) {
+            return nullptr;
+        }
+
+        auto it = bpe_merges.find(bpe_key(left, right));
+        if (it == bpe_merges.end()) {
+            return nullptr;
+        }
+
+        return &it->second;
+    }
+};
+
+// keeps the expert weights of memory mapped MoE models within a memory budget, for models that do not fit in RAM
+// the experts selected by the router of each layer are observed during the graph computation: the selected experts
+// are paged in and the least recently used ones are released, the experts predicted for the next layer are
+// prefetched and the most used experts are pinned
+struct llama_moe_pager {
+    struct expert {
+        // slices of the up, gate and down tensors of the expert in the mapped files
+        std::vector<std::pair<uint8_t *, size_t>> ranges;
+        size_t size = 0;
+
+        uint64_t n_used = 0; // number of tokens routed to the expert
+        uint64_t t_used = 0; // tick of the last use, for the LRU
+
+        bool resident   = false;
+        bool prefetched = false; // paged in by a prediction and not used since
+        bool pinned     = false;
+    };
+
+    // user data of the graph op that observes the selected experts of a layer
+    struct layer_hook {
+        llama_moe_pager * pager;
+        int il;
+    };
+
+    size_t budget        = 0;
+    size_t size_resident = 0;
+    size_t size_pinned   = 0;
+
+    int n_layer  = 0;
+    int n_expert = 0;
+
+    std::vector<expert>     experts; // [n_layer][n_expert]
+    std::vector<layer_hook> hooks;   // [n_layer]
+
+    // number of tokens routed to expert j of layer il + 1 after expert i of layer il, [n_layer][n_expert][n_expert]
+    std::vector<uint32_t> trans;
+
+    // selected experts of the last observed layer, [n_tokens][n_expert_used]
+    std::vector<int32_t> ids_prev;
+    int il_prev = -1;
+
+    uint64_t tick = 0;
+
+    uint64_t n_hit          = 0;
+    uint64_t n_miss         = 0;
+    uint64_t n_prefetch     = 0;
+    uint64_t n_prefetch_hit = 0;
+    uint64_t n_evict        = 0;
+
+    std::mutex mutex;
+
+    expert & get(int il, int e) {
+        return experts[il*n_expert + e];
+    }
+
+    static void advise(const expert & ex, bool willneed) {
+#ifdef _POSIX_MAPPED_FILES
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+        for (const auto & range : ex.ranges) {
+            size_t first = (size_t) range.first;
+            size_t last  = (size_t) range.first + range.second;
+
+            if (willneed) {
+                // the whole pages that contain the expert
+                first = first & ~(page_size - 1);
+                last  = GGML_PAD(last, page_size);
+
+                if (posix_madvise((void *) first, last - first, POSIX_MADV_WILLNEED)) {
+                    LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", strerror(errno));
+                }
+            } else {
+                // only the pages that are not shared with the neighboring experts
+                llama_mmap::align_range(&first, &last, page_size);
+                if (last == first) {
+                    continue;
+                }
+#if defined(MADV_PAGEOUT)
+                const int advice = MADV_PAGEOUT;
+#else
+                const int advice = MADV_DONTNEED;
+#endif
+                if (madvise((void *) first, last - first, advice)) {
+                    LLAMA_LOG_WARN("warning: madvise failed: %s\n", strerror(errno));
+                }
+            }
+        }
+#else
+        GGML_UNUSED(ex);
+        GGML_UNUSED(willneed);
+#endif
+    }
+
+    void page_in(expert & ex) {
+        if (!ex.resident) {
+            advise(ex, true);
+            ex.resident = true;
+            size_resident += ex.size;
+        }
+    }
+
+    void page_out(expert & ex) {
+        advise(ex, false);
+        ex.resident   = false;
+        ex.prefetched = false;
+        size_resident -= ex.size;
+        n_evict++;
+    }
+
+    // release the least recently used experts until the budget is met
+    // the experts used or prefetched in the current tick and the pinned experts are kept
+    void evict() {
+        while (size_resident > budget) {
+            expert * lru = nullptr;
+            for (auto & ex : experts) {
+                if (ex.resident && !ex.pinned && ex.t_used < tick && (!lru || ex.t_used < lru->t_used)) {
+                    lru = &ex;
+                }
+            }
+            if (!lru) {
+                break;
+            }
+            page_out(*lru);
+        }
+    }
+
+    // pin the most used experts, in up to a quarter of the budget
+    void repin() {
+        std::vector<expert *> order;
+        for (auto & ex : experts) {
+            ex.pinned = false;
+            if (ex.n_used > 0 && ex.size > 0) {
+                order.push_back(&ex);
+            }
+        }
+        std::sort(order.begin(), order.end(), [](const expert * a, const expert * b) {
+            return a->n_used > b->n_used;
+        });
+
+        size_pinned = 0;
+        for (expert * ex : order) {
+            if (size_pinned + ex->size > budget/4) {
+                break;
+            }
+            ex->pinned = true;
+            size_pinned += ex->size;
+            page_in(*ex);
+        }
+    }
+
+    // ids: the experts selected for each token of layer il, [n_tokens][n_expert_used] with a row stride of nb1 bytes
+    void observe(int il, const char * ids, size_t nb1, int n_expert_used, int64_t n_tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        tick++;
+
+        auto id = [&](int64_t t, int k) {
+            return *(const int32_t *) (ids + t*nb1 + k*sizeof(int32_t));
+        };
+
+        // routing from the previous layer, to predict the next layers
+        if (il > 0 && il_prev == il - 1 && (int64_t) ids_prev.size() == n_tokens*n_expert_used) {
+            uint32_t * trans_l = trans.data() + (size_t) (il - 1)*n_expert*n_expert;
+            for (int64_t t = 0; t < n_tokens; ++t) {
+                for (int i = 0; i < n_expert_used; ++i) {
+                    for (int j = 0; j < n_expert_used; ++j) {
+                        trans_l[ids_prev[t*n_expert_used + i]*n_expert + id(t, j)]++;
+                    }
+                }
+            }
+        }
+
+        for (int64_t t = 0; t < n_tokens; ++t) {
+            for (int k = 0; k < n_expert_used; ++k) {
+                expert & ex = get(il, id(t, k));
+                ex.n_used++;
+                if (ex.t_used == tick) {
+                    continue;
+                }
+                if (ex.resident) {
+                    n_hit++;
+                    n_prefetch_hit += ex.prefetched;
+                } else {
+                    n_miss++;
+                    page_in(ex);
+                }
+                ex.prefetched = false;
+                ex.t_used     = tick;
+            }
+        }
+
+        // prefetch the experts of the next layer that most often follow the selected ones
+        if (il + 1 < n_layer) {
+            const uint32_t * trans_l = trans.data() + (size_t) il*n_expert*n_expert;
+
+            std::vector<uint64_t> score(n_expert, 0);
+            for (int64_t t = 0; t < n_tokens; ++t) {
+                for (int k = 0; k < n_expert_used; ++k) {
+                    const uint32_t * row = trans_l + id(t, k)*n_expert;
+                    for (int j = 0; j < n_expert; ++j) {
+                        score[j] += row[j];
+                    }
+                }
+            }
+
+            std::vector<int> order(n_expert);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](int a, int b) { return score[a] > score[b]; });
+
+            const int64_t n_predict = std::min<int64_t>(n_expert, n_expert_used*n_tokens);
+            for (int64_t i = 0; i < n_predict && score[order[i]] > 0; ++i) {
+                expert & ex = get(il + 1, order[i]);
+                if (!ex.resident) {
+                    page_in(ex);
+                    ex.prefetched = true;
+                    n_prefetch++;
+                }
+                ex.t_used = tick;
+            }
         }
 
-        return it->second;
+        evict();
+
+        ids_prev.resize(n_tokens*n_expert_used);
+        for (int64_t t = 0; t < n_tokens; ++t) {
+            for (int k = 0; k < n_expert_used; ++k) {
+                ids_prev[t*n_expert_used + k] = id(t, k);
+            }
+        }
+        il_prev = il;
+
+        // update the pinned experts every 64 tokens of decoding
+        if (tick % (64*n_layer) == 0) {
+            repin();
+            evict();
+        }
     }
 };
 
+// graph op inserted after the expert selection of each layer, see llm_build_moe_ffn
+static void llama_moe_pager_observe(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    GGML_UNUSED(dst);
+    GGML_UNUSED(ith);
+    GGML_UNUSED(nth);
+
+    const auto * hook = (const llama_moe_pager::layer_hook *) userdata;
+
+    hook->pager->observe(hook->il, (const char *) a->data, a->nb[1], a->ne[0], a->ne[1]);
+}
+
 struct llama_model {
     e_model     type  = MODEL_UNKNOWN;
     llm_arch    arch  = LLM_ARCH_UNKNOWN;
@@ -2697,6 +3044,9 @@ struct llama_model {
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
 
+    // paging of the expert weights, when a budget is set
+    std::unique_ptr<llama_moe_pager> moe_pager;
+
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
@@ -2784,7 +3134,8 @@ struct llama_context {
 
     // sequence embeddings output (map of [n_embd] vectors)
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
-    std::map<llama_seq_id, std::vector<float>> embd_seq;
+    // llama_embd_seq_size() bytes per sequence, in the type cparams.embd_type
+    std::map<llama_seq_id, std::vector<uint8_t>> embd_seq;
 
     // whether we are computing encoder output or decoder output
     bool is_encoding = false;
@@ -2800,6 +3151,8 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    struct ggml_profiler * profiler = nullptr;
+
     // input tensors
     struct ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -2819,6 +3172,9 @@ struct llama_context {
 
     // control vectors
     struct llama_control_vector cvec;
+
+    // precomputed RoPE of the positions (CPU only)
+    struct llama_rope_table rope_table;
 };
 
 static size_t llama_get_device_count(const llama_model & model) {
@@ -5231,7 +5587,7 @@ static void llm_load_hparams(
 
 // TODO: This should probably be in llama.h
 static std::vector<llama_vocab::id> llama_tokenize_internal(
-    const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special = false
+    const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special = false, bool is_first = true, bool is_last = true
 );
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
 
@@ -5291,28 +5647,10 @@ static void llm_load_vocab(
         } else if (tokenizer_model == "gpt2") {
             vocab.type = LLAMA_VOCAB_TYPE_BPE;
 
-            // read bpe merges and populate bpe ranks
-            const int merges_keyidx = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str());
-            if (merges_keyidx == -1) {
+            // the merges are resolved to token ids once the token list is loaded (see below)
+            if (gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str()) == -1) {
                 throw std::runtime_error("cannot find tokenizer merges in model file\n");
             }
-            const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
-            for (int i = 0; i < n_merges; i++) {
-                const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
-                GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
-
-                std::string first;
-                std::string second;
-
-                const size_t pos = word.find(' ', 1);
-
-                if (pos != std::string::npos) {
-                    first  = word.substr(0, pos);
-                    second = word.substr(pos + 1);
-                }
-
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
-            }
 
             // default special tokens
             vocab.special_bos_id  = 11;
@@ -5527,6 +5865,47 @@ static void llm_load_vocab(
     }
     GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
 
+    // read bpe merges and populate the (left id, right id) -> (rank, merged id) table
+    if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        const int merges_keyidx = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str());
+        const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
+
+        vocab.bpe_merges.reserve(n_merges);
+
+        int n_skipped = 0;
+        for (int i = 0; i < n_merges; i++) {
+            const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
+            GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
+
+            std::string first;
+            std::string second;
+
+            const size_t pos = word.find(' ', 1);
+
+            if (pos != std::string::npos) {
+                first  = word.substr(0, pos);
+                second = word.substr(pos + 1);
+            }
+
+            const auto it_left   = vocab.token_to_id.find(first);
+            const auto it_right  = vocab.token_to_id.find(second);
+            const auto it_merged = vocab.token_to_id.find(first + second);
+
+            // a merge can only ever apply to (and produce) tokens that exist in the vocab
+            if (it_left == vocab.token_to_id.end() || it_right == vocab.token_to_id.end() || it_merged == vocab.token_to_id.end()) {
+                n_skipped++;
+                continue;
+            }
+
+            // keep the first (lowest) rank for duplicate pairs
+            vocab.bpe_merges.emplace(llama_vocab::bpe_key(it_left->second, it_right->second), llama_vocab::bpe_merge{ i, it_merged->second });
+        }
+
+        if (n_skipped > 0) {
+            LLAMA_LOG_WARN("%s: %d merges refer to tokens missing from the vocab - ignoring them\n", __func__, n_skipped);
+        }
+    }
+
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         // For Fill-In-the-Middle (FIM)/infill models which where converted
@@ -5666,6 +6045,33 @@ static void llm_load_vocab(
         LLAMA_LOG_INFO("%s: special tokens cache size = %u\n", __func__, (uint32_t)vocab.cache_special_tokens.size());
     }
 
+    // check if the text can be tokenized in chunks split at newlines
+    {
+        switch (vocab.type) {
+            case LLAMA_VOCAB_TYPE_BPE:
+                // the leading "\s?\p{L}+" regex of the MPT pre-tokenizer attaches the newline to the next word
+                vocab.can_split_at_newline = vocab.type_pre != LLAMA_VOCAB_PRE_TYPE_MPT;
+                break;
+            case LLAMA_VOCAB_TYPE_WPM:
+                vocab.can_split_at_newline = true;
+                break;
+            case LLAMA_VOCAB_TYPE_SPM:
+                // there is no pre-tokenizer, so no token is allowed to contain a newline
+                vocab.can_split_at_newline = true;
+                for (const auto & token_data : vocab.id_to_token) {
+                    if (token_data.text.size() > 1 && token_data.text.find('\n') != std::string::npos) {
+                        vocab.can_split_at_newline = false;
+                        break;
+                    }
+                }
+                break;
+            default:
+                // UGM normalizes the whitespace of the whole text
+                vocab.can_split_at_newline = false;
+                break;
+        }
+    }
+
     // build token to piece cache
     {
         size_t size_cache = 0;
@@ -5777,7 +6183,7 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch             = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch));
     LLAMA_LOG_INFO("%s: vocab type       = %s\n",     __func__, llama_model_vocab_type_name(vocab.type));
     LLAMA_LOG_INFO("%s: n_vocab          = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_merges.size());
     LLAMA_LOG_INFO("%s: vocab_only       = %d\n",     __func__, hparams.vocab_only);
 
     if (!hparams.vocab_only) {
@@ -5869,6 +6275,70 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
 }
 
 // Returns false if cancelled by progress_callback
+static std::unique_ptr<llama_moe_pager> llama_moe_pager_init(const llama_model & model, size_t budget) {
+    const auto & hparams = model.hparams;
+
+    if (hparams.n_expert == 0) {
+        LLAMA_LOG_WARN("%s: the model has no experts, ignoring the MoE budget\n", __func__);
+        return nullptr;
+    }
+    if (model.mappings.empty()) {
+        LLAMA_LOG_WARN("%s: the model is not memory mapped, ignoring the MoE budget\n", __func__);
+        return nullptr;
+    }
+#ifndef _POSIX_MAPPED_FILES
+    LLAMA_LOG_WARN("%s: expert paging is not supported on this platform, ignoring the MoE budget\n", __func__);
+    return nullptr;
+#endif
+
+    std::unique_ptr<llama_moe_pager> pager(new llama_moe_pager());
+
+    pager->budget   = budget;
+    pager->n_layer  = hparams.n_layer;
+    pager->n_expert = hparams.n_expert;
+    pager->experts.resize((size_t) pager->n_layer*pager->n_expert);
+    pager->trans.resize((size_t) pager->n_layer*pager->n_expert*pager->n_expert, 0);
+
+    auto is_mapped = [&](const ggml_tensor * t) {
+        for (const auto & mapping : model.mappings) {
+            const uint8_t * addr = (const uint8_t *) mapping->addr;
+            if ((const uint8_t *) t->data >= addr && (const uint8_t *) t->data + ggml_nbytes(t) <= addr + mapping->size) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    size_t size_total = 0;
+
+    for (int il = 0; il < pager->n_layer; ++il) {
+        const auto & layer = model.layers[il];
+
+        pager->hooks.push_back({ pager.get(), il });
+
+        for (const ggml_tensor * t : { layer.ffn_up_exps, layer.ffn_gate_exps, layer.ffn_down_exps }) {
+            if (t == nullptr) {
+                continue;
+            }
+            if (t->ne[2] != hparams.n_expert || !t->buffer || !ggml_backend_buffer_is_host(t->buffer) || !is_mapped(t)) {
+                LLAMA_LOG_WARN("%s: %s is not memory mapped in host memory, ignoring the MoE budget\n", __func__, t->name);
+                return nullptr;
+            }
+            for (int e = 0; e < pager->n_expert; ++e) {
+                auto & ex = pager->get(il, e);
+                ex.ranges.emplace_back((uint8_t *) t->data + e*t->nb[2], t->nb[2]);
+                ex.size += t->nb[2];
+                size_total += t->nb[2];
+            }
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: paging %.2f MiB of expert weights in a budget of %.2f MiB\n", __func__,
+            size_total / 1024.0 / 1024.0, budget / 1024.0 / 1024.0);
+
+    return pager;
+}
+
 static bool llm_load_tensors(
         llama_model_loader & ml,
         llama_model & model,
@@ -5877,6 +6347,7 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        size_t moe_budget,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -7504,7 +7975,8 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr);
+    // with a MoE budget the experts are paged in when they are used, do not read the whole model
+    ml.init_mappings(moe_budget == 0, use_mlock ? &model.mlock_mmaps : nullptr);
     model.mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -7638,6 +8110,14 @@ static bool llm_load_tensors(
         }
     }
 
+    if (moe_budget > 0) {
+        if (use_mlock) {
+            LLAMA_LOG_WARN("%s: the model is locked in memory, ignoring the MoE budget\n", __func__);
+        } else {
+            model.moe_pager = llama_moe_pager_init(model, moe_budget);
+        }
+    }
+
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
     model.t_load_us = ggml_time_us() - model.t_start_us;
@@ -7697,7 +8177,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 #endif
 
         if (!llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
+            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock, params.moe_budget,
             params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
@@ -7968,6 +8448,7 @@ static struct ggml_tensor * llm_build_ffn(
 
 static struct ggml_tensor * llm_build_moe_ffn(
         struct ggml_context * ctx,
+          const llama_model & model,
          struct ggml_tensor * cur,
          struct ggml_tensor * gate_inp,
          struct ggml_tensor * up_exps,
@@ -7995,6 +8476,12 @@ static struct ggml_tensor * llm_build_moe_ffn(
     cb(selected_experts->src[0], "ffn_moe_argsort", il);
     cb(selected_experts, "ffn_moe_topk", il);
 
+    if (model.moe_pager) {
+        // page in the selected experts and prefetch the next layer before the experts are used
+        selected_experts = ggml_map_custom1_inplace(ctx, selected_experts, llama_moe_pager_observe, 1, &model.moe_pager->hooks[il]);
+        cb(selected_experts, "ffn_moe_topk_paged", il);
+    }
+
     ggml_tensor * weights = ggml_get_rows(ctx,
             ggml_reshape_3d(ctx, probs, 1, n_expert, n_tokens), selected_experts); // [1, n_expert_used, n_tokens]
     cb(weights, "ffn_moe_weights", il);
@@ -8599,6 +9086,28 @@ struct llm_build_context {
                 } break;
         }
 
+        if (pooling_type != LLAMA_POOLING_TYPE_NONE) {
+            // L2 norm: rms_norm divides by sqrt(sum(x^2)/n_embd)
+            if (cparams.embd_normalize) {
+                cur = ggml_rms_norm(ctx0, cur, 1e-24f);
+                cur = ggml_scale(ctx0, cur, 1.0f/sqrtf(float(n_embd)));
+            }
+
+            // the rounding of INT8 and the packing of BINARY are done when extracting the embeddings
+            switch (cparams.embd_type) {
+                case LLAMA_EMBD_TYPE_F16:
+                    {
+                        cur = ggml_cast(ctx0, cur, GGML_TYPE_F16);
+                    } break;
+                case LLAMA_EMBD_TYPE_INT8:
+                    {
+                        cur = ggml_scale(ctx0, cur, 127.0f);
+                    } break;
+                default:
+                    break;
+            }
+        }
+
         cb(cur, "result_embd_pooled", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8758,7 +9267,7 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_moe_ffn(ctx0, cur,
+                cur = llm_build_moe_ffn(ctx0, model, cur,
                         model.layers[il].ffn_gate_inp,
                         model.layers[il].ffn_up_exps,
                         model.layers[il].ffn_gate_exps,
@@ -9238,7 +9747,7 @@ struct llm_build_context {
                     LLM_NORM_RMS, cb, il);
             cb(cur, "ffn_norm", il);
 
-            cur = llm_build_moe_ffn(ctx0, cur,
+            cur = llm_build_moe_ffn(ctx0, model, cur,
                     model.layers[il].ffn_gate_inp,
                     model.layers[il].ffn_up_exps,
                     model.layers[il].ffn_gate_exps,
@@ -9379,7 +9888,7 @@ struct llm_build_context {
                                  LLM_NORM, cb, il);
             cb(cur, "attn_out_norm", il);
 
-            cur = llm_build_moe_ffn(ctx0, cur,
+            cur = llm_build_moe_ffn(ctx0, model, cur,
                     model.layers[il].ffn_gate_inp,
                     model.layers[il].ffn_up_exps,
                     model.layers[il].ffn_gate_exps,
@@ -10509,7 +11018,7 @@ struct llm_build_context {
             cb(cur, "ffn_norm", il);
 
             ggml_tensor * moe_out =
-                    llm_build_moe_ffn(ctx0, cur,
+                    llm_build_moe_ffn(ctx0, model, cur,
                         model.layers[il].ffn_gate_inp,
                         model.layers[il].ffn_up_exps,
                         model.layers[il].ffn_gate_exps,
@@ -12668,7 +13177,7 @@ struct llm_build_context {
                     LLM_NORM_RMS, cb, il);
             cb(cur, "ffn_norm_exps", il);
 
-            cur = llm_build_moe_ffn(ctx0, cur,
+            cur = llm_build_moe_ffn(ctx0, model, cur,
                     model.layers[il].ffn_gate_inp,
                     model.layers[il].ffn_up_exps,
                     model.layers[il].ffn_gate_exps,
@@ -12888,7 +13397,7 @@ struct llm_build_context {
                 cb(cur, "ffn_norm", il);
 
                 ggml_tensor * moe_out =
-                        llm_build_moe_ffn(ctx0, cur,
+                        llm_build_moe_ffn(ctx0, model, cur,
                             model.layers[il].ffn_gate_inp,
                             model.layers[il].ffn_up_exps,
                             model.layers[il].ffn_gate_exps,
@@ -13667,6 +14176,10 @@ static struct ggml_cgraph * llama_build_graph(
             ggml_set_name(cur, name);
         }
 
+        if (lctx.rope_table.table && cur->op == GGML_OP_ROPE && cur->src[1] == lctx.inp_pos) {
+            lctx.rope_table.attach(cur);
+        }
+
         if (!lctx.cparams.offload_kqv) {
             if (strcmp(name, "kqv_merged_cont") == 0) {
                 // all nodes between the KV store and the attention output are run on the CPU
@@ -13935,6 +14448,10 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         const int64_t n_tokens = batch.n_tokens;
 
         ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
+
+        if (lctx.rope_table.table) {
+            lctx.rope_table.fill(*std::max_element(batch.pos, batch.pos + n_tokens) + 1);
+        }
     }
 
     if (hparams.causal_attn || cparams.pooling_type == LLAMA_POOLING_TYPE_NONE) {
@@ -14338,6 +14855,7 @@ static void llama_graph_compute(
     if (lctx.backend_cpu != nullptr) {
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        ggml_backend_cpu_set_profiler(lctx.backend_cpu, lctx.profiler);
     }
 #ifdef GGML_USE_BLAS
     if (lctx.backend_blas != nullptr) {
@@ -14618,13 +15136,44 @@ static int llama_decode_internal(
                         auto & embd_seq_out = lctx.embd_seq;
                         embd_seq_out.clear();
 
+                        const size_t embd_seq_size = llama_embd_seq_size(&lctx);
+
+                        // F32 and F16 are copied as they are, INT8 and BINARY are converted from F32
+                        const bool embd_convert = cparams.embd_type == LLAMA_EMBD_TYPE_INT8 || cparams.embd_type == LLAMA_EMBD_TYPE_BINARY;
+                        if (embd_convert) {
+                            ggml_backend_synchronize(backend_embd);
+                        }
+
+                        std::vector<float> embd_f32;
+
                         for (uint32_t i = 0; i < n_tokens; i++) {
                             const llama_seq_id seq_id = u_batch.seq_id[i][0];
                             if (embd_seq_out.find(seq_id) != embd_seq_out.end()) {
                                 continue;
                             }
-                            embd_seq_out[seq_id].resize(n_embd);
-                            ggml_backend_tensor_get_async(backend_embd, embd, embd_seq_out[seq_id].data(), (n_embd*seq_id)*sizeof(float), n_embd*sizeof(float));
+                            auto & out = embd_seq_out[seq_id];
+                            out.resize(embd_seq_size);
+                            if (!embd_convert) {
+                                ggml_backend_tensor_get_async(backend_embd, embd, out.data(), seq_id*embd->nb[1], embd_seq_size);
+                                continue;
+                            }
+
+                            embd_f32.resize(n_embd);
+                            ggml_backend_tensor_get(embd, embd_f32.data(), seq_id*embd->nb[1], n_embd*sizeof(float));
+
+                            if (cparams.embd_type == LLAMA_EMBD_TYPE_INT8) {
+                                int8_t * dst = (int8_t *) out.data();
+                                for (int64_t j = 0; j < n_embd; ++j) {
+                                    dst[j] = (int8_t) std::max(-127.0f, std::min(127.0f, std::round(embd_f32[j])));
+                                }
+                            } else {
+                                std::fill(out.begin(), out.end(), 0);
+                                for (int64_t j = 0; j < n_embd; ++j) {
+                                    if (embd_f32[j] > 0.0f) {
+                                        out[j/8] |= 1 << (j%8);
+                                    }
+                                }
+                            }
                         }
                     } break;
                 case LLAMA_POOLING_TYPE_UNSPECIFIED:
@@ -15349,6 +15898,17 @@ private:
 
 // TODO: there are a lot of common parts between spm and bpe tokenizers, should be refactored and reused
 
+struct llm_symbol_bpe {
+    using index = int;
+    index prev;
+    index next;
+    const char * text;
+    size_t n;
+    llama_vocab::id id; // -1 if the text is not a token of the vocab
+};
+
+static_assert(std::is_trivially_copyable<llm_symbol_bpe>::value, "llm_symbol_bpe is not trivially copyable");
+
 struct llm_bigram_bpe {
     struct comparator {
         bool operator()(const llm_bigram_bpe & l, const llm_bigram_bpe & r) const {
@@ -15356,13 +15916,14 @@ struct llm_bigram_bpe {
         }
     };
 
+    // used as a binary heap via std::push_heap/std::pop_heap so that the storage is reused across words
     using queue_storage = std::vector<llm_bigram_bpe>;
-    using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
-    llm_symbol::index left;
-    llm_symbol::index right;
-    std::string text;
+    llm_symbol_bpe::index left;
+    llm_symbol_bpe::index right;
+    llama_vocab::id id_left;
+    llama_vocab::id id_right;
+    llama_vocab::id id_merged;
     int rank;
-    size_t size;
 };
 
 struct llm_tokenizer_bpe {
@@ -15511,29 +16072,29 @@ struct llm_tokenizer_bpe {
     }
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-
         const auto word_collection = unicode_regex_split(text, regex_exprs);
 
-        symbols_final.clear();
-
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
+        for (const auto & word : word_collection) {
+            work_queue.clear();
             symbols.clear();
 
             int index = 0;
             size_t offset = 0;
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+            if (vocab.tokenizer_ignore_merges) {
+                const auto token = vocab.token_to_id.find(word);
+                if (token != vocab.token_to_id.end()) {
+                    symbols.emplace_back(llm_symbol_bpe{-1, -1, word.c_str(), word.size(), token->second});
+                    offset = word.size();
+                }
             }
 
             while (offset < word.size()) {
-                llm_symbol sym;
+                llm_symbol_bpe sym;
                 size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
                 sym.text = word.c_str() + offset;
                 sym.n = char_len;
+                sym.id = find_token(sym.text, sym.n);
                 offset += sym.n;
                 sym.prev = index - 1;
                 sym.next = offset == word.size() ? -1 : index + 1;
@@ -15546,8 +16107,9 @@ struct llm_tokenizer_bpe {
 
             // build token(s)
             while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+                std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+                const auto bigram = work_queue.back();
+                work_queue.pop_back();
 
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
@@ -15555,14 +16117,13 @@ struct llm_tokenizer_bpe {
                 if (left_symbol.n == 0 || right_symbol.n == 0) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
+                if (left_symbol.id != bigram.id_left || right_symbol.id != bigram.id_right) {
                     continue;  // Skip this bigram if it's outdated
                 }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
+                left_symbol.id = bigram.id_merged;
                 right_symbol.n = 0;
 
                 // remove the right sym from the chain
@@ -15575,83 +16136,71 @@ struct llm_tokenizer_bpe {
                 add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
-        }
-
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
+            // emit the finished tokens of the word in order
+            for (int i = symbols.empty() ? -1 : 0; i != -1; i = symbols[i].next) {
+                const auto & symbol = symbols[i];
                 if (symbol.n == 0) {
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
+                if (symbol.id != -1) {
+                    output.push_back(symbol.id);
+                } else {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        const llama_vocab::id id_byte = find_token(symbol.text + j, 1);
+                        if (id_byte != -1) {
+                            output.push_back(id_byte);
                         }
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
             }
         }
     }
 
 private:
+    llama_vocab::id find_token(const char * text, size_t n) {
+        piece.assign(text, n);
+
+        const auto token = vocab.token_to_id.find(piece);
+        if (token == vocab.token_to_id.end()) {
+            return -1;
+        }
+
+        return token->second;
+    }
+
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
+        const auto * merge = vocab.find_bpe_merge(symbols[left].id, symbols[right].id);
+        if (merge == nullptr) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left      = left;
+        bigram.right     = right;
+        bigram.id_left   = symbols[left].id;
+        bigram.id_right  = symbols[right].id;
+        bigram.id_merged = merge->merged;
+        bigram.rank      = merge->rank;
 
-        work_queue.push(bigram);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
     }
 
     const llama_vocab & vocab;
 
     std::vector<std::string> regex_exprs;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    // scratch buffers, reused across words and calls
+    std::vector<llm_symbol_bpe> symbols;
+    std::string piece;
 
-    llm_bigram_bpe::queue work_queue;
+    llm_bigram_bpe::queue_storage work_queue;
 };
 
 struct llm_tokenizer_wpm {
@@ -16290,7 +16839,9 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
     }
 }
 
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special) {
+// is_first/is_last are used when tokenizing consecutive pieces of a larger text (see llama_tokenize_parallel):
+// the BOS/EOS (CLS/SEP) tokens and the SPM leading space are only added at the start and end of the whole text
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special, bool is_first, bool is_last) {
     std::vector<llama_vocab::id> output;
     std::forward_list<fragment_buffer_variant> fragment_buffer;
 
@@ -16307,9 +16858,9 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                 // tokenizer.encode('', add_special_tokens=True)  returns [1]
                 // tokenizer.encode('', add_special_tokens=False) returns []
 
-                bool is_prev_special = true;  // prefix with space if first token
+                bool is_prev_special = is_first;  // prefix with space if first token
 
-                if (add_special && vocab.tokenizer_add_bos) {
+                if (add_special && is_first && vocab.tokenizer_add_bos) {
                     GGML_ASSERT(vocab.special_bos_id != -1);
                     output.push_back(vocab.special_bos_id);
                     is_prev_special = true;
@@ -16337,14 +16888,14 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                     }
                 }
 
-                if (add_special && vocab.tokenizer_add_bos && output.size() >= 2 && output[1] == vocab.special_bos_id) {
+                if (add_special && is_first && vocab.tokenizer_add_bos && output.size() >= 2 && output[1] == vocab.special_bos_id) {
                     LLAMA_LOG_WARN(
                         "%s: Added a BOS token to the prompt as specified by the model but the prompt "
                         "also starts with a BOS token. So now the final prompt starts with 2 BOS tokens. "
                         "Are you sure this is what you want?\n", __FUNCTION__);
                 }
 
-                if (add_special && vocab.tokenizer_add_eos) {
+                if (add_special && is_last && vocab.tokenizer_add_eos) {
                     GGML_ASSERT(vocab.special_eos_id != -1);
                     output.push_back(vocab.special_eos_id);
                 }
@@ -16353,7 +16904,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
             {
                 llm_tokenizer_bpe tokenizer(vocab);
 
-                if (add_special) {
+                if (add_special && is_first) {
                     tokenizer.append_bos(output);
                 }
                 for (const auto & fragment : fragment_buffer) {
@@ -16369,14 +16920,17 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                     }
                 }
 
-                if (add_special) {
+                if (add_special && is_last) {
                     tokenizer.append_eos(output);
+                }
+                if (add_special && is_first && is_last) {
+                    // for pieces of a larger text this is done on the joined output
                     tokenizer.check_double_bos_eos(output);
                 }
             } break;
         case LLAMA_VOCAB_TYPE_WPM:
             {
-                if (add_special) {
+                if (add_special && is_first) {
                     GGML_ASSERT(vocab.special_cls_id != -1);
                     output.push_back(vocab.special_cls_id);
                 }
@@ -16396,7 +16950,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                     }
                 }
 
-                if (add_special) {
+                if (add_special && is_last) {
                     GGML_ASSERT(vocab.special_sep_id != -1);
                     output.push_back(vocab.special_sep_id);
                 }
@@ -16405,7 +16959,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
             {
                 llm_tokenizer_ugm tokenizer(vocab);
 
-                if (add_special && vocab.tokenizer_add_bos != 0) {
+                if (add_special && is_first && vocab.tokenizer_add_bos != 0) {
                     GGML_ASSERT(vocab.special_bos_id != -1);
                     output.push_back(vocab.special_bos_id);
                 }
@@ -16422,14 +16976,14 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
                     }
                 }
 
-                if (add_special && vocab.tokenizer_add_bos != 0 && output.size() >= 2 && output[1] == vocab.special_bos_id) {
+                if (add_special && is_first && vocab.tokenizer_add_bos != 0 && output.size() >= 2 && output[1] == vocab.special_bos_id) {
                     LLAMA_LOG_WARN(
                         "%s: Added a BOS token to the prompt as specified by the model but the prompt "
                         "also starts with a BOS token. So now the final prompt starts with 2 BOS tokens. "
                         "Are you sure this is what you want?\n", __FUNCTION__);
                 }
 
-                if (add_special && vocab.tokenizer_add_eos == 1) {
+                if (add_special && is_last && vocab.tokenizer_add_eos == 1) {
                     GGML_ASSERT(vocab.special_eos_id != -1);
                     output.push_back(vocab.special_eos_id);
                 }
@@ -16928,12 +17482,19 @@ void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * c
         candidates->sorted = true;
     }
 
-    float max_l = candidates->data[0].logit;
-    float cum_sum = 0.0f;
-    for (size_t i = 0; i < candidates->size; ++i) {
-        float p = expf(candidates->data[i].logit - max_l);
-        candidates->data[i].p = p;
-        cum_sum += p;
+    // gather the logits in chunks to use the vectorized exp of ggml
+    const float max_l = candidates->data[0].logit;
+    double cum_sum = 0.0;
+    float buf[256];
+    for (size_t i0 = 0; i0 < candidates->size; i0 += 256) {
+        const size_t n = std::min(candidates->size - i0, (size_t) 256);
+        for (size_t i = 0; i < n; ++i) {
+            buf[i] = candidates->data[i0 + i].logit;
+        }
+        cum_sum += ggml_exp_sum_f32(buf, buf, n, max_l);
+        for (size_t i = 0; i < n; ++i) {
+            candidates->data[i0 + i].p = buf[i];
+        }
     }
     for (size_t i = 0; i < candidates->size; ++i) {
         candidates->data[i].p /= cum_sum;
@@ -17410,16 +17971,10 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
 }
 
 static void llama_log_softmax(float * array, size_t size) {
-    float max_l = *std::max_element(array, array + size);
-    float sum = 0.f;
-    for (size_t i = 0; i < size; ++i) {
-        float p = expf(array[i] - max_l);
-        sum += p;
-        array[i] = p;
-    }
+    const float log_sum = ggml_log_sum_exp_f32(array, size);
 
     for (size_t i = 0; i < size; ++i) {
-        array[i] = logf(array[i] / sum);
+        array[i] -= log_sum;
     }
 }
 
@@ -18750,6 +19305,7 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.moe_budget                  =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
@@ -18776,6 +19332,7 @@ struct llama_context_params llama_context_default_params() {
         /*.rope_scaling_type           =*/ LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED,
         /*.pooling_type                =*/ LLAMA_POOLING_TYPE_UNSPECIFIED,
         /*.attention_type              =*/ LLAMA_ATTENTION_TYPE_UNSPECIFIED,
+        /*.embd_type                   =*/ LLAMA_EMBD_TYPE_F32,
         /*.rope_freq_base              =*/ 0.0f,
         /*.rope_freq_scale             =*/ 0.0f,
         /*.yarn_ext_factor             =*/ -1.0f,
@@ -18792,6 +19349,7 @@ struct llama_context_params llama_context_default_params() {
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
+        /*.embd_normalize              =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -18817,6 +19375,16 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
     return result;
 }
 
+struct llama_state_file_params llama_state_file_default_params() {
+    struct llama_state_file_params result = {
+        /*.type_kv                     =*/ GGML_TYPE_Q8_0,
+        /*.compress                    =*/ false,
+        /*.outputs                     =*/ false,
+    };
+
+    return result;
+}
+
 size_t llama_max_devices(void) {
 #if defined(GGML_USE_RPC)
     return GGML_RPC_MAX_SERVERS;
@@ -18986,6 +19554,8 @@ struct llama_context * llama_new_context_with_model(
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.pooling_type     = params.pooling_type;
+    cparams.embd_type        = params.embd_type;
+    cparams.embd_normalize   = params.embd_normalize || params.embd_type == LLAMA_EMBD_TYPE_INT8;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -19239,6 +19809,41 @@ struct llama_context * llama_new_context_with_model(
                     ggml_backend_buffer_get_size(ctx->buf_output) / 1024.0 / 1024.0);
         }
 
+        // RoPE table, only read by the CPU kernels
+        bool cpu_only = true;
+        for (auto * backend : ctx->backends) {
+            bool is_cpu = ggml_backend_is_cpu(backend);
+#ifdef GGML_USE_BLAS
+            is_cpu = is_cpu || backend == ctx->backend_blas;
+#endif
+            cpu_only = cpu_only && is_cpu;
+        }
+
+        if (cpu_only && hparams.rope_type != LLAMA_ROPE_TYPE_NONE && hparams.n_rot > 0) {
+            auto & rt = ctx->rope_table;
+
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+
+            rt.ctx   = ggml_init(params);
+            rt.table = ggml_new_tensor_2d(rt.ctx, GGML_TYPE_F32, hparams.n_rot, cparams.n_ctx);
+            ggml_set_name(rt.table, "rope_table");
+
+            // the rows are only touched as the positions are used
+            rt.buf = ggml_backend_alloc_ctx_tensors_from_buft(rt.ctx, llama_default_buffer_type_cpu(true));
+            if (rt.buf == nullptr) {
+                LLAMA_LOG_WARN("%s: failed to allocate the RoPE table\n", __func__);
+                rt.table = nullptr;
+            } else {
+                LLAMA_LOG_INFO("%s: %10s    RoPE table size = %8.2f MiB\n", __func__,
+                        ggml_backend_buffer_name(rt.buf),
+                        ggml_backend_buffer_get_size(rt.buf) / 1024.0 / 1024.0);
+            }
+        }
+
         // scheduler and compute buffers
         {
             // buffer types used for the compute buffer of each backend
@@ -19502,6 +20107,67 @@ llama_token llama_model_decoder_start_token(const struct llama_model * model) {
     return model->hparams.dec_start_token_id;
 }
 
+int32_t llama_model_expert_usage(const struct llama_model * model, int32_t il, uint64_t * counts, int32_t n_counts) {
+    llama_moe_pager * pager = model->moe_pager.get();
+    if (!pager || il < 0 || il >= pager->n_layer) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(pager->mutex);
+
+    for (int32_t e = 0; e < std::min(n_counts, pager->n_expert); ++e) {
+        counts[e] = pager->get(il, e).n_used;
+    }
+
+    return pager->n_expert;
+}
+
+void llama_model_print_expert_stats(const struct llama_model * model) {
+    llama_moe_pager * pager = model->moe_pager.get();
+    if (!pager) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(pager->mutex);
+
+    const uint64_t n_access = pager->n_hit + pager->n_miss;
+
+    LLAMA_LOG_INFO("\n");
+    LLAMA_LOG_INFO("%s: budget   = %10.2f MiB, resident = %10.2f MiB, pinned = %10.2f MiB\n", __func__,
+            pager->budget / 1024.0 / 1024.0, pager->size_resident / 1024.0 / 1024.0, pager->size_pinned / 1024.0 / 1024.0);
+    LLAMA_LOG_INFO("%s: accesses = %10" PRIu64 ", hits = %10" PRIu64 " (%5.1f%%), evictions = %10" PRIu64 "\n", __func__,
+            n_access, pager->n_hit, n_access ? 100.0*pager->n_hit/n_access : 0.0, pager->n_evict);
+    LLAMA_LOG_INFO("%s: prefetch = %10" PRIu64 ", used = %10" PRIu64 " (%5.1f%%)\n", __func__,
+            pager->n_prefetch, pager->n_prefetch_hit, pager->n_prefetch ? 100.0*pager->n_prefetch_hit/pager->n_prefetch : 0.0);
+
+    for (int il = 0; il < pager->n_layer; ++il) {
+        uint64_t n_tokens = 0;
+        int n_resident = 0;
+        std::vector<int> order;
+        for (int e = 0; e < pager->n_expert; ++e) {
+            const auto & ex = pager->get(il, e);
+            n_tokens   += ex.n_used;
+            n_resident += ex.resident;
+            order.push_back(e);
+        }
+        if (n_tokens == 0) {
+            continue;
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return pager->get(il, a).n_used > pager->get(il, b).n_used;
+        });
+
+        // the most used experts with their share of the routed tokens
+        std::string top;
+        for (int i = 0; i < std::min(4, pager->n_expert); ++i) {
+            const auto & ex = pager->get(il, order[i]);
+            top += format(" %3d%s %5.1f%%", order[i], ex.pinned ? "*" : " ", 100.0*ex.n_used/n_tokens);
+        }
+
+        LLAMA_LOG_INFO("%s: layer %3d: resident %3d/%3d, top:%s\n", __func__, il, n_resident, pager->n_expert, top.c_str());
+    }
+}
+
 uint32_t llama_model_quantize(
         const char * fname_inp,
         const char * fname_out,
@@ -19881,93 +20547,94 @@ struct llama_data_file_context : llama_data_context {
     }
 };
 
-/** copy state data into either a buffer or file depending on the passed in context
- *
- * file context:
- * llama_file file("/path", "wb");
- * llama_data_file_context data_ctx(&file);
- * llama_state_get_data(ctx, &data_ctx);
- *
- * buffer context:
- * std::vector<uint8_t> buf(max_size, 0);
- * llama_data_buffer_context data_ctx(&buf.data());
- * llama_state_get_data(ctx, &data_ctx);
- *
-*/
-static void llama_state_get_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
-    llama_synchronize(ctx);
+static void llama_state_write_rng(struct llama_context * ctx, llama_data_context * data_ctx) {
+    std::ostringstream rng_ss;
+    rng_ss << ctx->rng;
 
-    // copy rng
-    {
-        std::ostringstream rng_ss;
-        rng_ss << ctx->rng;
+    const std::string & rng_str  = rng_ss.str();
+    const size_t        rng_size = rng_str.size();
 
-        const std::string & rng_str  = rng_ss.str();
-        const size_t        rng_size = rng_str.size();
+    GGML_ASSERT(rng_size <= LLAMA_MAX_RNG_STATE);
 
-        GGML_ASSERT(rng_size <= LLAMA_MAX_RNG_STATE);
+    data_ctx->write(&rng_size,      sizeof(rng_size));
+    data_ctx->write(rng_str.data(), rng_size);
+}
 
-        data_ctx->write(&rng_size,      sizeof(rng_size));
-        data_ctx->write(rng_str.data(), rng_size);
-    }
+static void llama_state_write_outputs(struct llama_context * ctx, llama_data_context * data_ctx) {
+    // Can't use ctx->n_outputs because it's not for the
+    // entire last batch when n_ubatch is smaller than n_batch
+    size_t n_outputs = 0;
 
-    // copy outputs
+    // copy output ids
     {
-        // Can't use ctx->n_outputs because it's not for the
-        // entire last batch when n_ubatch is smaller than n_batch
-        size_t n_outputs = 0;
-
-        // copy output ids
-        {
-            std::vector<int32_t> output_pos;
+        std::vector<int32_t> output_pos;
 
-            const size_t    n_batch = ctx->cparams.n_batch;
-            const auto & output_ids = ctx->output_ids;
+        const size_t    n_batch = ctx->cparams.n_batch;
+        const auto & output_ids = ctx->output_ids;
 
-            output_pos.resize(ctx->output_size);
+        output_pos.resize(ctx->output_size);
 
-            // build a more compact representation of the output ids
-            for (size_t i = 0; i < n_batch; ++i) {
-                // map an output id to a position in the batch
-                int32_t pos = output_ids[i];
-                if (pos >= 0) {
-                    if ((size_t) pos >= n_outputs) {
-                        n_outputs = pos + 1;
-                    }
-                    GGML_ASSERT((size_t) pos < ctx->output_size);
-                    output_pos[pos] = i;
+        // build a more compact representation of the output ids
+        for (size_t i = 0; i < n_batch; ++i) {
+            // map an output id to a position in the batch
+            int32_t pos = output_ids[i];
+            if (pos >= 0) {
+                if ((size_t) pos >= n_outputs) {
+                    n_outputs = pos + 1;
                 }
+                GGML_ASSERT((size_t) pos < ctx->output_size);
+                output_pos[pos] = i;
             }
+        }
 
-            data_ctx->write(&n_outputs, sizeof(n_outputs));
+        data_ctx->write(&n_outputs, sizeof(n_outputs));
 
-            if (n_outputs) {
-                data_ctx->write(output_pos.data(), n_outputs * sizeof(int32_t));
-            }
+        if (n_outputs) {
+            data_ctx->write(output_pos.data(), n_outputs * sizeof(int32_t));
         }
+    }
 
-        // copy logits
-        {
-            const size_t logits_size = std::min(ctx->logits_size, n_outputs * ctx->model.hparams.n_vocab);
+    // copy logits
+    {
+        const size_t logits_size = std::min(ctx->logits_size, n_outputs * ctx->model.hparams.n_vocab);
 
-            data_ctx->write(&logits_size, sizeof(logits_size));
+        data_ctx->write(&logits_size, sizeof(logits_size));
 
-            if (logits_size) {
-                data_ctx->write(ctx->logits, logits_size * sizeof(float));
-            }
+        if (logits_size) {
+            data_ctx->write(ctx->logits, logits_size * sizeof(float));
         }
+    }
 
-        // copy embeddings
-        {
-            const size_t embeddings_size = std::min(ctx->embd_size, n_outputs * ctx->model.hparams.n_embd);
+    // copy embeddings
+    {
+        const size_t embeddings_size = std::min(ctx->embd_size, n_outputs * ctx->model.hparams.n_embd);
 
-            data_ctx->write(&embeddings_size, sizeof(embeddings_size));
+        data_ctx->write(&embeddings_size, sizeof(embeddings_size));
 
-            if (embeddings_size) {
-                data_ctx->write(ctx->embd, embeddings_size * sizeof(float));
-            }
+        if (embeddings_size) {
+            data_ctx->write(ctx->embd, embeddings_size * sizeof(float));
         }
     }
+}
+
+/** copy state data into either a buffer or file depending on the passed in context
+ *
+ * file context:
+ * llama_file file("/path", "wb");
+ * llama_data_file_context data_ctx(&file);
+ * llama_state_get_data(ctx, &data_ctx);
+ *
+ * buffer context:
+ * std::vector<uint8_t> buf(max_size, 0);
+ * llama_data_buffer_context data_ctx(&buf.data());
+ * llama_state_get_data(ctx, &data_ctx);
+ *
+*/
+static void llama_state_get_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
+    llama_synchronize(ctx);
+
+    llama_state_write_rng(ctx, data_ctx);
+    llama_state_write_outputs(ctx, data_ctx);
 
     // copy kv cache
     {
@@ -20050,27 +20717,23 @@ size_t llama_state_get_data(struct llama_context * ctx, uint8_t * dst) {
     return data_ctx.get_size_written();
 }
 
-// Sets the state reading from the specified source address
-size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
-    llama_synchronize(ctx);
-
-    const uint8_t * inp = src;
+static const uint8_t * llama_state_read_rng(struct llama_context * ctx, const uint8_t * inp) {
+    size_t rng_size;
+    memcpy(&rng_size, inp, sizeof(rng_size)); inp += sizeof(rng_size);
 
-    // set rng
-    {
-        size_t rng_size;
-        memcpy(&rng_size, inp, sizeof(rng_size)); inp += sizeof(rng_size);
+    GGML_ASSERT(rng_size <= LLAMA_MAX_RNG_STATE);
 
-        GGML_ASSERT(rng_size <= LLAMA_MAX_RNG_STATE);
+    std::string rng_str((const char *)inp, rng_size); inp += rng_size;
 
-        std::string rng_str((const char *)inp, rng_size); inp += rng_size;
+    std::istringstream rng_ss(rng_str);
+    rng_ss >> ctx->rng;
 
-        std::istringstream rng_ss(rng_str);
-        rng_ss >> ctx->rng;
+    GGML_ASSERT(!rng_ss.fail());
 
-        GGML_ASSERT(!rng_ss.fail());
-    }
+    return inp;
+}
 
+static const uint8_t * llama_state_read_outputs(struct llama_context * ctx, const uint8_t * inp) {
     // set output ids
     {
         size_t n_outputs;
@@ -20123,6 +20786,18 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
         }
     }
 
+    return inp;
+}
+
+// Sets the state reading from the specified source address
+size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
+    llama_synchronize(ctx);
+
+    const uint8_t * inp = src;
+
+    inp = llama_state_read_rng(ctx, inp);
+    inp = llama_state_read_outputs(ctx, inp);
+
     // set kv cache
     {
         const auto & kv_self = ctx->kv_self;
@@ -20219,12 +20894,20 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
     return nread;
 }
 
+// compact session files, see below
+static bool   llama_state_load_file_compact    (struct llama_context * ctx, llama_file & file, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
+static size_t llama_state_seq_load_file_compact(struct llama_context * ctx, llama_file & file, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
+
 static bool llama_state_load_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(path_session, "rb");
 
     // sanity checks
     {
         const uint32_t magic   = file.read_u32();
+        if (magic == LLAMA_STATE_COMPACT_MAGIC) {
+            return llama_state_load_file_compact(ctx, file, tokens_out, n_token_capacity, n_token_count_out);
+        }
+
         const uint32_t version = file.read_u32();
 
         if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
@@ -20310,7 +20993,8 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
     }
 }
 
-size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id) {
+// the cells of the sequence with a position >= p0 (all the cells when p0 < 0)
+static size_t llama_state_seq_get_size_internal(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0) {
     // save the size of size_t as a uint32_t for safety check
     const size_t size_t_size_size = sizeof(uint32_t);
 
@@ -20328,7 +21012,7 @@ size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id)
 
     for (uint32_t i = 0; i < kv_self.size; ++i) {
         const auto & cell = kv_self.cells[i];
-        if (cell.seq_id.count(seq_id) > 0) {
+        if (cell.seq_id.count(seq_id) > 0 && cell.pos >= p0) {
             ++s_cell_count;
             s_cell_data_size += sizeof(llama_pos);
         }
@@ -20363,7 +21047,47 @@ size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id)
     return s_total;
 }
 
-static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_context & data_ctx, llama_seq_id seq_id) {
+size_t llama_state_seq_get_size(struct llama_context * ctx, llama_seq_id seq_id) {
+    return llama_state_seq_get_size_internal(ctx, seq_id, -1);
+}
+
+// the ranges of the cells of the sequence with a position >= p0, from inclusive, to exclusive
+static std::vector<std::pair<uint32_t, uint32_t>> llama_state_seq_cell_ranges(const llama_kv_cache & kv_self, llama_seq_id seq_id, llama_pos p0, uint32_t & cell_count) {
+    std::vector<std::pair<uint32_t, uint32_t>> cell_ranges;
+
+    cell_count = 0;
+
+    uint32_t cell_range_begin = kv_self.size;
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        const auto & cell = kv_self.cells[i];
+        if (cell.has_seq_id(seq_id) && cell.pos >= p0) {
+            ++cell_count;
+            if (cell_range_begin == kv_self.size) {
+                cell_range_begin = i;
+            }
+        }
+        else {
+            if (cell_range_begin != kv_self.size) {
+                cell_ranges.emplace_back(cell_range_begin, i);
+                cell_range_begin = kv_self.size;
+            }
+        }
+    }
+    if (cell_range_begin != kv_self.size) {
+        cell_ranges.emplace_back(cell_range_begin, kv_self.size);
+    }
+
+    // DEBUG CHECK: Sum of cell counts in ranges should equal the total cell count
+    uint32_t cell_count_check = 0;
+    for (const auto & range : cell_ranges) {
+        cell_count_check += range.second - range.first;
+    }
+    GGML_ASSERT(cell_count == cell_count_check);
+
+    return cell_ranges;
+}
+
+static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_context & data_ctx, llama_seq_id seq_id, llama_pos p0) {
     llama_synchronize(ctx);
 
     const auto & kv_self = ctx->kv_self;
@@ -20373,39 +21097,11 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
     const uint32_t size_t_size = sizeof(size_t);
     data_ctx.write(&size_t_size, sizeof(size_t_size));
 
-    std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
     uint32_t cell_count = 0;
 
     // Count the number of cells with the specified seq_id
     // Find all the ranges of cells with this seq id
-    {
-        uint32_t cell_range_begin = kv_self.size;
-        for (uint32_t i = 0; i < kv_self.size; ++i) {
-            const auto & cell = kv_self.cells[i];
-            if (cell.has_seq_id(seq_id)) {
-                ++cell_count;
-                if (cell_range_begin == kv_self.size) {
-                    cell_range_begin = i;
-                }
-            }
-            else {
-                if (cell_range_begin != kv_self.size) {
-                    cell_ranges.emplace_back(cell_range_begin, i);
-                    cell_range_begin = kv_self.size;
-                }
-            }
-        }
-        if (cell_range_begin != kv_self.size) {
-            cell_ranges.emplace_back(cell_range_begin, kv_self.size);
-        }
-
-        // DEBUG CHECK: Sum of cell counts in ranges should equal the total cell count
-        uint32_t cell_count_check = 0;
-        for (const auto & range : cell_ranges) {
-            cell_count_check += range.second - range.first;
-        }
-        GGML_ASSERT(cell_count == cell_count_check);
-    }
+    const auto cell_ranges = llama_state_seq_cell_ranges(kv_self, seq_id, p0, cell_count);
 
     // Write the cell count
     data_ctx.write(&cell_count, sizeof(cell_count));
@@ -20507,17 +21203,46 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
 
 size_t llama_state_seq_get_data(struct llama_context* ctx, uint8_t* dst, llama_seq_id seq_id) {
     llama_data_buffer_context data_ctx(dst);
-    return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+    return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, -1);
 }
 
-size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+// allocate a contiguous block of cells starting at kv_self.head for the restored positions of a sequence
+static bool llama_state_seq_alloc_cells(struct llama_kv_cache & kv_self, llama_seq_id dest_seq_id, const llama_pos * pos, uint32_t cell_count) {
+    llama_batch batch = llama_batch_init(cell_count, 0, 1);
+    batch.n_tokens = cell_count;
+    for (uint32_t i = 0; i < cell_count; ++i) {
+        batch.pos[i] = pos[i];
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = dest_seq_id;
+    }
+    if (!llama_kv_cache_find_slot(kv_self, batch)) {
+        llama_batch_free(batch);
+        return false;
+    }
+
+    // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
+    // Assume that this is one contiguous block of cells
+    GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
+    GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
+    GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+    GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
+    GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+
+    // Cleanup
+    llama_batch_free(batch);
+
+    return true;
+}
+
+// replaces the cells of the sequence with a position >= p0 (the whole sequence when p0 < 0)
+static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id, llama_pos p0) {
     llama_synchronize(ctx);
 
     auto & kv_self = ctx->kv_self;
     GGML_ASSERT(!kv_self.recurrent); // not implemented
 
     // Wipe the slot
-    llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+    llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
 
     const uint8_t * inp = src;
 
@@ -20561,33 +21286,14 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
     // Allocate the new cells for the slot
     if (cell_count) {
-        llama_batch batch = llama_batch_init(cell_count, 0, 1);
-        batch.n_tokens = cell_count;
-        for (uint32_t i = 0; i < cell_count; ++i) {
-            llama_pos pos;
-            memcpy(&pos, inp, sizeof(pos));
-            inp += sizeof(pos);
+        std::vector<llama_pos> pos(cell_count);
+        memcpy(pos.data(), inp, cell_count * sizeof(llama_pos));
+        inp += cell_count * sizeof(llama_pos);
 
-            batch.pos[i] = pos;
-            batch.n_seq_id[i] = 1;
-            batch.seq_id[i][0] = dest_seq_id;
-        }
-        if (!llama_kv_cache_find_slot(kv_self, batch)) {
-            llama_batch_free(batch);
+        if (!llama_state_seq_alloc_cells(kv_self, dest_seq_id, pos.data(), cell_count)) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return 0;
         }
-
-        // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-        // Assume that this is one contiguous block of cells
-        GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-        GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-        GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-        GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
-
-        // Cleanup
-        llama_batch_free(batch);
     }
 
     const uint32_t kv_size = kv_self.size;
@@ -20603,7 +21309,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
         inp += sizeof(k_type_i_ref);
         const int32_t k_type_i = (int32_t)kv_self.k_l[il]->type;
         if (k_type_i != k_type_i_ref) {
-            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
             LLAMA_LOG_ERROR("%s: mismatched key type (%d != %d, layer %d)\n", __func__, k_type_i, k_type_i_ref, il);
             return 0;
         }
@@ -20614,7 +21320,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
         inp += sizeof(k_size_row_ref);
         const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
         if (k_size_row != k_size_row_ref) {
-            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
             LLAMA_LOG_ERROR("%s: mismatched key row size (%zu != %zu, layer %d)\n", __func__, k_size_row, k_size_row_ref, il);
             return 0;
         }
@@ -20637,7 +21343,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             inp += sizeof(v_type_i_ref);
             const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
             if (v_type_i != v_type_i_ref) {
-                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
                 return 0;
             }
@@ -20648,7 +21354,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             inp += sizeof(v_size_row_ref);
             const size_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
             if (v_size_row != v_size_row_ref) {
-                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value row size (%zu != %zu, layer %d)\n", __func__, v_size_row, v_size_row_ref, il);
                 return 0;
             }
@@ -20670,7 +21376,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             inp += sizeof(v_type_i_ref);
             const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
             if (v_type_i != v_type_i_ref) {
-                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
                 return 0;
             }
@@ -20681,7 +21387,7 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             inp += sizeof(v_size_el_ref);
             const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
             if (v_size_el != v_size_el_ref) {
-                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, p0, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value element size (%zu != %zu, layer %d)\n", __func__, v_size_el, v_size_el_ref, il);
                 return 0;
             }
@@ -20702,6 +21408,10 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     return nread;
 }
 
+size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+    return llama_state_seq_set_data_internal(ctx, src, dest_seq_id, -1);
+}
+
 static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     llama_file file(filepath, "wb");
 
@@ -20714,7 +21424,7 @@ static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, con
 
     // save the context state using stream saving
     llama_data_file_context data_ctx(&file);
-    llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+    llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, -1);
 
     const size_t res = file.tell();
     GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + data_ctx.get_size_written());
@@ -20727,6 +21437,10 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
     // version checks
     {
         const uint32_t magic   = file.read_u32();
+        if (magic == LLAMA_STATE_COMPACT_MAGIC) {
+            return llama_state_seq_load_file_compact(ctx, file, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out);
+        }
+
         const uint32_t version = file.read_u32();
 
         if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
@@ -20783,71 +21497,1167 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
     }
 }
 
-void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
-    ctx->cparams.n_threads       = n_threads;
-    ctx->cparams.n_threads_batch = n_threads_batch;
+size_t llama_state_seq_get_size_delta(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0) {
+    return sizeof(p0) + llama_state_seq_get_size_internal(ctx, seq_id, p0);
 }
 
-uint32_t llama_n_threads(struct llama_context * ctx) {
-    return ctx->cparams.n_threads;
+size_t llama_state_seq_get_data_delta(struct llama_context * ctx, uint8_t * dst, llama_seq_id seq_id, llama_pos p0) {
+    llama_data_buffer_context data_ctx(dst);
+    data_ctx.write(&p0, sizeof(p0));
+    return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, p0);
 }
 
-uint32_t llama_n_threads_batch(struct llama_context * ctx) {
-    return ctx->cparams.n_threads_batch;
-}
+size_t llama_state_seq_set_data_delta(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+    llama_pos p0;
+    memcpy(&p0, src, sizeof(p0));
 
-void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
-    ctx->abort_callback      = abort_callback;
-    ctx->abort_callback_data = abort_callback_data;
+    const size_t nread = llama_state_seq_set_data_internal(ctx, src + sizeof(p0), dest_seq_id, p0);
+    return nread ? sizeof(p0) + nread : 0;
 }
 
-void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
-    ctx->cparams.embeddings = embeddings;
-}
+// sequence state log: magic, version and records, each holding either a full snapshot of the sequence or the cells
+// appended since the previous record, with the tokens added since the previous record
+struct llama_state_seq_log_record {
+    // magic, p0, p1, n_token, n_data
+    static constexpr size_t header_size = sizeof(uint32_t) + 2*sizeof(llama_pos) + sizeof(uint32_t) + sizeof(uint64_t);
 
-void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
-    ctx->cparams.causal_attn = causal_attn;
-}
+    size_t    offs;    // offset of the record in the file
+    llama_pos p0;      // position of the first cell, -1 for a full snapshot
+    llama_pos p1;      // end position of the sequence
+    uint32_t  n_token; // number of tokens
+    uint64_t  n_data;  // size of the sequence state data
 
-struct llama_batch llama_batch_get_one(
-             llama_token * tokens,
-                 int32_t   n_tokens,
-               llama_pos   pos_0,
-            llama_seq_id   seq_id) {
-    return {
-        /*n_tokens       =*/ n_tokens,
-        /*tokens         =*/ tokens,
-        /*embd           =*/ nullptr,
-        /*pos            =*/ nullptr,
-        /*n_seq_id       =*/ nullptr,
-        /*seq_id         =*/ nullptr,
-        /*logits         =*/ nullptr,
-        /*all_pos_0      =*/ pos_0,
-        /*all_pos_1      =*/ 1,
-        /*all_seq_id     =*/ seq_id,
-    };
-}
+    size_t end() const {
+        return offs + header_size + n_token*sizeof(llama_token) + n_data;
+    }
+};
 
-struct llama_batch llama_batch_init(int32_t n_tokens_alloc, int32_t embd, int32_t n_seq_max) {
-    llama_batch batch = { 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, 0, };
+// the complete records of the log, a record truncated by an interrupted append ends the log
+static std::vector<llama_state_seq_log_record> llama_state_seq_log_read_records(const llama_file & file) {
+    std::vector<llama_state_seq_log_record> records;
 
-    if (embd) {
-        batch.embd = (float *) malloc(sizeof(float) * n_tokens_alloc * embd);
-    } else {
-        batch.token = (llama_token *) malloc(sizeof(llama_token) * n_tokens_alloc);
-    }
+    size_t offs = 2*sizeof(uint32_t);
+    while (offs + llama_state_seq_log_record::header_size <= file.size) {
+        file.seek(offs, SEEK_SET);
+        if (file.read_u32() != LLAMA_STATE_SEQ_LOG_MAGIC) {
+            break;
+        }
 
-    batch.pos      = (llama_pos *)     malloc(sizeof(llama_pos)      * n_tokens_alloc);
-    batch.n_seq_id = (int32_t *)       malloc(sizeof(int32_t)        * n_tokens_alloc);
-    batch.seq_id   = (llama_seq_id **) malloc(sizeof(llama_seq_id *) * (n_tokens_alloc + 1));
-    for (int i = 0; i < n_tokens_alloc; ++i) {
-        batch.seq_id[i] = (llama_seq_id *) malloc(sizeof(llama_seq_id) * n_seq_max);
-    }
-    batch.seq_id[n_tokens_alloc] = nullptr;
+        llama_state_seq_log_record rec;
+        rec.offs = offs;
+        file.read_raw(&rec.p0, sizeof(rec.p0));
+        file.read_raw(&rec.p1, sizeof(rec.p1));
+        rec.n_token = file.read_u32();
+        file.read_raw(&rec.n_data, sizeof(rec.n_data));
 
-    batch.logits   = (int8_t *)        malloc(sizeof(int8_t)         * n_tokens_alloc);
+        if (rec.end() > file.size) {
+            break;
+        }
 
-    return batch;
+        records.push_back(rec);
+        offs = rec.end();
+    }
+
+    return records;
+}
+
+static size_t llama_state_seq_save_log_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    bool exists = false;
+    {
+        FILE * fp = ggml_fopen(filepath, "rb");
+        if (fp) {
+            exists = true;
+            fclose(fp);
+        }
+    }
+
+    llama_file file(filepath, exists ? "r+b" : "wb");
+
+    std::vector<llama_state_seq_log_record> records;
+
+    if (file.size >= 2*sizeof(uint32_t)) {
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+
+        if (magic != LLAMA_STATE_SEQ_LOG_MAGIC || version != LLAMA_STATE_SEQ_LOG_VERSION) {
+            LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state log: %08x, %08x\n", __func__, magic, version);
+            return 0;
+        }
+
+        records = llama_state_seq_log_read_records(file);
+    } else {
+        file.write_u32(LLAMA_STATE_SEQ_LOG_MAGIC);
+        file.write_u32(LLAMA_STATE_SEQ_LOG_VERSION);
+    }
+
+    // the tokens logged since the last full snapshot
+    std::vector<llama_token> tokens_prev;
+    llama_pos p1_prev = -1;
+    for (const auto & rec : records) {
+        if (rec.p0 < 0) {
+            tokens_prev.clear();
+        }
+        tokens_prev.resize(tokens_prev.size() + rec.n_token);
+        file.seek(rec.offs + llama_state_seq_log_record::header_size, SEEK_SET);
+        file.read_raw(tokens_prev.data() + tokens_prev.size() - rec.n_token, rec.n_token*sizeof(llama_token));
+        p1_prev = rec.p1;
+    }
+
+    const llama_pos p1 = llama_kv_cache_seq_pos_max(ctx->kv_self, seq_id) + 1;
+
+    // only the new cells when the sequence extends the logged one, otherwise a full snapshot
+    llama_pos p0 = p1_prev;
+    if (records.empty() || p1 < p1_prev || n_token_count < tokens_prev.size() ||
+        !std::equal(tokens_prev.begin(), tokens_prev.end(), tokens)) {
+        p0 = -1;
+        tokens_prev.clear();
+    }
+
+    const size_t   offs    = records.empty() ? 2*sizeof(uint32_t) : records.back().end();
+    const uint32_t n_token = n_token_count - tokens_prev.size();
+    const uint64_t n_data  = llama_state_seq_get_size_internal(ctx, seq_id, p0);
+
+    file.seek(offs, SEEK_SET);
+    file.write_u32(LLAMA_STATE_SEQ_LOG_MAGIC);
+    file.write_raw(&p0, sizeof(p0));
+    file.write_raw(&p1, sizeof(p1));
+    file.write_u32(n_token);
+    file.write_raw(&n_data, sizeof(n_data));
+    file.write_raw(tokens + tokens_prev.size(), n_token*sizeof(llama_token));
+
+    llama_data_file_context data_ctx(&file);
+    llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, p0);
+    GGML_ASSERT(data_ctx.get_size_written() == n_data);
+
+    return file.tell() - offs;
+}
+
+static size_t llama_state_seq_load_log_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_file file(filepath, "rb");
+
+    // version checks
+    {
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+
+        if (magic != LLAMA_STATE_SEQ_LOG_MAGIC || version != LLAMA_STATE_SEQ_LOG_VERSION) {
+            LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state log: %08x, %08x\n", __func__, magic, version);
+            return 0;
+        }
+    }
+
+    const auto records = llama_state_seq_log_read_records(file);
+
+    // replay the last full snapshot and the deltas after it
+    size_t i0 = records.size();
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (records[i].p0 < 0) {
+            i0 = i;
+        }
+    }
+
+    if (i0 == records.size()) {
+        LLAMA_LOG_ERROR("%s: no snapshot in sequence state log\n", __func__);
+        return 0;
+    }
+
+    size_t n_token_count = 0;
+    std::vector<uint8_t> state_data;
+
+    for (size_t i = i0; i < records.size(); ++i) {
+        const auto & rec = records[i];
+
+        if (n_token_count + rec.n_token > n_token_capacity) {
+            llama_kv_cache_seq_rm(ctx->kv_self, dest_seq_id, -1, -1);
+            LLAMA_LOG_ERROR("%s: token count in sequence state log exceeded capacity! %zu > %zu\n", __func__, n_token_count + rec.n_token, n_token_capacity);
+            return 0;
+        }
+
+        file.seek(rec.offs + llama_state_seq_log_record::header_size, SEEK_SET);
+        file.read_raw(tokens_out + n_token_count, rec.n_token*sizeof(llama_token));
+        n_token_count += rec.n_token;
+
+        state_data.resize(rec.n_data);
+        file.read_raw(state_data.data(), rec.n_data);
+
+        const size_t nread = llama_state_seq_set_data_internal(ctx, state_data.data(), dest_seq_id, rec.p0);
+        if (nread != rec.n_data) {
+            llama_kv_cache_seq_rm(ctx->kv_self, dest_seq_id, -1, -1);
+            LLAMA_LOG_ERROR("%s: failed to restore record %zu of sequence state log\n", __func__, i);
+            return 0;
+        }
+    }
+
+    *n_token_count_out = n_token_count;
+
+    return records.back().end();
+}
+
+size_t llama_state_seq_save_log_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    try {
+        return llama_state_seq_save_log_file_internal(ctx, filepath, seq_id, tokens, n_token_count);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving sequence state log: %s\n", err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_load_log_file(struct llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        return llama_state_seq_load_log_file_internal(ctx, filepath, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error loading sequence state log: %s\n", err.what());
+        return 0;
+    }
+}
+
+//
+// compact session files
+//
+// the K/V cache is stored as one chunk per layer and per K/V with one row per cell (V is de-transposed), converted
+// to the requested type and entropy coded per byte plane of the elements
+// the chunk headers hold absolute file offsets and the chunks are 32-byte aligned, so that a mapped file can be
+// decoded in parallel without copying it first
+//
+
+#define LLAMA_STATE_COMPACT_KIND_CONTEXT 0
+#define LLAMA_STATE_COMPACT_KIND_SEQ     1
+
+#define LLAMA_STATE_COMPACT_ALIGNMENT 32
+
+enum llama_state_codec {
+    LLAMA_STATE_CODEC_RAW          = 0,
+    LLAMA_STATE_CODEC_SHUFFLE_RANS = 1,
+};
+
+struct llama_state_kv_chunk {
+    int32_t  type;   // ggml_type of the rows
+    uint32_t codec;  // llama_state_codec
+    uint32_t n_embd; // elements per row
+    uint32_t n_rows; // one row per cell
+    uint64_t offs;   // absolute offset of the data in the file
+    uint64_t size;   // size of the (compressed) data
+};
+
+static_assert(sizeof(llama_state_kv_chunk) == 32, "llama_state_kv_chunk must be 32 bytes");
+
+// order-0 rANS entropy coder, one stream per byte plane of the shuffled elements:
+// u16 freq[256] (sum 1 << LLAMA_STATE_RANS_PROB_BITS), u32 stream size, stream (u32 final state first)
+
+#define LLAMA_STATE_RANS_PROB_BITS 12
+#define LLAMA_STATE_RANS_PROB_SCALE (1u << LLAMA_STATE_RANS_PROB_BITS)
+#define LLAMA_STATE_RANS_L (1u << 23)
+
+static void llama_state_rans_freqs(const uint8_t * src, size_t n, uint16_t * freq) {
+    uint32_t count[256] = {};
+    for (size_t i = 0; i < n; ++i) {
+        count[src[i]]++;
+    }
+
+    int32_t sum = 0;
+    for (int s = 0; s < 256; ++s) {
+        freq[s] = count[s] ? std::max<uint32_t>(1, (uint32_t) ((uint64_t) count[s]*LLAMA_STATE_RANS_PROB_SCALE/n)) : 0;
+        sum += freq[s];
+    }
+
+    // fix the rounding on the most frequent symbols
+    while (sum != (int32_t) LLAMA_STATE_RANS_PROB_SCALE) {
+        int best = -1;
+        for (int s = 0; s < 256; ++s) {
+            if (freq[s] > 1 && (best < 0 || freq[s] > freq[best])) {
+                best = s;
+            }
+        }
+        if (best < 0) {
+            // a single symbol
+            for (int s = 0; s < 256; ++s) {
+                if (freq[s]) {
+                    best = s;
+                }
+            }
+        }
+        if (sum > (int32_t) LLAMA_STATE_RANS_PROB_SCALE) {
+            freq[best]--;
+            sum--;
+        } else {
+            const int32_t add = LLAMA_STATE_RANS_PROB_SCALE - sum;
+            freq[best] += add;
+            sum += add;
+        }
+    }
+}
+
+static void llama_state_rans_encode(const uint8_t * src, size_t n, std::vector<uint8_t> & out) {
+    uint16_t freq[256];
+    uint32_t cum[257];
+
+    llama_state_rans_freqs(src, n, freq);
+
+    cum[0] = 0;
+    for (int s = 0; s < 256; ++s) {
+        cum[s + 1] = cum[s] + freq[s];
+    }
+
+    // the symbols are encoded in reverse so that they are decoded in order
+    // a symbol takes at most LLAMA_STATE_RANS_PROB_BITS bits
+    std::vector<uint8_t> stream(n + n/2 + 16);
+    uint8_t * end = stream.data() + stream.size();
+    uint8_t * ptr = end;
+
+    uint32_t x = LLAMA_STATE_RANS_L;
+    for (size_t i = n; i-- > 0; ) {
+        const uint32_t f = freq[src[i]];
+        const uint32_t x_max = ((LLAMA_STATE_RANS_L >> LLAMA_STATE_RANS_PROB_BITS) << 8) * f;
+        while (x >= x_max) {
+            *--ptr = (uint8_t) (x & 0xff);
+            x >>= 8;
+        }
+        x = ((x / f) << LLAMA_STATE_RANS_PROB_BITS) + (x % f) + cum[src[i]];
+    }
+
+    GGML_ASSERT(ptr - stream.data() >= 4);
+    ptr -= 4;
+    memcpy(ptr, &x, sizeof(x));
+
+    const uint32_t size = end - ptr;
+
+    out.insert(out.end(), (const uint8_t *) freq, (const uint8_t *) (freq + 256));
+    out.insert(out.end(), (const uint8_t *) &size, (const uint8_t *) (&size + 1));
+    out.insert(out.end(), ptr, end);
+}
+
+static bool llama_state_rans_decode(const uint8_t * & ip, const uint8_t * ip_end, uint8_t * dst, size_t n) {
+    uint16_t freq[256];
+    uint32_t cum[256];
+    uint32_t size;
+
+    if ((size_t) (ip_end - ip) < sizeof(freq) + sizeof(size)) {
+        return false;
+    }
+    memcpy(freq,  ip, sizeof(freq)); ip += sizeof(freq);
+    memcpy(&size, ip, sizeof(size)); ip += sizeof(size);
+
+    if (size < 4 || size > (size_t) (ip_end - ip)) {
+        return false;
+    }
+
+    std::vector<uint8_t> sym(LLAMA_STATE_RANS_PROB_SCALE);
+    uint32_t sum = 0;
+    for (int s = 0; s < 256; ++s) {
+        if (freq[s] > LLAMA_STATE_RANS_PROB_SCALE - sum) {
+            return false;
+        }
+        cum[s] = sum;
+        memset(sym.data() + sum, s, freq[s]);
+        sum += freq[s];
+    }
+    if (sum != LLAMA_STATE_RANS_PROB_SCALE) {
+        return false;
+    }
+
+    const uint8_t * ptr = ip;
+    const uint8_t * end = ip + size;
+
+    uint32_t x;
+    memcpy(&x, ptr, sizeof(x)); ptr += sizeof(x);
+
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t slot = x & (LLAMA_STATE_RANS_PROB_SCALE - 1);
+        const uint8_t  s    = sym[slot];
+
+        dst[i] = s;
+
+        x = freq[s] * (x >> LLAMA_STATE_RANS_PROB_BITS) + slot - cum[s];
+        while (x < LLAMA_STATE_RANS_L) {
+            if (ptr == end) {
+                return false;
+            }
+            x = (x << 8) | *ptr++;
+        }
+    }
+
+    ip = end;
+
+    return ptr == end && x == LLAMA_STATE_RANS_L;
+}
+
+// group the bytes of the elements by significance, the sign/exponent bytes of F16/F32 values have a much lower entropy
+static void llama_state_shuffle(const uint8_t * src, uint8_t * dst, size_t n, size_t elem_size) {
+    const size_t n_elem = n / elem_size;
+    for (size_t i = 0; i < n_elem; ++i) {
+        for (size_t b = 0; b < elem_size; ++b) {
+            dst[b*n_elem + i] = src[i*elem_size + b];
+        }
+    }
+}
+
+static void llama_state_unshuffle(const uint8_t * src, uint8_t * dst, size_t n, size_t elem_size) {
+    const size_t n_elem = n / elem_size;
+    for (size_t i = 0; i < n_elem; ++i) {
+        for (size_t b = 0; b < elem_size; ++b) {
+            dst[i*elem_size + b] = src[b*n_elem + i];
+        }
+    }
+}
+
+static void llama_state_compress(const std::vector<uint8_t> & src, size_t elem_size, std::vector<uint8_t> & out) {
+    std::vector<uint8_t> shuffled(src.size());
+    llama_state_shuffle(src.data(), shuffled.data(), src.size(), elem_size);
+
+    const size_t n_plane = src.size() / elem_size;
+
+    out.clear();
+    for (size_t b = 0; b < elem_size && out.size() < src.size(); ++b) {
+        llama_state_rans_encode(shuffled.data() + b*n_plane, n_plane, out);
+    }
+}
+
+static bool llama_state_decompress(const uint8_t * src, size_t n_src, size_t elem_size, std::vector<uint8_t> & out) {
+    std::vector<uint8_t> shuffled(out.size());
+
+    const size_t n_plane = out.size() / elem_size;
+
+    const uint8_t * ip     = src;
+    const uint8_t * ip_end = src + n_src;
+    for (size_t b = 0; b < elem_size; ++b) {
+        if (!llama_state_rans_decode(ip, ip_end, shuffled.data() + b*n_plane, n_plane)) {
+            return false;
+        }
+    }
+    if (ip != ip_end) {
+        return false;
+    }
+
+    llama_state_unshuffle(shuffled.data(), out.data(), out.size(), elem_size);
+
+    return true;
+}
+
+static size_t llama_state_shuffle_elem_size(enum ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32:  return 4;
+        case GGML_TYPE_F16:
+        case GGML_TYPE_BF16: return 2;
+        default:             return 1;
+    }
+}
+
+static void llama_state_to_f32(enum ggml_type type, const uint8_t * src, float * dst, int64_t n) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+        return;
+    }
+
+    const auto traits = ggml_internal_get_type_traits(type);
+    GGML_ASSERT(traits.to_float != nullptr);
+
+    traits.to_float(src, dst, n);
+}
+
+static void llama_state_from_f32(enum ggml_type type, const float * src, uint8_t * dst, int64_t n_rows, int64_t n_embd) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n_rows*n_embd*sizeof(float));
+        return;
+    }
+
+    ggml_quantize_chunk(type, src, dst, 0, n_rows, n_embd, nullptr);
+}
+
+// the type the rows of a cache tensor are stored as
+static enum ggml_type llama_state_chunk_type(enum ggml_type type_cache, enum ggml_type type_kv, uint32_t n_embd) {
+    if (type_kv == GGML_TYPE_COUNT || type_kv == type_cache) {
+        return type_cache;
+    }
+
+    // do not requantize
+    if (type_cache != GGML_TYPE_F32 && type_cache != GGML_TYPE_F16) {
+        return type_cache;
+    }
+
+    if (n_embd % ggml_blck_size(type_kv) != 0 || ggml_quantize_requires_imatrix(type_kv)) {
+        return type_cache;
+    }
+
+    return type_kv;
+}
+
+// copy the rows of the cells in the ranges of a K/V cache tensor, one row per cell
+static void llama_state_kv_get_rows(const llama_kv_cache & kv_self, int il, bool is_v, uint32_t n_embd,
+        const std::vector<std::pair<uint32_t, uint32_t>> & ranges, std::vector<uint8_t> & out) {
+    const ggml_tensor * t = is_v ? kv_self.v_l[il] : kv_self.k_l[il];
+
+    const size_t row_size = ggml_row_size(t->type, n_embd);
+
+    uint32_t n_rows = 0;
+    for (const auto & range : ranges) {
+        n_rows += range.second - range.first;
+    }
+
+    out.resize(n_rows*row_size);
+
+    if (!is_v || !kv_self.v_trans) {
+        size_t offs = 0;
+        for (const auto & range : ranges) {
+            const size_t size = (range.second - range.first)*row_size;
+            ggml_backend_tensor_get(t, out.data() + offs, range.first*row_size, size);
+            offs += size;
+        }
+        return;
+    }
+
+    // v is transposed, gather the elements of each cell
+    const size_t el_size      = ggml_type_size(t->type);
+    const size_t v_row_stride = el_size*kv_self.size;
+
+    std::vector<uint8_t> tmp;
+    for (uint32_t ir = 0; ir < n_embd; ++ir) {
+        uint32_t cell = 0;
+        for (const auto & range : ranges) {
+            const uint32_t n = range.second - range.first;
+            tmp.resize(n*el_size);
+            ggml_backend_tensor_get(t, tmp.data(), ir*v_row_stride + range.first*el_size, tmp.size());
+            for (uint32_t i = 0; i < n; ++i, ++cell) {
+                memcpy(out.data() + cell*row_size + ir*el_size, tmp.data() + i*el_size, el_size);
+            }
+        }
+    }
+}
+
+// set the rows of the cells [cell0, cell0 + n_rows) of a K/V cache tensor
+static void llama_state_kv_set_rows(const llama_kv_cache & kv_self, int il, bool is_v, uint32_t n_embd,
+        uint32_t cell0, uint32_t n_rows, const uint8_t * rows) {
+    ggml_tensor * t = is_v ? kv_self.v_l[il] : kv_self.k_l[il];
+
+    const size_t row_size = ggml_row_size(t->type, n_embd);
+
+    if (!is_v || !kv_self.v_trans) {
+        ggml_backend_tensor_set(t, rows, cell0*row_size, n_rows*row_size);
+        return;
+    }
+
+    // v is transposed, scatter the elements of each cell
+    const size_t el_size      = ggml_type_size(t->type);
+    const size_t v_row_stride = el_size*kv_self.size;
+
+    std::vector<uint8_t> tmp(n_rows*el_size);
+    for (uint32_t ir = 0; ir < n_embd; ++ir) {
+        for (uint32_t i = 0; i < n_rows; ++i) {
+            memcpy(tmp.data() + i*el_size, rows + i*row_size + ir*el_size, el_size);
+        }
+        ggml_backend_tensor_set(t, tmp.data(), ir*v_row_stride + cell0*el_size, tmp.size());
+    }
+}
+
+// run fn(0) .. fn(n_jobs - 1) on up to n_threads threads
+static void llama_state_parallel_for(int n_jobs, int n_threads, const std::function<void(int)> & fn) {
+    n_threads = std::max(1, std::min(n_threads, n_jobs));
+
+    std::mutex mutex;
+    int counter = 0;
+    auto compute = [&]() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            const int job = counter++;
+            lock.unlock();
+            if (job >= n_jobs) {
+                break;
+            }
+            fn(job);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int it = 0; it < n_threads - 1; ++it) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & w : workers) { w.join(); }
+}
+
+static uint32_t llama_state_kv_n_embd(const llama_hparams & hparams, int il, bool is_v) {
+    return is_v ? hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s() : hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
+}
+
+static void llama_state_write_padding(llama_file & file) {
+    static const uint8_t zeros[LLAMA_STATE_COMPACT_ALIGNMENT] = {};
+
+    const size_t pad = GGML_PAD(file.tell(), LLAMA_STATE_COMPACT_ALIGNMENT) - file.tell();
+    if (pad) {
+        file.write_raw(zeros, pad);
+    }
+}
+
+// write the K/V rows of the cells in the ranges: u32 n_chunks, the chunk headers and the aligned chunk data
+static void llama_state_write_kv_compact(struct llama_context * ctx, llama_file & file,
+        const std::vector<std::pair<uint32_t, uint32_t>> & ranges, const llama_state_file_params & params) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    const int n_chunks = 2*hparams.n_layer;
+
+    std::vector<llama_state_kv_chunk> chunks(n_chunks);
+    std::vector<std::vector<uint8_t>> data(n_chunks);
+
+    // the backend tensors are read from the main thread
+    for (int i = 0; i < n_chunks; ++i) {
+        const int  il   = i / 2;
+        const bool is_v = i % 2;
+
+        const uint32_t n_embd = llama_state_kv_n_embd(hparams, il, is_v);
+
+        llama_state_kv_get_rows(kv_self, il, is_v, n_embd, ranges, data[i]);
+
+        auto & chunk = chunks[i];
+        chunk.type   = (is_v ? kv_self.v_l[il] : kv_self.k_l[il])->type;
+        chunk.codec  = LLAMA_STATE_CODEC_RAW;
+        chunk.n_embd = n_embd;
+        chunk.n_rows = data[i].size() / ggml_row_size((enum ggml_type) chunk.type, n_embd);
+    }
+
+    llama_state_parallel_for(n_chunks, ctx->cparams.n_threads, [&](int i) {
+        auto & chunk = chunks[i];
+        auto & buf   = data[i];
+
+        const enum ggml_type type_cache = (enum ggml_type) chunk.type;
+        const enum ggml_type type       = llama_state_chunk_type(type_cache, params.type_kv, chunk.n_embd);
+
+        if (type != type_cache && chunk.n_rows > 0) {
+            std::vector<float> f32(chunk.n_rows*chunk.n_embd);
+            llama_state_to_f32(type_cache, buf.data(), f32.data(), f32.size());
+
+            buf.resize(ggml_row_size(type, chunk.n_embd)*chunk.n_rows);
+            llama_state_from_f32(type, f32.data(), buf.data(), chunk.n_rows, chunk.n_embd);
+        }
+        chunk.type = type;
+
+        if (params.compress && !buf.empty()) {
+            std::vector<uint8_t> compressed;
+            llama_state_compress(buf, llama_state_shuffle_elem_size(type), compressed);
+
+            if (compressed.size() < buf.size()) {
+                buf.swap(compressed);
+                chunk.codec = LLAMA_STATE_CODEC_SHUFFLE_RANS;
+            }
+        }
+
+        chunk.size = buf.size();
+    });
+
+    // lay out the chunk data after the headers
+    size_t offs = GGML_PAD(file.tell() + sizeof(uint32_t) + n_chunks*sizeof(llama_state_kv_chunk), LLAMA_STATE_COMPACT_ALIGNMENT);
+    for (auto & chunk : chunks) {
+        chunk.offs = offs;
+        offs = GGML_PAD(offs + chunk.size, LLAMA_STATE_COMPACT_ALIGNMENT);
+    }
+
+    file.write_u32(n_chunks);
+    file.write_raw(chunks.data(), n_chunks*sizeof(llama_state_kv_chunk));
+
+    for (int i = 0; i < n_chunks; ++i) {
+        llama_state_write_padding(file);
+        GGML_ASSERT(file.tell() == chunks[i].offs);
+        file.write_raw(data[i].data(), data[i].size());
+    }
+}
+
+// a read-only view of a session file, mapped when possible
+struct llama_state_file_view {
+    std::unique_ptr<llama_mmap> mapping;
+    std::vector<uint8_t>        buf;
+
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+    size_t          offs = 0;
+
+    llama_state_file_view(llama_file & file) {
+        if (llama_mmap::SUPPORTED && file.size > 0) {
+            mapping.reset(new llama_mmap(&file));
+            data = (const uint8_t *) mapping->addr;
+        } else {
+            buf.resize(file.size);
+            file.seek(0, SEEK_SET);
+            file.read_raw(buf.data(), buf.size());
+            data = buf.data();
+        }
+        size = file.size;
+    }
+
+    const uint8_t * read(size_t n) {
+        if (n > size - offs) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+        const uint8_t * p = data + offs;
+        offs += n;
+        return p;
+    }
+
+    void read_raw(void * dst, size_t n) {
+        memcpy(dst, read(n), n);
+    }
+
+    uint32_t read_u32() {
+        uint32_t v;
+        read_raw(&v, sizeof(v));
+        return v;
+    }
+};
+
+// read the K/V section and set the rows of the cells [cell0, cell0 + n_rows)
+static bool llama_state_read_kv_compact(struct llama_context * ctx, llama_state_file_view & view, uint32_t cell0, uint32_t n_rows) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    const uint32_t n_chunks = view.read_u32();
+    if (n_chunks != 2*hparams.n_layer) {
+        LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_chunks/2, hparams.n_layer);
+        return false;
+    }
+
+    std::vector<llama_state_kv_chunk> chunks(n_chunks);
+    view.read_raw(chunks.data(), n_chunks*sizeof(llama_state_kv_chunk));
+
+    for (uint32_t i = 0; i < n_chunks; ++i) {
+        const auto & chunk = chunks[i];
+
+        const uint32_t n_embd = llama_state_kv_n_embd(hparams, i / 2, i % 2);
+
+        if (chunk.n_embd != n_embd || chunk.n_rows != n_rows) {
+            LLAMA_LOG_ERROR("%s: mismatched K/V chunk %u (n_embd %u, n_rows %u instead of %u, %u)\n",
+                    __func__, i, chunk.n_embd, chunk.n_rows, n_embd, n_rows);
+            return false;
+        }
+        if (chunk.type < 0 || chunk.type >= GGML_TYPE_COUNT || chunk.codec > LLAMA_STATE_CODEC_SHUFFLE_RANS ||
+            chunk.offs > view.size || chunk.size > view.size - chunk.offs) {
+            LLAMA_LOG_ERROR("%s: invalid K/V chunk %u\n", __func__, i);
+            return false;
+        }
+        if (n_embd % ggml_blck_size((enum ggml_type) chunk.type) != 0 ||
+            (chunk.type != GGML_TYPE_F32 && ggml_internal_get_type_traits((enum ggml_type) chunk.type).to_float == nullptr)) {
+            LLAMA_LOG_ERROR("%s: invalid type %s for K/V chunk %u\n", __func__, ggml_type_name((enum ggml_type) chunk.type), i);
+            return false;
+        }
+    }
+
+    std::vector<std::vector<uint8_t>> data(n_chunks);
+    std::atomic<bool> ok(true);
+
+    llama_state_parallel_for(n_chunks, ctx->cparams.n_threads, [&](int i) {
+        const auto & chunk = chunks[i];
+
+        const int  il   = i / 2;
+        const bool is_v = i % 2;
+
+        const enum ggml_type type       = (enum ggml_type) chunk.type;
+        const enum ggml_type type_cache = (is_v ? kv_self.v_l[il] : kv_self.k_l[il])->type;
+
+        const size_t size = ggml_row_size(type, chunk.n_embd)*chunk.n_rows;
+
+        const uint8_t * src = view.data + chunk.offs;
+
+        std::vector<uint8_t> buf;
+        if (chunk.codec == LLAMA_STATE_CODEC_SHUFFLE_RANS) {
+            buf.resize(size);
+            if (!llama_state_decompress(src, chunk.size, llama_state_shuffle_elem_size(type), buf)) {
+                ok = false;
+                return;
+            }
+        } else {
+            if (chunk.size != size) {
+                ok = false;
+                return;
+            }
+            buf.assign(src, src + size);
+        }
+
+        if (type != type_cache && chunk.n_rows > 0) {
+            std::vector<float> f32(chunk.n_rows*chunk.n_embd);
+            llama_state_to_f32(type, buf.data(), f32.data(), f32.size());
+
+            buf.resize(ggml_row_size(type_cache, chunk.n_embd)*chunk.n_rows);
+            llama_state_from_f32(type_cache, f32.data(), buf.data(), chunk.n_rows, chunk.n_embd);
+        }
+
+        data[i].swap(buf);
+    });
+
+    if (!ok) {
+        LLAMA_LOG_ERROR("%s: failed to decode the K/V chunks\n", __func__);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_chunks; ++i) {
+        if (n_rows > 0) {
+            llama_state_kv_set_rows(kv_self, i / 2, i % 2, chunks[i].n_embd, cell0, n_rows, data[i].data());
+        }
+    }
+
+    return true;
+}
+
+// append to a vector, used for the sections that need their size up front
+struct llama_data_vector_context : llama_data_context {
+    std::vector<uint8_t> & buf;
+
+    llama_data_vector_context(std::vector<uint8_t> & b) : buf(b) {}
+
+    void write(const void * src, size_t size) override {
+        buf.insert(buf.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+    }
+
+    size_t get_size_written() override {
+        return buf.size();
+    }
+};
+
+static void llama_state_write_compact_header(struct llama_context * ctx, llama_file & file, uint32_t kind, const llama_token * tokens, size_t n_token_count) {
+    file.write_u32(LLAMA_STATE_COMPACT_MAGIC);
+    file.write_u32(LLAMA_STATE_COMPACT_VERSION);
+    file.write_u32(kind);
+
+    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+}
+
+// reads the header after the magic, returns false on a mismatch
+static bool llama_state_read_compact_header(struct llama_context * ctx, llama_state_file_view & view, uint32_t kind,
+        llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    const uint32_t version = view.read_u32();
+    const uint32_t kind_file = view.read_u32();
+
+    if (version != LLAMA_STATE_COMPACT_VERSION || kind_file != kind) {
+        LLAMA_LOG_ERROR("%s: unknown (version, kind) for compact session file: %u, %u\n", __func__, version, kind_file);
+        return false;
+    }
+
+    llama_hparams session_hparams;
+    view.read_raw(&session_hparams, sizeof(llama_hparams));
+
+    if (session_hparams != ctx->model.hparams) {
+        LLAMA_LOG_ERROR("%s: model hparams didn't match from session file!\n", __func__);
+        return false;
+    }
+
+    const uint32_t n_token_count = view.read_u32();
+
+    if (n_token_count > n_token_capacity) {
+        LLAMA_LOG_ERROR("%s: token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+        return false;
+    }
+
+    view.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+    *n_token_count_out = n_token_count;
+
+    return true;
+}
+
+static bool llama_state_save_file_compact(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, const llama_state_file_params & params) {
+    llama_synchronize(ctx);
+
+    const auto & kv_self = ctx->kv_self;
+    if (kv_self.recurrent) {
+        LLAMA_LOG_ERROR("%s: compact session files are not supported for recurrent models\n", __func__);
+        return false;
+    }
+
+    llama_file file(path_session, "wb");
+
+    llama_state_write_compact_header(ctx, file, LLAMA_STATE_COMPACT_KIND_CONTEXT, tokens, n_token_count);
+
+    llama_data_file_context data_ctx(&file);
+    llama_state_write_rng(ctx, &data_ctx);
+
+    // the logits and embeddings are only needed to sample without evaluating a token first
+    {
+        std::vector<uint8_t> outputs;
+        if (params.outputs) {
+            llama_data_vector_context outputs_ctx(outputs);
+            llama_state_write_outputs(ctx, &outputs_ctx);
+        }
+
+        const uint64_t outputs_size = outputs.size();
+        file.write_raw(&outputs_size, sizeof(outputs_size));
+        file.write_raw(outputs.data(), outputs.size());
+    }
+
+    const uint32_t kv_head = llama_kv_cache_cell_max(kv_self);
+    const uint32_t kv_used = kv_self.used;
+
+    file.write_u32(kv_head);
+    file.write_u32(kv_used);
+
+    for (uint32_t i = 0; i < kv_head; ++i) {
+        const auto & cell = kv_self.cells[i];
+
+        const llama_pos pos   = cell.pos;
+        const uint32_t  n_seq = cell.seq_id.size();
+
+        file.write_raw(&pos, sizeof(pos));
+        file.write_u32(n_seq);
+
+        for (auto seq_id : cell.seq_id) {
+            file.write_raw(&seq_id, sizeof(seq_id));
+        }
+    }
+
+    llama_state_write_kv_compact(ctx, file, { { 0, kv_head } }, params);
+
+    return true;
+}
+
+static bool llama_state_load_file_compact(struct llama_context * ctx, llama_file & file, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_synchronize(ctx);
+
+    auto & kv_self = ctx->kv_self;
+    if (kv_self.recurrent) {
+        LLAMA_LOG_ERROR("%s: compact session files are not supported for recurrent models\n", __func__);
+        return false;
+    }
+
+    llama_state_file_view view(file);
+    view.read(sizeof(uint32_t)); // magic
+
+    if (!llama_state_read_compact_header(ctx, view, LLAMA_STATE_COMPACT_KIND_CONTEXT, tokens_out, n_token_capacity, n_token_count_out)) {
+        return false;
+    }
+
+    // rng
+    {
+        const uint8_t * rng = view.read(sizeof(size_t));
+
+        size_t rng_size;
+        memcpy(&rng_size, rng, sizeof(rng_size));
+
+        if (rng_size > LLAMA_MAX_RNG_STATE) {
+            LLAMA_LOG_ERROR("%s: invalid rng state size %zu\n", __func__, rng_size);
+            return false;
+        }
+        view.read(rng_size);
+
+        llama_state_read_rng(ctx, rng);
+    }
+
+    // outputs
+    {
+        uint64_t outputs_size;
+        view.read_raw(&outputs_size, sizeof(outputs_size));
+
+        if (outputs_size > view.size - view.offs) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+
+        if (outputs_size > 0) {
+            const uint8_t * outputs = view.read(outputs_size);
+            if (llama_state_read_outputs(ctx, outputs) != outputs + outputs_size) {
+                LLAMA_LOG_ERROR("%s: invalid outputs in session file\n", __func__);
+                return false;
+            }
+        } else {
+            ctx->n_outputs = 0;
+        }
+    }
+
+    const uint32_t kv_head = view.read_u32();
+    const uint32_t kv_used = view.read_u32();
+
+    if (kv_head > kv_self.size) {
+        LLAMA_LOG_ERROR("%s: the session file contains %u KV cells but the context only has %u\n", __func__, kv_head, kv_self.size);
+        return false;
+    }
+
+    llama_kv_cache_clear(ctx);
+
+    for (uint32_t i = 0; i < kv_head; ++i) {
+        llama_pos pos;
+        view.read_raw(&pos, sizeof(pos));
+
+        const uint32_t n_seq = view.read_u32();
+
+        auto & cell = kv_self.cells[i];
+        cell.pos = pos;
+
+        for (uint32_t j = 0; j < n_seq; ++j) {
+            llama_seq_id seq_id;
+            view.read_raw(&seq_id, sizeof(seq_id));
+
+            if (seq_id < 0 || (uint32_t) seq_id >= ctx->cparams.n_seq_max) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id %d, must be in [0, %u)\n", __func__, seq_id, ctx->cparams.n_seq_max);
+                llama_kv_cache_clear(ctx);
+                return false;
+            }
+            cell.seq_id.insert(seq_id);
+        }
+    }
+
+    if (!llama_state_read_kv_compact(ctx, view, 0, kv_head)) {
+        llama_kv_cache_clear(ctx);
+        return false;
+    }
+
+    kv_self.head = kv_head;
+    kv_self.used = kv_used;
+
+    return true;
+}
+
+static size_t llama_state_seq_save_file_compact(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count, const llama_state_file_params & params) {
+    llama_synchronize(ctx);
+
+    const auto & kv_self = ctx->kv_self;
+    if (kv_self.recurrent) {
+        LLAMA_LOG_ERROR("%s: compact session files are not supported for recurrent models\n", __func__);
+        return 0;
+    }
+
+    llama_file file(filepath, "wb");
+
+    llama_state_write_compact_header(ctx, file, LLAMA_STATE_COMPACT_KIND_SEQ, tokens, n_token_count);
+
+    uint32_t cell_count;
+    const auto cell_ranges = llama_state_seq_cell_ranges(kv_self, seq_id, -1, cell_count);
+
+    file.write_u32(cell_count);
+    for (const auto & range : cell_ranges) {
+        for (uint32_t i = range.first; i < range.second; ++i) {
+            const llama_pos pos = kv_self.cells[i].pos;
+            file.write_raw(&pos, sizeof(pos));
+        }
+    }
+
+    llama_state_write_kv_compact(ctx, file, cell_ranges, params);
+
+    return file.tell();
+}
+
+static size_t llama_state_seq_load_file_compact(struct llama_context * ctx, llama_file & file, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_synchronize(ctx);
+
+    auto & kv_self = ctx->kv_self;
+    if (kv_self.recurrent) {
+        LLAMA_LOG_ERROR("%s: compact session files are not supported for recurrent models\n", __func__);
+        return 0;
+    }
+
+    llama_state_file_view view(file);
+    view.read(sizeof(uint32_t)); // magic
+
+    if (!llama_state_read_compact_header(ctx, view, LLAMA_STATE_COMPACT_KIND_SEQ, tokens_out, n_token_capacity, n_token_count_out)) {
+        return 0;
+    }
+
+    const uint32_t cell_count = view.read_u32();
+
+    std::vector<llama_pos> pos(cell_count);
+    view.read_raw(pos.data(), cell_count*sizeof(llama_pos));
+
+    llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+
+    if (cell_count == 0) {
+        return view.size;
+    }
+
+    if (!llama_state_seq_alloc_cells(kv_self, dest_seq_id, pos.data(), cell_count)) {
+        LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
+        return 0;
+    }
+
+    if (!llama_state_read_kv_compact(ctx, view, kv_self.head, cell_count)) {
+        llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+        return 0;
+    }
+
+    return view.size;
+}
+
+bool llama_state_save_file_ext(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, struct llama_state_file_params params) {
+    try {
+        return llama_state_save_file_compact(ctx, path_session, tokens, n_token_count, params);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
+        return false;
+    }
+}
+
+size_t llama_state_seq_save_file_ext(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count, struct llama_state_file_params params) {
+    try {
+        return llama_state_seq_save_file_compact(ctx, filepath, seq_id, tokens, n_token_count, params);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving sequence state file: %s\n", err.what());
+        return 0;
+    }
+}
+
+void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
+    ctx->cparams.n_threads       = n_threads;
+    ctx->cparams.n_threads_batch = n_threads_batch;
+}
+
+uint32_t llama_n_threads(struct llama_context * ctx) {
+    return ctx->cparams.n_threads;
+}
+
+uint32_t llama_n_threads_batch(struct llama_context * ctx) {
+    return ctx->cparams.n_threads_batch;
+}
+
+void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
+    ctx->abort_callback      = abort_callback;
+    ctx->abort_callback_data = abort_callback_data;
+}
+
+void llama_set_profiler(struct llama_context * ctx, struct ggml_profiler * profiler) {
+    ctx->profiler = profiler;
+}
+
+void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
+    ctx->cparams.embeddings = embeddings;
+}
+
+void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
+    ctx->cparams.causal_attn = causal_attn;
+}
+
+struct llama_batch llama_batch_get_one(
+             llama_token * tokens,
+                 int32_t   n_tokens,
+               llama_pos   pos_0,
+            llama_seq_id   seq_id) {
+    return {
+        /*n_tokens       =*/ n_tokens,
+        /*tokens         =*/ tokens,
+        /*embd           =*/ nullptr,
+        /*pos            =*/ nullptr,
+        /*n_seq_id       =*/ nullptr,
+        /*seq_id         =*/ nullptr,
+        /*logits         =*/ nullptr,
+        /*all_pos_0      =*/ pos_0,
+        /*all_pos_1      =*/ 1,
+        /*all_seq_id     =*/ seq_id,
+    };
+}
+
+struct llama_batch llama_batch_init(int32_t n_tokens_alloc, int32_t embd, int32_t n_seq_max) {
+    llama_batch batch = { 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, 0, };
+
+    if (embd) {
+        batch.embd = (float *) malloc(sizeof(float) * n_tokens_alloc * embd);
+    } else {
+        batch.token = (llama_token *) malloc(sizeof(llama_token) * n_tokens_alloc);
+    }
+
+    batch.pos      = (llama_pos *)     malloc(sizeof(llama_pos)      * n_tokens_alloc);
+    batch.n_seq_id = (int32_t *)       malloc(sizeof(int32_t)        * n_tokens_alloc);
+    batch.seq_id   = (llama_seq_id **) malloc(sizeof(llama_seq_id *) * (n_tokens_alloc + 1));
+    for (int i = 0; i < n_tokens_alloc; ++i) {
+        batch.seq_id[i] = (llama_seq_id *) malloc(sizeof(llama_seq_id) * n_seq_max);
+    }
+    batch.seq_id[n_tokens_alloc] = nullptr;
+
+    batch.logits   = (int8_t *)        malloc(sizeof(int8_t)         * n_tokens_alloc);
+
+    return batch;
 }
 
 void llama_batch_free(struct llama_batch batch) {
@@ -21002,6 +22812,14 @@ float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i) {
 }
 
 float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id) {
+    if (ctx->cparams.embd_type != LLAMA_EMBD_TYPE_F32) {
+        return nullptr;
+    }
+
+    return (float *) llama_get_embeddings_seq_data(ctx, seq_id);
+}
+
+const void * llama_get_embeddings_seq_data(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
     auto it = ctx->embd_seq.find(seq_id);
@@ -21012,6 +22830,20 @@ float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id
     return it->second.data();
 }
 
+size_t llama_embd_seq_size(const struct llama_context * ctx) {
+    const int64_t n_embd = ctx->model.hparams.n_embd;
+
+    switch (ctx->cparams.embd_type) {
+        case LLAMA_EMBD_TYPE_F32:    return n_embd*sizeof(float);
+        case LLAMA_EMBD_TYPE_F16:    return n_embd*sizeof(ggml_fp16_t);
+        case LLAMA_EMBD_TYPE_INT8:   return n_embd*sizeof(int8_t);
+        case LLAMA_EMBD_TYPE_BINARY: return (n_embd + 7)/8;
+    }
+
+    GGML_ASSERT(false && "unknown embd type");
+    return 0;
+}
+
 const char * llama_token_get_text(const struct llama_model * model, llama_token token) {
     GGML_ASSERT(model->vocab.type != LLAMA_VOCAB_TYPE_NONE);
     return model->vocab.id_to_token[token].text.c_str();
@@ -21107,6 +22939,136 @@ int32_t llama_tokenize(
     return res.size();
 }
 
+// splitting the text right after a newline that is surrounded by non-whitespace codepoints gives the same tokens as
+// tokenizing the whole text, provided that no special token overlaps the split point and that the tokenizer never
+// merges across such a newline (llama_vocab::can_split_at_newline)
+static bool llama_tokenize_is_split_point(const llama_vocab & vocab, const std::string & text, size_t pos, bool parse_special) {
+    if (pos < 2 || pos >= text.size() || text[pos - 1] != '\n') {
+        return false;
+    }
+
+    // [ini, end) spans the codepoints before and after the newline
+    size_t ini = pos - 2;
+    while (ini > 0 && (text[ini] & 0xC0) == 0x80) {
+        ini--;
+    }
+    size_t end = pos;
+
+    try {
+        size_t offs = ini;
+        if (unicode_cpt_flags(unicode_cpt_from_utf8(text, offs)).is_whitespace || offs != pos - 1) {
+            return false;
+        }
+        if (unicode_cpt_flags(unicode_cpt_from_utf8(text, end)).is_whitespace) {
+            return false;
+        }
+    } catch (const std::invalid_argument & /*e*/) {
+        return false;
+    }
+
+    if (parse_special) {
+        for (const llama_vocab::id special_id : vocab.cache_special_tokens) {
+            const auto & special_token = vocab.id_to_token[special_id].text;
+            const size_t n = special_token.size();
+            if (n == 0) {
+                continue;
+            }
+            for (size_t i = ini >= n - 1 ? ini - (n - 1) : 0; i < end && i + n <= text.size(); ++i) {
+                if (text.compare(i, n, special_token) == 0) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static std::vector<llama_vocab::id> llama_tokenize_parallel_internal(const llama_vocab & vocab, std::string raw_text, bool add_special, bool parse_special, int32_t n_threads) {
+    // do not bother with chunks smaller than this
+    const size_t min_chunk_size = 64*1024;
+
+    const size_t n_chunks = std::min<size_t>(std::max(n_threads, 1), raw_text.size() / min_chunk_size);
+    if (n_chunks <= 1 || !vocab.can_split_at_newline) {
+        return llama_tokenize_internal(vocab, std::move(raw_text), add_special, parse_special);
+    }
+
+    // chunk boundaries - the first split point after each even split position
+    std::vector<size_t> bounds = { 0 };
+    for (size_t i = 1; i < n_chunks; ++i) {
+        const size_t pos_end = (i + 1)*raw_text.size()/n_chunks;
+        for (size_t pos = std::max(i*raw_text.size()/n_chunks, bounds.back()); pos < pos_end; ++pos) {
+            pos = raw_text.find('\n', pos);
+            if (pos == std::string::npos || pos + 1 >= pos_end) {
+                break;
+            }
+            if (llama_tokenize_is_split_point(vocab, raw_text, pos + 1, parse_special)) {
+                bounds.push_back(pos + 1);
+                break;
+            }
+        }
+    }
+    bounds.push_back(raw_text.size());
+
+    const size_t n_parts = bounds.size() - 1;
+    if (n_parts == 1) {
+        return llama_tokenize_internal(vocab, std::move(raw_text), add_special, parse_special);
+    }
+
+    LLAMA_LOG_INFO("%s: tokenizing %zu bytes in %zu chunks\n", __func__, raw_text.size(), n_parts);
+
+    std::vector<std::future<std::vector<llama_vocab::id>>> results;
+    results.reserve(n_parts);
+    for (size_t i = 0; i < n_parts; ++i) {
+        results.emplace_back(std::async(std::launch::async, [&, i] {
+            return llama_tokenize_internal(vocab, raw_text.substr(bounds[i], bounds[i + 1] - bounds[i]), add_special, parse_special, i == 0, i == n_parts - 1);
+        }));
+    }
+
+    std::vector<std::vector<llama_vocab::id>> parts;
+    parts.reserve(n_parts);
+    size_t n_tokens = 0;
+    for (auto & result : results) {
+        parts.push_back(result.get());
+        n_tokens += parts.back().size();
+    }
+
+    std::vector<llama_vocab::id> output;
+    output.reserve(n_tokens);
+    for (const auto & part : parts) {
+        output.insert(output.end(), part.begin(), part.end());
+    }
+
+    // the BOS/EOS of the whole text are only known after joining the parts
+    if (add_special && vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        llm_tokenizer_bpe(vocab).check_double_bos_eos(output);
+    }
+
+    return output;
+}
+
+int32_t llama_tokenize_parallel(
+    const struct llama_model * model,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    auto res = llama_tokenize_parallel_internal(model->vocab, std::string(text, text_len), add_special, parse_special, n_threads);
+    if (n_tokens_max < (int) res.size()) {
+        // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
+        return -((int) res.size());
+    }
+
+    for (size_t i = 0; i < res.size(); i++) {
+        tokens[i] = res[i];
+    }
+
+    return res.size();
+}
+
 static std::string llama_decode_text(const std::string & text) {
     std::string decoded_text;
 
@@ -1,31 +1,18 @@
-#if defined(_MSC_VER)
-#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
-#endif
-
 #include "unicode.h"
 #include "unicode-data.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstddef>
 #include <cstdint>
 #include <map>
-#include <regex>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
-#include <locale>
-#include <codecvt>
-
-static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> & cps) {
-    std::string result;
-    for (size_t i = 0; i < cps.size(); ++i) {
-        result.append(unicode_cpt_to_utf8(cps[i]));
-    }
-    return result;
-}
 
 uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
     assert(offset < utf8.size());
@@ -193,36 +180,11 @@ static std::unordered_map<std::string, uint8_t> unicode_utf8_to_byte_map() {
     return map;
 }
 
-static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
-    return conv.from_bytes(s);
-}
-
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
-    }
-    return bpe_encoded_words;
-}
-
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -335,12 +297,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 system regex is the same, except that it uses \p{N} instead of \p{N}{1,3} (n_digits_max = 1)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const size_t n_digits_max) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -412,7 +373,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= n_digits_max) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -475,79 +436,259 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
     return bpe_offsets;
 }
 
-// use std::wregex to split the text
-static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
-    std::wregex expr(regex_expr);
-    std::vector<size_t> bpe_offsets; // store the offset of each word
-    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
-    size_t start = 0;
-    for (auto offset : offsets) {
-        std::wcregex_iterator it(wtext.data() + start, wtext.data() + start + offset, expr);
-        std::wcregex_iterator end;
-
-        int64_t start_idx = 0;
-        while (it != end) {
-            std::wcmatch match = *it;
-            if (match.position() > start_idx) {
-                bpe_offsets.emplace_back(match.position() - start_idx);
+// character class of a pre-tokenizer regex, e.g. [\p{P}\$\+<=>\^~\|]
+// the matching follows the semantics of the std::regex implementation that these splitters replace:
+//  - non-ASCII whitespace is treated as a single (ASCII) whitespace and does not match any literal codepoint
+//  - \p{L}, \p{N}, \p{P} and \s are resolved through the codepoint flags
+struct unicode_cpt_class {
+    bool     negated    = false;
+    uint16_t categories = 0;     // codepoint_flags::NUMBER | LETTER | PUNCTUATION
+    bool     whitespace = false; // \s
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // [first, last]
+
+    bool contains(const uint32_t cpt, const codepoint_flags flags) const {
+        return negated != contains_raw(cpt, flags);
+    }
+
+private:
+    bool contains_raw(uint32_t cpt, const codepoint_flags flags) const {
+        if (flags.is_whitespace) {
+            if (whitespace) {
+                return true;
+            }
+            cpt = cpt < 128 ? cpt : 0x0B;
+        } else if (flags.as_uint() & categories) {
+            return true;
+        }
+        for (const auto & range : ranges) {
+            if (range.first <= cpt && cpt <= range.second) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+static bool unicode_regex_parse_category(const std::string & expr, size_t & pos, uint16_t & category) {
+    static const std::map<std::string, uint16_t> k_ucat_enum = {
+        { "\\p{N}", codepoint_flags::NUMBER },
+        { "\\p{L}", codepoint_flags::LETTER },
+        { "\\p{P}", codepoint_flags::PUNCTUATION },
+    };
+
+    if (expr.compare(pos, 3, "\\p{") != 0 || pos + 5 > expr.size()) {
+        return false;
+    }
+    const auto it = k_ucat_enum.find(expr.substr(pos, 5));
+    if (it == k_ucat_enum.end()) {
+        return false;
+    }
+    category = it->second;
+    pos += 5;
+    return true;
+}
+
+// parse a [...] class starting at expr[pos], on success pos is moved past the closing bracket
+static bool unicode_regex_parse_class(const std::string & expr, size_t & pos, unicode_cpt_class & cls) {
+    if (pos >= expr.size() || expr[pos] != '[') {
+        return false;
+    }
+    pos++;
+
+    if (pos < expr.size() && expr[pos] == '^') {
+        cls.negated = true;
+        pos++;
+    }
+
+    // read a single (possibly escaped) codepoint
+    auto read_cpt = [&](uint32_t & cpt) -> bool {
+        if (expr[pos] == '\\') {
+            if (pos + 1 >= expr.size()) {
+                return false;
+            }
+            switch (expr[pos + 1]) {
+                case 'r': cpt = '\r'; break;
+                case 'n': cpt = '\n'; break;
+                case 't': cpt = '\t'; break;
+                default:
+                    if (isalnum((unsigned char) expr[pos + 1])) {
+                        return false; // unknown escape sequence
+                    }
+                    cpt = (unsigned char) expr[pos + 1];
+                    break;
             }
-            bpe_offsets.emplace_back(match.length());
-            start_idx = match.position() + match.length();
-            ++it;
+            pos += 2;
+            return true;
         }
+        cpt = unicode_cpt_from_utf8(expr, pos);
+        return true;
+    };
 
-        if (start_idx < (int64_t) offset) {
-            bpe_offsets.emplace_back(offset - start_idx);
+    while (pos < expr.size() && expr[pos] != ']') {
+        uint16_t category = 0;
+        if (unicode_regex_parse_category(expr, pos, category)) {
+            cls.categories |= category;
+            continue;
         }
-        start += offset;
+        if (expr.compare(pos, 2, "\\s") == 0) {
+            cls.whitespace = true;
+            pos += 2;
+            continue;
+        }
+
+        uint32_t first = 0;
+        if (!read_cpt(first)) {
+            return false;
+        }
+        uint32_t last = first;
+        if (pos + 1 < expr.size() && expr[pos] == '-' && expr[pos + 1] != ']') {
+            pos++;
+            if (!read_cpt(last)) {
+                return false;
+            }
+        }
+        cls.ranges.emplace_back(first, last);
     }
 
-    return bpe_offsets;
+    if (pos >= expr.size()) {
+        return false;
+    }
+    pos++; // ]
+    return true;
 }
 
-// use std::regex to split the text
-static std::vector<size_t> unicode_regex_split_stl(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::regex expr(regex_expr);
+// generic driver: match() returns the length of the match starting at pos (0 if there is none)
+// every match becomes a word and so does every unmatched gap between matches, same as a regex search
+template <typename F>
+static std::vector<size_t> unicode_regex_split_custom_search(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, F && match) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
     size_t start = 0;
     for (auto offset : offsets) {
-        std::cregex_iterator it(text.data() + start, text.data() + start + offset, expr);
-        std::cregex_iterator end;
-
-        int64_t start_idx = 0;
-        while (it != end) {
-            std::cmatch match = *it;
-            if (match.position() > start_idx) {
-                bpe_offsets.emplace_back(match.position() - start_idx);
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        size_t gap_ini = offset_ini;
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/ ) {
+            const size_t len = match(pos, offset_end);
+            if (len == 0) {
+                pos++;
+                continue;
+            }
+            if (pos > gap_ini) {
+                bpe_offsets.push_back(pos - gap_ini);
             }
-            bpe_offsets.emplace_back(match.length());
-            start_idx = match.position() + match.length();
-            ++it;
+            bpe_offsets.push_back(len);
+            pos += len;
+            gap_ini = pos;
         }
-
-        if (start_idx < (int64_t) offset) {
-            bpe_offsets.emplace_back(offset - start_idx);
+        if (offset_end > gap_ini) {
+            bpe_offsets.push_back(offset_end - gap_ini);
         }
-        start += offset;
     }
 
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::vector<size_t> bpe_offsets;
+// regex: <prefix>?<class>+ where <prefix> is one of "\s?", " ?" or empty and the "+" is optional
+// e.g. "[\r\n]", "\p{N}", "\s?\p{L}+", " ?[^(\s|.,!?…。，、।۔،)]+", "[一-龥ࠀ-一가-퟿]+"
+static bool unicode_regex_split_custom_class(const std::vector<uint32_t> & cpts, const std::string & regex_expr, std::vector<size_t> & offsets) {
+    size_t pos = 0;
+
+    enum { PREFIX_NONE, PREFIX_WHITESPACE, PREFIX_SPACE } prefix = PREFIX_NONE;
+    if (regex_expr.compare(0, 3, "\\s?") == 0) {
+        prefix = PREFIX_WHITESPACE;
+        pos += 3;
+    } else if (regex_expr.compare(0, 2, " ?") == 0) {
+        prefix = PREFIX_SPACE;
+        pos += 2;
+    }
+
+    unicode_cpt_class cls;
+    uint16_t category = 0;
+    if (unicode_regex_parse_category(regex_expr, pos, category)) {
+        cls.categories = category;
+    } else if (!unicode_regex_parse_class(regex_expr, pos, cls)) {
+        return false;
+    }
 
+    bool repeat = false;
+    if (pos < regex_expr.size() && regex_expr[pos] == '+') {
+        repeat = true;
+        pos++;
+    }
+
+    if (pos != regex_expr.size()) {
+        return false;
+    }
+
+    offsets = unicode_regex_split_custom_search(cpts, offsets, [&](const size_t ini, const size_t end) -> size_t {
+        auto _in_class = [&](const size_t p) -> bool {
+            return p < end && cls.contains(cpts[p], unicode_cpt_flags(cpts[p]));
+        };
+
+        size_t p = ini;
+        if (prefix != PREFIX_NONE && _in_class(p + 1) &&
+            (prefix == PREFIX_SPACE ? cpts[p] == ' ' : unicode_cpt_flags(cpts[p]).is_whitespace)) {
+            p++;
+        }
+        if (!_in_class(p)) {
+            return 0;
+        }
+        p++;
+        while (repeat && _in_class(p)) {
+            p++;
+        }
+        return p - ini;
+    });
+
+    return true;
+}
+
+static bool unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, std::vector<size_t> & offsets) {
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        offsets = unicode_regex_split_custom_llama3(cpts, offsets, 3);
+    } else if (
+            regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+
+        offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1);
+    } else if (regex_expr == "[0-9][0-9][0-9]") {
+        offsets = unicode_regex_split_custom_search(cpts, offsets, [&](const size_t ini, const size_t end) -> size_t {
+            for (size_t p = ini; p < ini + 3; ++p) {
+                if (p >= end || cpts[p] < '0' || cpts[p] > '9') {
+                    return 0;
+                }
+            }
+            return 3;
+        });
+    } else if (regex_expr == "\\s+$") {
+        // the match is the maximal whitespace suffix of the segment - find its start once per segment
+        size_t suffix_ini = 0;
+        size_t suffix_end = SIZE_MAX;
+        offsets = unicode_regex_split_custom_search(cpts, offsets, [&](const size_t ini, const size_t end) -> size_t {
+            if (end != suffix_end) {
+                suffix_end = end;
+                suffix_ini = end;
+                while (suffix_ini > ini && unicode_cpt_flags(cpts[suffix_ini - 1]).is_whitespace) {
+                    suffix_ini--;
+                }
+            }
+            return ini == suffix_ini && ini < end ? end - ini : 0;
+        });
+    } else {
+        return unicode_regex_split_custom_class(cpts, regex_expr, offsets);
     }
 
-    return bpe_offsets;
+    return true;
 }
 
 //
@@ -637,176 +778,42 @@ uint32_t unicode_tolower(uint32_t cp) {
 }
 
 std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
-    // unicode categories
-    static const std::map<std::string, int> k_ucat_enum = {
-        { "\\p{N}", codepoint_flags::NUMBER },
-        { "\\p{L}", codepoint_flags::LETTER },
-        { "\\p{P}", codepoint_flags::PUNCTUATION },
-    };
-
-    static const std::map<int, int> k_ucat_cpt = {
-        { codepoint_flags::NUMBER,        0xD1 },
-        { codepoint_flags::LETTER,        0xD2 },
-        { codepoint_flags::PUNCTUATION,   0xD3 },
-    };
-
-    static const std::map<int, std::string> k_ucat_map = {
-        { codepoint_flags::NUMBER,        "\x30-\x39" }, // 0-9
-        { codepoint_flags::LETTER,        "\x41-\x5A\x61-\x7A" }, // A-Za-z
-        { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
-    };
-
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
-    // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
-    // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
-    std::string text_collapsed;
-    if (need_collapse) {
-        // collapse all unicode categories
-        text_collapsed.resize(cpts.size());
-
-        for (size_t i = 0; i < cpts.size(); ++i) {
-            // keep single-byte codepoints as is
-            if (cpts[i] < 128) {
-                text_collapsed[i] = cpts[i];
-                continue;
-            }
-
-            const auto flags = unicode_cpt_flags(cpts[i]);
-
-            if (flags.is_whitespace) {
-                //NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
-                //text_collapsed[i] = (char) 0x85;  // <Next Line> as whitespace fallback
-                text_collapsed[i] = (char) 0x0B;    // <vertical tab> as whitespace fallback
-            } else if (k_ucat_cpt.find(flags.category_flag()) != k_ucat_cpt.end()) {
-                text_collapsed[i] = k_ucat_cpt.at(flags.category_flag());
-            } else {
-                text_collapsed[i] = (char) 0xD0; // fallback
-            }
-        }
-    }
-
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
     for (auto & regex_expr : regex_exprs) {
-        // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
-
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
-        }
-
-        // fallback to general-purpose std::regex / std::wregex
-        try {
-            // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
-            // with the corresponding collapsed representation
-            bool use_collapsed = false;
-            for (auto & ucat : k_ucat_enum) {
-                if (std::string::npos != regex_expr.find(ucat.first)) {
-                    use_collapsed = true;
-                    break;
-                }
-            }
-
-            if (use_collapsed) {
-                // sanity-check that the original regex does not contain any non-ASCII characters
-                const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
-                for (size_t i = 0; i < cpts_regex.size(); ++i) {
-                    if (cpts_regex[i] >= 128) {
-                        throw std::runtime_error("Regex includes both unicode categories and non-ASCII characters - not supported");
-                    }
-                }
-
-                // generate a collapsed representation of the regex
-                std::string regex_expr_collapsed;
-
-                // track if we are inside [], because nested [] are not allowed
-                bool inside = false;
-                for (size_t i = 0; i < regex_expr.size(); ++i) {
-                    if (regex_expr[i] == '[' && (i == 0 || regex_expr[i - 1] != '\\')) {
-                        regex_expr_collapsed += '[';
-                        inside = true;
-                        continue;
-                    }
-
-                    if (inside && regex_expr[i] == ']' && regex_expr[i - 1] != '\\') {
-                        regex_expr_collapsed += ']';
-                        inside = false;
-                        continue;
-                    }
-
-                    if (regex_expr[i + 0] == '\\' && i + 4 < regex_expr.size() &&
-                        regex_expr[i + 1] == 'p' &&
-                        regex_expr[i + 2] == '{' &&
-                        regex_expr[i + 4] == '}') {
-                        const std::string pat = regex_expr.substr(i, 5);
-                        if (k_ucat_enum.find(pat) != k_ucat_enum.end()) {
-                            if (!inside) {
-                                regex_expr_collapsed += '[';
-                            }
-                            regex_expr_collapsed += k_ucat_cpt.at(k_ucat_enum.at(pat));
-                            regex_expr_collapsed += k_ucat_map.at(k_ucat_enum.at(pat));
-                            if (!inside) {
-                                regex_expr_collapsed += ']';
-                            }
-                            i += 4;
-                            continue;
-                        }
-                    }
-
-                    regex_expr_collapsed += regex_expr[i];
-                }
-
-                //printf("text_collapsed: %s\n", text_collapsed.c_str());
-                //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
-            } else {
-                // no unicode category used, we can use std::wregex directly
-                const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
-
-                // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
-                std::wstring wtext(cpts.begin(), cpts.end());
-                for (size_t i = 0; i < wtext.size(); ++i) {
-                    if (wtext[i] > 0x7F && unicode_cpt_flags(wtext[i]).is_whitespace) {
-                        wtext[i] = 0x0B;
-                    }
-                }
-
-                //printf("text: %s\n", text.c_str());
-                //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
-            }
-        } catch (std::regex_error & e) {
+        // all pre-tokenizer regexes have a custom implementation
+        if (!unicode_regex_split_custom(cpts, regex_expr, bpe_offsets)) {
             fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
-            fprintf(stderr, "Regex error: %s\n", e.what());
-            throw std::runtime_error("Failed to process regex");
+            throw std::runtime_error("Unsupported regex");
         }
     }
 
+    // byte-level encoding of the words
+    static const auto byte_to_utf8 = []() {
+        std::vector<std::string> table(256);
+        for (int ch = 0; ch < 256; ++ch) {
+            table[ch] = unicode_byte_to_utf8(ch);
+        }
+        return table;
+    }();
+
     std::vector<std::string> bpe_words;
     bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
 
     size_t start = 0;
     for (size_t & offset : bpe_offsets) {
         bpe_words.emplace_back();
+        auto & word = bpe_words.back();
+        word.reserve(2*offset);
         for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                word += byte_to_utf8[(uint8_t) c];
+            }
         }
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
@@ -0,0 +1,101 @@
+// Checks the vectorized softmax helpers of ggml against a double precision reference
+// and reports the time per row at the vocabulary sizes of current models
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// the loop that the callers of ggml_log_sum_exp_f32 used to have
+static float log_sum_exp_scalar(const float * x, int n) {
+    float max = x[0];
+    for (int i = 1; i < n; ++i) {
+        max = std::max(max, x[i]);
+    }
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        sum += expf(x[i] - max);
+    }
+    return max + log(sum);
+}
+
+static double log_sum_exp_ref(const float * x, int n) {
+    double max = *std::max_element(x, x + n);
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        sum += exp(x[i] - max);
+    }
+    return max + log(sum);
+}
+
+template <typename F>
+static double time_per_row_us(F && f, int n_rows) {
+    const int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_rows; ++i) {
+        f(i);
+    }
+    return double(ggml_time_us() - t_start)/n_rows;
+}
+
+int main(void) {
+    ggml_time_init();
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    // accuracy, including sizes that are not a multiple of the SIMD width
+    for (int n : { 1, 3, 17, 255, 256, 257, 1000, 32000 }) {
+        std::vector<float> x(n);
+        for (auto & v : x) {
+            v = dist(rng);
+        }
+        x[n/2] += 30.0f; // a dominant logit, as after a confident prediction
+
+        const double ref = log_sum_exp_ref(x.data(), n);
+        const float  lse = ggml_log_sum_exp_f32(x.data(), n);
+        if (std::fabs(lse - ref) > 1e-5*std::max(1.0, std::fabs(ref))) {
+            fprintf(stderr, "ggml_log_sum_exp_f32: n = %d, got %.7f, expected %.7f\n", n, lse, ref);
+            return 1;
+        }
+
+        std::vector<float> y(n);
+        const float max = *std::max_element(x.begin(), x.end());
+        const float sum = ggml_exp_sum_f32(x.data(), y.data(), n, max);
+        double sum_y = 0.0;
+        for (int i = 0; i < n; ++i) {
+            const double p_ref = exp(x[i] - ref);
+            if (std::fabs(y[i]/sum - p_ref) > 1e-6) {
+                fprintf(stderr, "ggml_exp_sum_f32: n = %d, p[%d] = %.8f, expected %.8f\n", n, i, y[i]/sum, p_ref);
+                return 1;
+            }
+            sum_y += y[i];
+        }
+        assert(std::fabs(sum_y - sum) <= 1e-5*sum);
+    }
+
+    printf("%10s %14s %14s %8s\n", "n_vocab", "scalar us/row", "ggml us/row", "speedup");
+    for (int n_vocab : { 32000, 128256, 256000 }) {
+        const int n_rows = 16;
+        std::vector<float> logits((size_t) n_rows*n_vocab);
+        for (auto & v : logits) {
+            v = dist(rng);
+        }
+
+        volatile float sink = 0.0f;
+        const double t_scalar = time_per_row_us([&](int i) { sink = sink + log_sum_exp_scalar  (logits.data() + (size_t) i*n_vocab, n_vocab); }, n_rows);
+        const double t_ggml   = time_per_row_us([&](int i) { sink = sink + ggml_log_sum_exp_f32(logits.data() + (size_t) i*n_vocab, n_vocab); }, n_rows);
+
+        printf("%10d %14.1f %14.1f %7.1fx\n", n_vocab, t_scalar, t_ggml, t_scalar/t_ggml);
+    }
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 #include <vector>
 
@@ -169,14 +170,25 @@ int main(int /*argc*/, const char ** /*argv*/) {
         //  33,  34,  35, ..., 105
         struct ggml_tensor * r2 = ggml_rope(ctx0, x,  p2, n_rot, mode);
 
+        // same as r2, with the positions up to 63 read from a precomputed table
+        struct ggml_tensor * table = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_rot, 64);
+        ggml_rope_yarn_table((float *) table->data, 0, table->ne[1], n_rot, 0, NULL, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+
+        struct ggml_tensor * r3 = ggml_rope(ctx0, x,  p2, n_rot, mode);
+        ggml_rope_set_table(r3, table);
+
         ggml_cgraph * gf = ggml_new_graph(ctx0);
 
         ggml_build_forward_expand(gf, r0);
         ggml_build_forward_expand(gf, r1);
         ggml_build_forward_expand(gf, r2);
+        ggml_build_forward_expand(gf, r3);
 
         ggml_graph_compute_helper(work_buffer, gf, 4);
 
+        // check that the table gives the same results as computing the cos/sin
+        GGML_ASSERT(memcmp(r2->data, r3->data, ggml_nbytes(r2)) == 0);
+
         // check that r1 and r2 are the same
         {
             double sum0 = 0.0f;
@@ -0,0 +1,183 @@
+#include "llama.h"
+#include "common.h"
+#include "console.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks that llama_tokenize_parallel gives exactly the same tokens as llama_tokenize on a large text
+// built from the test strings of the vocab (the .inp file used by test-tokenizer-0)
+//
+// the number of chunks is taken from the log of llama_tokenize_parallel, so that the test fails if the text is
+// not actually split - or, with --no-split, if a vocab that cannot be split is split anyway
+
+static size_t g_n_chunks = 0;
+
+static void log_callback(ggml_log_level level, const char * text, void * user_data) {
+    (void) level;
+    (void) user_data;
+
+    const std::string msg = text;
+    const size_t pos = msg.find(" chunks\n");
+    if (msg.find("llama_tokenize_parallel_internal") == 0 && pos != std::string::npos) {
+        g_n_chunks = std::stoul(msg.substr(msg.rfind(' ', pos - 1) + 1));
+    }
+
+    fputs(text, stderr);
+    fflush(stderr);
+}
+
+static std::vector<std::string> read_inputs(const std::string & fname_inp) {
+    std::vector<std::string> sinp;
+
+    std::ifstream ifs_inp(fname_inp);
+    if (!ifs_inp) {
+        fprintf(stderr, "%s : error: could not open file '%s'\n", __func__, fname_inp.c_str());
+        return sinp;
+    }
+
+    std::string sraw((std::istreambuf_iterator<char>(ifs_inp)), std::istreambuf_iterator<char>());
+
+    const std::string sep = "\n__ggml_vocab_test__\n";
+
+    size_t pos = 0;
+    while (pos < sraw.size()) {
+        const size_t next = sraw.find(sep, pos);
+        if (next == std::string::npos) {
+            sinp.push_back(sraw.substr(pos));
+            break;
+        }
+        sinp.push_back(sraw.substr(pos, next - pos));
+        pos = next + sep.size();
+    }
+
+    return sinp;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s vocab-file [--no-split]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    const bool expect_split = !(argc > 2 && std::string(argv[2]) == "--no-split");
+
+    llama_log_set(log_callback, nullptr);
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_model * model;
+    llama_context * ctx;
+
+    llama_backend_init();
+
+    // load the vocab
+    {
+        auto mparams = llama_model_default_params();
+
+        mparams.vocab_only = true;
+
+        model = llama_load_model_from_file(fname.c_str(), mparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        auto cparams = llama_context_default_params();
+
+        ctx = llama_new_context_with_model(model, cparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+#ifdef _WIN32
+    // We need this for unicode console support
+    console::init(false, false);
+    atexit([]() { console::cleanup(); });
+#endif
+
+    std::vector<std::string> inputs = read_inputs(fname + ".inp");
+    if (inputs.empty()) {
+        fprintf(stderr, "%s : error: no tests found\n", __func__);
+        return 1;
+    }
+
+    // special tokens around the newlines exercise the split point checks
+    for (const llama_token id : { llama_token_bos(model), llama_token_eos(model) }) {
+        if (id != -1) {
+            inputs.push_back(llama_token_to_piece(ctx, id, true));
+            inputs.push_back(llama_token_to_piece(ctx, id, true) + "\n" + llama_token_to_piece(ctx, id, true));
+        }
+    }
+
+    // build a text of ~256 kB by joining random test strings with separators
+    std::string text;
+    {
+        const std::vector<std::string> seps = { "\n", "\n\n", " ", "", "\nx", "x\n", " \n " };
+
+        std::mt19937 rng(42);
+        while (text.size() < 256*1024) {
+            text += inputs[rng() % inputs.size()];
+            text += seps[rng() % seps.size()];
+        }
+    }
+
+    bool success = true;
+
+    for (const bool add_special : { false, true }) {
+        for (const bool parse_special : { false, true }) {
+            const std::vector<llama_token> ref = llama_tokenize(ctx, text, add_special, parse_special);
+
+            for (const int n_threads : { 1, 3, 4 }) {
+                g_n_chunks = 1;
+
+                const std::vector<llama_token> res = llama_tokenize_parallel(ctx, text, add_special, parse_special, n_threads);
+
+                const bool correct = res == ref;
+
+                printf("add_special = %d, parse_special = %d, n_threads = %d: %zu tokens, %zu chunks - %s\n",
+                        add_special, parse_special, n_threads, res.size(), g_n_chunks, correct ? "OK" : "FAILED");
+
+                const bool split = g_n_chunks > 1;
+                if (split != (expect_split && n_threads > 1)) {
+                    fprintf(stderr, "%s : error: expected the text to be %s, got %zu chunks\n", __func__,
+                            split ? "tokenized in one piece" : "split", g_n_chunks);
+                    success = false;
+                }
+
+                if (!correct) {
+                    for (size_t i = 0; i < std::min(res.size(), ref.size()); ++i) {
+                        if (res[i] != ref[i]) {
+                            fprintf(stderr, "%s : first mismatch at token %zu: %d '%s' instead of %d '%s'\n", __func__, i,
+                                    res[i], llama_token_to_piece(ctx, res[i]).c_str(),
+                                    ref[i], llama_token_to_piece(ctx, ref[i]).c_str());
+                            break;
+                        }
+                    }
+                    success = false;
+                }
+            }
+        }
+    }
+
+    llama_free_model(model);
+    llama_free(ctx);
+
+    llama_backend_free();
+
+    printf("\n");
+    printf("Tests %s\n", success ? "passed" : "failed");
+
+    return success ? 0 : 3;
+}